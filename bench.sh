@@ -0,0 +1,142 @@
+#!/bin/bash
+#
+# bench.sh - make synthetic trees and time synclink on them.
+#
+# Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.# See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+# MA 02110-1301, USA.
+#
+# Each run makes a tree with mkbenchtree, syncs it, then syncs it again
+# with nothing left to do. Both syncs report their wall time, cpu times
+# and peak RSS, and the time of each phase from synclink -M; with -C
+# their syscalls too. Runs on tmpfs and, when run as root, on an ext4
+# loop image.
+#
+# Usage: bench.sh [-n files] [-d depth] [-f fanout] [-H hugedir files]
+#                 [-s filesize] [-l link%] [-c copy%] [-e extra%]
+#                 [-t "tmpfs ext4"] [-i imagesize] [-C] [-- synclink args]
+#
+# make bench runs it with BENCHFLAGS.
+
+SYNCLINK=${SYNCLINK:-./synclink}
+MKBENCHTREE=${MKBENCHTREE:-./mkbenchtree}
+GENARGS=()
+FSTYPES="tmpfs ext4"
+IMGSIZE=4G
+COUNT=0
+
+usage() {
+	sed -n '/^# Usage/,/^#$/p' "$0" | sed -n 's/^# //p' >&2
+	exit 1
+}
+
+while getopts "n:d:f:H:s:l:c:e:t:i:Ch" opt
+do
+	case $opt in
+	n|d|f|H|s|l|c|e) GENARGS+=("-$opt" "$OPTARG") ;;
+	t) FSTYPES=$OPTARG ;;
+	i) IMGSIZE=$OPTARG ;;
+	C) COUNT=1 ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+SLARGS=("$@")
+
+for prog in "$SYNCLINK" "$MKBENCHTREE"
+do
+	if [[ ! -x $prog ]]
+	then
+		echo "$prog not built, try make bench." >&2
+		exit 1
+	fi
+done
+
+# Show the seconds of each phase that took any from the -M file.
+phases() {
+	local label=$1 file=$2
+	[[ -s $file ]] || return
+	grep -o '"[a-z_]*":{"seconds":[0-9.]*' "$file" |
+		sed 's/^"\([a-z_]*\)":{"seconds":\(.*\)/\1 \2/' |
+		awk -v label="$label" '$2 > 0 {printf "%s: %8.3fs %s\n", label, $2, $1}'
+}
+
+# Sync, or if counting syscalls sync under strace and show its totals.
+timedsync() {
+	local label=$1 dir=$2
+	rm -f "$dir/metrics.json"
+	if [[ $COUNT == 1 ]]
+	then
+		if ! command -v strace >/dev/null
+		then
+			echo "strace not found, not counting syscalls." >&2
+			COUNT=0
+		fi
+	fi
+	if [[ $COUNT == 1 ]]
+	then
+		"$MKBENCHTREE" -r "$label" strace -f -c -o "$dir/strace.txt" \
+			"$SYNCLINK" -M "$dir/metrics.json" "${SLARGS[@]}" \
+			"$dir/tree/src" "$dir/tree/dst"
+		echo "$label: syscalls $(awk '/total/ {print $4}' "$dir/strace.txt")"
+		sort -k4 -n -r "$dir/strace.txt" | awk 'NF >= 5 && $NF != "total"' |
+			head -5 | sed "s/^/$label:   /"
+	else
+		"$MKBENCHTREE" -r "$label" "$SYNCLINK" -M "$dir/metrics.json" \
+			"${SLARGS[@]}" "$dir/tree/src" "$dir/tree/dst"
+	fi
+	phases "$label" "$dir/metrics.json"
+}
+
+# Make the tree in dir and time both syncs.
+benchin() {
+	local fs=$1 dir=$2
+	echo "== $fs: mkbenchtree ${GENARGS[*]}"
+	"$MKBENCHTREE" "${GENARGS[@]}" "$dir/tree" || return 1
+	sync
+	# cold caches if allowed, as they would be in production.
+	echo 3 > /proc/sys/vm/drop_caches 2>/dev/null
+	timedsync "$fs sync" "$dir"
+	timedsync "$fs resync" "$dir"
+}
+
+for fs in $FSTYPES
+do
+	case $fs in
+	tmpfs)
+		dir=$(mktemp -d /dev/shm/synclink-bench.XXXXXX) || exit 1
+		benchin tmpfs "$dir"
+		rm -rf "$dir"
+		;;
+	ext4)
+		if [[ $(id -u) != 0 ]] || ! command -v mkfs.ext4 >/dev/null
+		then
+			echo "== ext4: skipped, needs root and mkfs.ext4." >&2
+			continue
+		fi
+		img=$(mktemp /var/tmp/synclink-bench.XXXXXX) || exit 1
+		dir=$(mktemp -d /var/tmp/synclink-bench.XXXXXX) || exit 1
+		truncate -s "$IMGSIZE" "$img"
+		mkfs.ext4 -q -F "$img" &&
+			mount -o loop "$img" "$dir" &&
+			benchin ext4 "$dir"
+		umount "$dir" 2>/dev/null
+		rm -rf "$img" "$dir"
+		;;
+	*)
+		echo "Unknown file system: $fs" >&2
+		;;
+	esac
+done
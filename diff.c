@@ -0,0 +1,536 @@
+/*    diff.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of diff.[h|c] is to compare a source and a destination
+ * listing and to produce the list of actions that will make the
+ * destination a hard linked copy of the source.
+ * */
+
+#include <stddef.h>
+#include "diff.h"
+#include "srt.h"
+
+actlist
+*init_actlist(void)
+{ /* An empty action list. */
+	actlist *al = xmalloc(sizeof(actlist));
+	memset(al, 0, sizeof(actlist));
+	return al;
+} // init_actlist()
+
+void
+free_actlist(actlist *al)
+{ /* Free al, the paths belong to the listings or the plan. */
+	free(al->acts);
+	free(al);
+} // free_actlist()
+
+void
+addaction(actlist *al, unsigned char op, char *path)
+{ /* Append an action to al, growing al as needed. */
+	if (al->count == al->limit) {
+		al->limit = (al->limit) ? al->limit * 2 : 1024;
+		al->acts = realloc(al->acts, al->limit * sizeof(action));
+		if (!al->acts) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	al->acts[al->count].path = path;
+	al->acts[al->count].fl = NULL;
+	al->acts[al->count].op = op;
+	al->count++;
+} // addaction()
+
+void
+addentaction(actlist *al, unsigned char op, fslist *fl, size_t ent)
+{ /* Append an action on the path of entry ent of fl. The path is not
+   * made until it is needed, listings hold names only.
+  */
+	addaction(al, op, NULL);
+	al->acts[al->count - 1].fl = fl;
+	al->acts[al->count - 1].ent = ent;
+} // addentaction()
+
+void
+copyaction(actlist *al, action *act)
+{ /* Append a copy of act to al. */
+	addaction(al, act->op, act->path);
+	al->acts[al->count - 1].fl = act->fl;
+	al->acts[al->count - 1].ent = act->ent;
+} // copyaction()
+
+char
+*actpath(action *act, char *buf)
+{ /* Put the path of act in buf, which must hold PATH_MAX, and return
+   * buf.
+  */
+	if (act->path) return strcpy(buf, act->path);
+	return fspath(act->fl, act->ent, buf);
+} // actpath()
+
+/* A cursor keeps the path of the current entry of a sorted listing,
+ * each path being made from its parent's as the list is walked.
+ * */
+typedef struct fscursor {
+	fslist *fl;
+	size_t i;
+	int depth;
+	size_t ents[PATH_MAX / 2];	// the entries whose names are in path
+	size_t ends[PATH_MAX / 2];	// and where each ends.
+	char path[PATH_MAX];
+} fscursor;
+
+static void
+cursorpath(fscursor *c)
+{ /* Make the path of entry c->i from that of its dir, which being
+   * sorted is on the stack.
+  */
+	if (c->i >= c->fl->count) return;
+	fsent *fe = &c->fl->ents[c->i];
+	while (c->depth && c->ents[c->depth - 1] != fe->parent) c->depth--;
+	size_t pos = (c->depth) ? c->ends[c->depth - 1] : 0;
+	size_t len = strlen(fe->name);
+	if (pos + len + 2 > PATH_MAX || c->depth == PATH_MAX / 2) {
+		fprintf(stderr, "%s/%s: path too long\n", c->path, fe->name);
+		exit(EXIT_FAILURE);
+	}
+	if (pos) c->path[pos++] = '/';
+	memcpy(c->path + pos, fe->name, len + 1);
+	c->ents[c->depth] = c->i;
+	c->ends[c->depth++] = pos + len;
+} // cursorpath()
+
+void
+difffslists(fslist *src, fslist *dst, actlist *al)
+{ /* Both lists must be sorted ascending. Walks them together once and
+   * appends to al what must be done to dst. Nothing is stat'd; the
+   * types and inodes recorded by the walk are all that is needed.
+   * The actions come out in ascending path order so that, run in list
+   * order, every mkdir precedes what goes in it, and run in reverse
+   * order every rmdir follows the removal of what was in it. They
+   * refer to the listings, which must outlive al.
+  */
+	fscursor *sc = xmalloc(sizeof(fscursor));
+	fscursor *dc = xmalloc(sizeof(fscursor));
+	memset(sc, 0, offsetof(fscursor, ents));
+	memset(dc, 0, offsetof(fscursor, ents));
+	sc->fl = src;
+	dc->fl = dst;
+	cursorpath(sc);
+	cursorpath(dc);
+	size_t *i = &sc->i, *j = &dc->i;
+	while (*i < src->count || *j < dst->count) {
+		int res;
+		if (*i == src->count) res = 1;
+		else if (*j == dst->count) res = -1;
+		else res = cmppath(sc->path, dc->path);
+		if (res <= 0) {
+			fsent *s = &src->ents[*i];
+			fsent *d = (res == 0) ? &dst->ents[*j] : NULL;
+			if (!d) {	// only in src.
+				addentaction(al, (s->type == DT_DIR)
+								? ACT_MKDIR : ACT_LINK, src, *i);
+			} else if (s->type != d->type) {	// one kind by another.
+				addentaction(al, (d->type == DT_DIR)
+								? ACT_RMDIR : ACT_UNLINK, dst, *j);
+				addentaction(al, (s->type == DT_DIR)
+								? ACT_MKDIR : ACT_LINK, src, *i);
+			} else if (s->type == DT_REG &&
+						(s->ino != d->ino || s->dev != d->dev)) {
+				addentaction(al, ACT_RELINK, src, *i);	// a copy.
+			}
+			(*i)++;
+			cursorpath(sc);
+			if (res < 0) continue;
+		} else {	// only in dst.
+			addentaction(al, (dst->ents[*j].type == DT_DIR)
+							? ACT_RMDIR : ACT_UNLINK, dst, *j);
+		}
+		(*j)++;
+		cursorpath(dc);
+	}
+	free(sc);
+	free(dc);
+} // difffslists()
+
+/* The src files al is to link, by inode, for findrenames() to look up
+ * the dst files it is to unlink. Open addressing, at most half full.
+ * */
+typedef struct inomap {
+	fsent *ents;	// of the src listing.
+	size_t *slots;	// entry indexes, NOPARENT if empty.
+	size_t mask;
+} inomap;
+
+static size_t
+inoslot(inomap *im, dev_t dev, ino_t ino)
+{ /* The slot that has, or would have, the entry with dev and ino, or
+   * NOPARENT if it is not there and there is no room for it.
+  */
+	uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32)) *
+					11400714819323198485ULL;
+	size_t s = (size_t)(h >> 17) & im->mask, n;
+	for (n = 0; n <= im->mask; n++) {
+		if (im->slots[s] == NOPARENT) return s;
+		fsent *fe = &im->ents[im->slots[s]];
+		if (fe->ino == ino && fe->dev == dev) return s;
+		s = (s + 1) & im->mask;
+	}
+	return NOPARENT;
+} // inoslot()
+
+enum {	// what findrenames() notes of each entry.
+	RN_GONE = 1,	// a dst entry al removes.
+	RN_NEW = 1,		// a src entry al links or makes,
+	RN_HELD = 2,	// where dst has one of the other kind, or the copy
+					// a relink replaces.
+	RN_MOVED = 4,	// the from or to of a rename.
+	RN_MADE = 8		// a dir made for the to of a rename.
+};
+
+static size_t
+*growsizes(size_t *a, size_t *limit)
+{ /* Double the room in a, which has *limit. */
+	*limit = (*limit) ? *limit * 2 : 256;
+	a = realloc(a, *limit * sizeof(size_t));
+	if (!a) {
+		fputs("Out of memory.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	return a;
+} // growsizes()
+
+static int
+cmpsize(const void *p1, const void *p2)
+{ /* For qsort() ascending on size_t. */
+	size_t a = *(const size_t *)p1, b = *(const size_t *)p2;
+	return (a > b) - (a < b);
+} // cmpsize()
+
+static int
+movedabove(fslist *fl, unsigned char *flags, size_t i)
+{ /* Whether a dir that entry i is in is the from or to of a rename. */
+	size_t p;
+	for (p = fl->ents[i].parent; p != NOPARENT; p = fl->ents[p].parent)
+		if (flags[p] & RN_MOVED) return 1;
+	return 0;
+} // movedabove()
+
+renames
+*findrenames(fslist *src, fslist *dst, actlist *al)
+{ /* Find in what al, from difffslists(), would remove from dst what is
+   * only to be linked or made again at another path. A dst file is
+   * that of a src file if it has its inode, being a link to it. A dst
+   * dir is that of a src dir if a file in it went there under the same
+   * name, and their dirs too as long as those have the same names.
+   * Nothing is renamed to where dst has something, and nothing in a dir
+   * that is renamed is renamed again. The dirs a rename needs that dst
+   * has not are to be made first. Done, the renames leave what al would
+   * remove from under a renamed dir or put in it, see renamefslist().
+  */
+	renames *rn = xmalloc(sizeof(renames));
+	memset(rn, 0, sizeof(renames));
+	size_t ns = src->count, nd = dst->count, i, k, nfiles = 0;
+	unsigned char *sf = xmalloc(ns + 1), *df = xmalloc(nd + 1);
+	memset(sf, 0, ns + 1);
+	memset(df, 0, nd + 1);
+	char p1[PATH_MAX], p2[PATH_MAX];
+	for (k = 0; k < al->count; k++) {
+		action *act = &al->acts[k];
+		if (!act->fl) continue;
+		if (act->fl == dst) {
+			df[act->ent] |= RN_GONE;
+			continue;
+		}
+		sf[act->ent] |= RN_NEW;
+		// where dst has a copy, a rename would lose it unchecked.
+		if (act->op == ACT_RELINK) sf[act->ent] |= RN_HELD;
+		// one kind by another: the dst action just precedes it.
+		action *prev = (k) ? &al->acts[k - 1] : NULL;
+		if (prev && prev->fl == dst &&
+				strcmp(fspath(dst, prev->ent, p1),
+						fspath(src, act->ent, p2)) == 0)
+			sf[act->ent] |= RN_HELD;
+	}
+	// only files to be linked where dst has nothing may be renamed to.
+	for (i = 0; i < ns; i++)
+		if (src->ents[i].type == DT_REG && sf[i] == RN_NEW) nfiles++;
+	if (!nfiles) goto done;
+	inomap im;
+	im.ents = src->ents;
+	for (im.mask = 1; im.mask < 2 * nfiles; im.mask <<= 1) ;
+	im.slots = xmalloc(im.mask * sizeof(size_t));
+	memset(im.slots, 0xff, im.mask * sizeof(size_t));	// NOPARENT.
+	im.mask--;
+	for (i = 0; i < ns; i++) {
+		fsent *fe = &src->ents[i];
+		if (fe->type != DT_REG || sf[i] != RN_NEW) continue;
+		size_t s = inoslot(&im, fe->dev, fe->ino);
+		if (s != NOPARENT && im.slots[s] == NOPARENT) im.slots[s] = i;
+	}
+	size_t j;
+	for (j = 0; j < nd; j++) {
+		fsent *de = &dst->ents[j];
+		if (de->type != DT_REG || !(df[j] & RN_GONE)) continue;
+		size_t s = inoslot(&im, de->dev, de->ino);
+		i = (s == NOPARENT) ? NOPARENT : im.slots[s];
+		if (i == NOPARENT || sf[i] != RN_NEW) continue;
+		size_t from = j, to = i, pj = de->parent, pi = src->ents[i].parent;
+		// the dirs too, while they also go from one place to the other.
+		while (pj != NOPARENT && pi != NOPARENT &&
+				dst->ents[pj].type == DT_DIR && df[pj] == RN_GONE &&
+				src->ents[pi].type == DT_DIR && sf[pi] == RN_NEW &&
+				strcmp(dst->ents[from].name, src->ents[to].name) == 0) {
+			from = pj;
+			to = pi;
+			pj = dst->ents[pj].parent;
+			pi = src->ents[pi].parent;
+		}
+		if (from != j && ((df[from] | sf[to]) & RN_MOVED)) {
+			if (df[from] & sf[to] & RN_MOVED) continue;	// found already.
+			from = j;	// the dirs went elsewhere, the file may not have.
+			to = i;
+		}
+		if ((df[from] | sf[to]) & RN_MOVED) continue;
+		df[from] |= RN_MOVED;
+		sf[to] |= RN_MOVED;
+		if (rn->count == rn->limit) {
+			size_t limit = rn->limit;
+			rn->from = growsizes(rn->from, &limit);
+			rn->to = growsizes(rn->to, &rn->limit);
+		}
+		rn->from[rn->count] = from;
+		rn->to[rn->count++] = to;
+	}
+	free(im.slots);
+	// drop what is in what is renamed, and what lands where it can not.
+	size_t n = 0;
+	for (k = 0; k < rn->count; k++) {
+		size_t from = rn->from[k], to = rn->to[k], p;
+		int keep = !movedabove(dst, df, from) && !movedabove(src, sf, to);
+		for (p = src->ents[to].parent; keep && p != NOPARENT &&
+				(sf[p] & RN_NEW); p = src->ents[p].parent)
+			if (sf[p] & RN_HELD) keep = 0;
+		if (!keep) continue;
+		rn->from[n] = from;
+		rn->to[n++] = to;
+	}
+	rn->count = n;
+	for (k = 0; k < rn->count; k++) {	// the dirs to make for them.
+		size_t p;
+		for (p = src->ents[rn->to[k]].parent; p != NOPARENT &&
+				(sf[p] & RN_NEW) && !(sf[p] & RN_MADE);
+				p = src->ents[p].parent) {
+			sf[p] |= RN_MADE;
+			if (rn->nmkdirs == rn->mlimit)
+				rn->mkdirs = growsizes(rn->mkdirs, &rn->mlimit);
+			rn->mkdirs[rn->nmkdirs++] = p;
+		}
+	}
+	// the listing is in tree order, so parents come first.
+	if (rn->nmkdirs) qsort(rn->mkdirs, rn->nmkdirs, sizeof(size_t), cmpsize);
+done:
+	free(sf);
+	free(df);
+	return rn;
+} // findrenames()
+
+void
+free_renames(renames *rn)
+{ /* Free what findrenames() made. */
+	free(rn->from);	// any may be NULL, so not vfree().
+	free(rn->to);
+	free(rn->mkdirs);
+	free(rn);
+} // free_renames()
+
+void
+renamefslist(fslist *src, fslist *dst, renames *rn)
+{ /* Make dst the listing of what it lists once the dirs of rn are made
+   * and its renames done, sorted. Diffed with src again, it then gives
+   * only what the renames did not do.
+  */
+	if (!rn->count && !rn->nmkdirs) return;
+	size_t nd = dst->count, k;
+	char path[PATH_MAX];
+	/* The dst entry of the dir of each made dir and each renamed entry,
+	 * found before dst is changed. A dir to be made is nd + its place in
+	 * mkdirs, as that is where it goes. */
+	size_t *mp = xmalloc((rn->nmkdirs + 1) * sizeof(size_t));
+	size_t *rp = xmalloc((rn->count + 1) * sizeof(size_t));
+	for (k = 0; k < rn->nmkdirs + rn->count; k++) {
+		size_t s = (k < rn->nmkdirs) ? rn->mkdirs[k]
+										: rn->to[k - rn->nmkdirs];
+		size_t p = src->ents[s].parent, d = NOPARENT;
+		if (p != NOPARENT) {
+			size_t *m = (!rn->nmkdirs) ? NULL :
+						bsearch(&p, rn->mkdirs, rn->nmkdirs, sizeof(size_t),
+								cmpsize);
+			if (m) d = nd + (m - rn->mkdirs);
+			else d = (size_t)findfslist(dst, fspath(src, p, path));
+		}
+		if (k < rn->nmkdirs) mp[k] = d;
+		else rp[k - rn->nmkdirs] = d;
+	}
+	for (k = 0; k < rn->nmkdirs; k++) {
+		fsent fe;
+		memset(&fe, 0, sizeof(fsent));
+		fe.type = DT_DIR;
+		fe.nlink = 2;
+		fe.parent = mp[k];
+		addfslist(dst, src->ents[rn->mkdirs[k]].name, &fe);
+	}
+	for (k = 0; k < rn->count; k++) {
+		fsent *fe = &dst->ents[rn->from[k]];
+		fe->name = arenastr(dst->ar, src->ents[rn->to[k]].name);
+		fe->parent = rp[k];
+	}
+	vfree(mp, rp, NULL);
+	sortfslist(dst, 0);
+} // renamefslist()
+
+/* The rmdirs diffruns() has put off until the walk leaves the dir, and
+ * whether a link to the src file that replaces it is to follow.
+ * */
+typedef struct rmstack {
+	char *paths;	// nul separated.
+	size_t used;
+	size_t size;
+	size_t *offs;
+	int *thenlink;
+	size_t n;
+	size_t limit;
+} rmstack;
+
+static void
+pushrmdir(rmstack *rs, const char *path, int thenlink)
+{ /* Put off the rmdir of path. */
+	size_t len = strlen(path) + 1;
+	if (rs->used + len > rs->size || rs->n == rs->limit) {
+		rs->size = (rs->size + len) * 2;
+		rs->limit = (rs->limit) ? rs->limit * 2 : 64;
+		rs->paths = realloc(rs->paths, rs->size);
+		rs->offs = realloc(rs->offs, rs->limit * sizeof(size_t));
+		rs->thenlink = realloc(rs->thenlink, rs->limit * sizeof(int));
+		if (!rs->paths || !rs->offs || !rs->thenlink) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(rs->paths + rs->used, path, len);
+	rs->offs[rs->n] = rs->used;
+	rs->thenlink[rs->n++] = thenlink;
+	rs->used += len;
+} // pushrmdir()
+
+static void
+poprmdirs(rmstack *rs, const char *path, act_emit emit, void *arg)
+{ /* Emit the rmdirs put off of the dirs path is not in, the deepest
+   * first, or all of them if path is NULL.
+  */
+	while (rs->n) {
+		char *dir = rs->paths + rs->offs[rs->n - 1];
+		size_t len = strlen(dir);
+		if (path && strncmp(path, dir, len) == 0 && path[len] == '/')
+			return;
+		rs->n--;
+		emit(arg, ACT_RMDIR, dir);
+		if (rs->thenlink[rs->n]) emit(arg, ACT_LINK, dir);
+		rs->used = rs->offs[rs->n];
+	}
+} // poprmdirs()
+
+void
+diffruns(runmerge *src, runmerge *dst, act_emit emit, void *arg)
+{ /* As difffslists() on the entries of two trees as merged from their
+   * runs, handing each action to emit() as it is found. The order is
+   * ascending except that an rmdir comes after all that is done in the
+   * dir, followed by the link that replaces it if any. So the actions
+   * may be done a batch at a time, cut anywhere, each batch in the
+   * order applyactions() does them with rmdirsafter set. What is held
+   * grows with the depth of the trees, not their size.
+  */
+	rmstack rs;
+	memset(&rs, 0, sizeof(rmstack));
+	runrec *s = runs_next(src), *d = runs_next(dst);
+	while (s || d) {
+		int res;
+		if (!s) res = 1;
+		else if (!d) res = -1;
+		else res = cmppath(s->path, d->path);
+		poprmdirs(&rs, (res <= 0) ? s->path : d->path, emit, arg);
+		if (res <= 0) {
+			if (res < 0) {	// only in src.
+				emit(arg, (s->type == DT_DIR) ? ACT_MKDIR : ACT_LINK,
+						s->path);
+			} else if (s->type != d->type) {	// one kind by another.
+				if (d->type == DT_DIR) {	// the link waits for the rmdir.
+					pushrmdir(&rs, d->path, 1);
+				} else {
+					emit(arg, ACT_UNLINK, d->path);
+					emit(arg, ACT_MKDIR, s->path);
+				}
+			} else if (s->type == DT_REG &&
+						(s->ino != d->ino || s->dev != d->dev)) {
+				emit(arg, ACT_RELINK, s->path);	// a copy.
+			}
+			s = runs_next(src);
+			if (res < 0) continue;
+		} else if (d->type == DT_DIR) {	// only in dst.
+			pushrmdir(&rs, d->path, 0);
+		} else {
+			emit(arg, ACT_UNLINK, d->path);
+		}
+		d = runs_next(dst);
+	}
+	poprmdirs(&rs, NULL, emit, arg);
+	vfree(rs.paths, rs.offs, rs.thenlink, NULL);
+} // diffruns()
+
+const char
+*actname(unsigned char op)
+{ /* Printable name of op. */
+	switch(op) {
+	case ACT_MKDIR:
+		return "mkdir";
+	case ACT_LINK:
+		return "link";
+	case ACT_RELINK:
+		return "relink";
+	case ACT_UNLINK:
+		return "unlink";
+	case ACT_RMDIR:
+		return "rmdir";
+	}
+	return "unknown";
+} // actname()
+
+void
+dumpactlist(const char *tmpfn, actlist *al)
+{ /* Write the actions in al, one per line, to tmpfn. */
+	FILE *fpo = dofopen(tmpfn, "w");
+	char path[PATH_MAX];
+	size_t i;
+	for (i = 0; i < al->count; i++)
+		fprintf(fpo, "%s %s\n", actname(al->acts[i].op),
+				actpath(&al->acts[i], path));
+	dofclose(fpo);
+} // dumpactlist()
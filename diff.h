@@ -0,0 +1,108 @@
+/*    diff.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of diff.[h|c] is to compare a source and a destination
+ * listing and to produce the list of actions that will make the
+ * destination a hard linked copy of the source.
+ * */
+#ifndef _DIFF_H
+#define _DIFF_H
+#define _GNU_SOURCE 1
+
+#include "str.h"
+#include "dirs.h"
+#include "runs.h"
+
+enum {	// action op codes.
+	ACT_MKDIR = 1,	// make dir in dst.
+	ACT_LINK,		// link src file into dst.
+	ACT_RELINK,		// replace dst file with a link to src file.
+	ACT_UNLINK,		// remove file from dst.
+	ACT_RMDIR		// remove dir from dst.
+};
+
+typedef struct action {
+	char *path;		// relative to both roots, NULL if it is that of
+	fslist *fl;		// entry ent of listing fl; see actpath().
+	size_t ent;
+	unsigned char op;
+} action;
+
+typedef struct actlist {
+	action *acts;
+	size_t count;
+	size_t limit;
+	int rmdirsafter;	// each rmdir follows those of the dirs in it,
+						// as from diffruns(), else it precedes them.
+	int quiet;		// one of many done in turn, the phases not logged.
+} actlist;
+
+typedef void (*act_emit)(void *arg, unsigned char op, const char *path);
+
+typedef struct renames {	// what findrenames() found moved.
+	size_t *from;	// dst entries to rename,
+	size_t *to;		// each to the path of this src entry.
+	size_t count;
+	size_t limit;
+	size_t *mkdirs;	// src entries of the dirs to make for them first,
+	size_t nmkdirs;	// parents before what is in them.
+	size_t mlimit;
+} renames;
+
+actlist
+*init_actlist(void);
+
+void
+free_actlist(actlist *al);
+
+void
+addaction(actlist *al, unsigned char op, char *path);
+
+void
+addentaction(actlist *al, unsigned char op, fslist *fl, size_t ent);
+
+void
+copyaction(actlist *al, action *act);
+
+char
+*actpath(action *act, char *buf);
+
+void
+difffslists(fslist *src, fslist *dst, actlist *al);
+
+void
+diffruns(runmerge *src, runmerge *dst, act_emit emit, void *arg);
+
+renames
+*findrenames(fslist *src, fslist *dst, actlist *al);
+
+void
+free_renames(renames *rn);
+
+void
+renamefslist(fslist *src, fslist *dst, renames *rn);
+
+const char
+*actname(unsigned char op);
+
+void
+dumpactlist(const char *tmpfn, actlist *al);
+
+#endif
@@ -24,6 +24,7 @@
  * */
 
 #include "dirs.h"
+#include "metrics.h"
 
 DIR
 *dopendir(const char *name)
@@ -36,36 +37,857 @@ DIR
 	return dir;
 } // dopendir()
 
+DIR
+*dopendirat(int dirfd, const char *name, const char *errname)
+{ /* open the dir name relative to dirfd, with error handling.
+   * Symlinks are not followed. Errname is what to report on failure.
+  */
+	int fd = openat(dirfd, name,
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+	if (!dir) {
+		perror(errname);
+		exit(EXIT_FAILURE);
+	}
+	return dir;
+} // dopendirat()
+
+static DIR
+*opensubdir(int dirfd, const char *name, const char *errname)
+{ /* As dopendirat() except that a dir gone or replaced since it was
+   * read is not an error; NULL is returned and the walk goes on.
+  */
+	uint64_t t = mt_start();
+	int fd = openat(dirfd, name,
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	mt_end(MC_OPEN, t, fd == -1);
+	if (fd == -1 && (errno == ENOENT || errno == ENOTDIR || errno == ELOOP))
+		return NULL;
+	DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+	if (!dir) {
+		perror(errname);
+		exit(EXIT_FAILURE);
+	}
+	return dir;
+} // opensubdir()
+
+static int
+rejected(rd_data *rd, const char *root, const char *relpath)
+{ /* The rejectlist holds real paths so make one from root and relpath
+   * before looking. Only done for dirs and only if there is a list.
+  */
+	char buf[PATH_MAX];
+	strcpy(buf, root);
+	strjoin(buf, '/', (char *)relpath, PATH_MAX);
+	return inlist(buf, rd->rejectlist);
+} // rejected()
+
+/* A dirents holds the wanted entries of one dir between reading them
+ * and recording them, so that they can all be stat'd in one batch.
+ * Each walker thread reuses one for every dir it reads.
+ * The dir is read with getdents64() straight into buf, and the names
+ * are used where the kernel put them; buf grows until the whole dir
+ * fits, so none of them is ever moved or copied.
+ * */
+
+struct dent64 {	// as getdents64() fills the buffer.
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+typedef struct dirents {
+	char *buf;		// the dir as read, or the names from an index.
+	size_t size;
+	size_t used;
+	fsent *ents;	// path is set as each is recorded.
+	size_t *names;	// offset of the name of each in buf.
+	size_t count;
+	size_t limit;
+	uring *ur;		// NULL unless rd->uring and io_uring works.
+	uring_op *ops;
+	struct statx *stx;
+	int ms;			// the match state of the dir read, if rd->match.
+} dirents;
+
+static dirents
+*init_dirents(rd_data *rd)
+{ /* A reusable dirents, with its own ring if so requested. */
+	dirents *de = xmalloc(sizeof(dirents));
+	memset(de, 0, sizeof(dirents));
+	if (rd->uring) de->ur = init_uring(256);
+	return de;
+} // init_dirents()
+
+static void
+free_dirents(dirents *de)
+{
+	if (de->ur) free_uring(de->ur);
+	free(de->buf);
+	free(de->ents);	// vfree() would stop at a NULL ops.
+	free(de->names);
+	free(de->ops);
+	free(de->stx);
+	free(de);
+} // free_dirents()
+
+static char
+*dename(dirents *de, size_t i)
+{ /* The name of entry i. */
+	return de->buf + de->names[i];
+} // dename()
+
+static void
+growdebuf(dirents *de, size_t need)
+{ /* Make room for need more bytes in buf. */
+	if (de->size - de->used >= need) return;
+	size_t size = de->size * 2;
+	if (size < de->used + need) size = de->used + need;
+	de->buf = realloc(de->buf, size);
+	if (!de->buf) {
+		fputs("Out of memory.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	de->size = size;
+} // growdebuf()
+
+static void
+growdirents(dirents *de)
+{ /* Make room for more entries. */
+	de->limit = (de->limit) ? de->limit * 2 : 256;
+	de->ents = realloc(de->ents, de->limit * sizeof(fsent));
+	de->names = realloc(de->names, de->limit * sizeof(size_t));
+	if (de->ur) {
+		de->ops = realloc(de->ops, de->limit * sizeof(uring_op));
+		de->stx = realloc(de->stx, de->limit * sizeof(struct statx));
+	}
+	if (!de->ents || !de->names || (de->ur && (!de->ops || !de->stx))) {
+		fputs("Out of memory.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+} // growdirents()
+
+static size_t
+readdirents(DIR *dp, char *path, dirents *de, rd_data *rd,
+				const char *root)
+{ /* Read the entries of dp, whose name relative to root is in path,
+   * keeping those that pass the rd_data filters. Returns their count.
+   * Only the fd of dp is used, readdir() is never called on it.
+  */
+	int fd = dirfd(dp);
+	size_t plen = strlen(path);
+	int ms = 0;		// the match state of the dir, once for all its entries.
+	if (rd->match) {
+		char rel[PATH_MAX];
+		strcpy(rel, (rd->matchrel) ? rd->matchrel : "");
+		if (plen) strjoin(rel, (*rel) ? '/' : 0, path, PATH_MAX);
+		ms = match_dirstate(rd->match, rel);
+	}
+	de->ms = ms;
+	de->used = 0;
+	de->count = 0;
+	while (1) {
+		growdebuf(de, rd->dentbuf);
+		uint64_t t = mt_start();
+		long n = syscall(SYS_getdents64, fd, de->buf + de->used,
+							de->size - de->used);
+		mt_end(MC_GETDENTS, t, n == -1);
+		if (n == -1) {
+			perror((*path) ? path : root);
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0) break;
+		char *cp = de->buf + de->used;
+		char *end = cp + n;
+		de->used += n;	// a multiple of 8, so the next read is aligned.
+		for (; cp < end; cp += ((struct dent64 *)cp)->d_reclen) {
+			struct dent64 *dent = (struct dent64 *)cp;
+			char *name = dent->d_name;
+			if (name[0] == '.' &&
+				(!name[1] || (name[1] == '.' && !name[2]))) continue;
+			/* Process only file system objects named in rd->fsobj[]. A file
+			 * system without d_type, some NFS, XFS and FUSE, gives
+			 * DT_UNKNOWN; those are kept and get their type from the stat
+			 * that every entry has anyway. */
+			int unknown = dent->d_type == DT_UNKNOWN;
+			if (!unknown && !in_uch_array(dent->d_type, rd->fsobj))
+				continue;
+			/* If there is list of paths to reject check that any dirs
+			 * found are not in rd->rejectlist[] */
+			if ((rd->rejectlist) && (dent->d_type == DT_DIR || unknown)) {
+				strjoin(path, (plen) ? '/' : 0, name, PATH_MAX);
+				int rej = rejected(rd, root, path);
+				path[plen] = 0;
+				if (rej) continue;
+			}
+			if (rd->match &&
+				match_name(rd->match, ms, name, dent->d_type == DT_DIR) &&
+				(!unknown || match_name(rd->match, ms, name, 1)))
+				continue;	// and so not opened, if a dir.
+			if (de->count == de->limit) growdirents(de);
+			de->names[de->count] = name - de->buf;
+			fsent *fe = &de->ents[de->count++];
+			memset(fe, 0, sizeof(fsent));
+			fe->ino = dent->d_ino;
+			fe->type = dent->d_type;	// DT_UNKNOWN is 0.
+		}
+	}
+	return de->count;
+} // readdirents()
+
+/* All that is asked of the stat of an entry. Cached attributes do, so
+ * a network file system need not go to the server for them.
+ * */
+#define ENTMASK (STATX_TYPE | STATX_INO | STATX_NLINK)
+#define ENTFLAGS (AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC)
+
+static int
+statent(int dfd, const char *name, struct statx *stx)
+{ /* statx() of name in dfd, or fstatat() if the kernel has no statx().
+   * Returns 0, or -1 with errno set.
+  */
+	static int nostatx;
+	if (!nostatx) {
+		int res = statx(dfd, name, ENTFLAGS, ENTMASK, stx);
+		if (res == 0 || errno != ENOSYS) return res;
+		nostatx = 1;
+	}
+	struct stat sb;
+	if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) return -1;
+	stx->stx_mode = sb.st_mode;
+	stx->stx_ino = sb.st_ino;
+	stx->stx_dev_major = major(sb.st_dev);
+	stx->stx_dev_minor = minor(sb.st_dev);
+	stx->stx_nlink = sb.st_nlink;
+	return 0;
+} // statent()
+
+static void
+resolvedirent(dirents *de, size_t i, mode_t mode, rd_data *rd)
+{ /* Entry i was read as DT_UNKNOWN: give it the type of mode, or drop
+   * it as if gone if that is not wanted or the type makes it excluded.
+  */
+	fsent *fe = &de->ents[i];
+	fe->type = IFTODT(mode);
+	if (!in_uch_array(fe->type, rd->fsobj) || (rd->match &&
+			match_name(rd->match, de->ms, dename(de, i), fe->type == DT_DIR)))
+		fe->type = 0;
+} // resolvedirent()
+
+static void
+statdirents(int dfd, dirents *de, rd_data *rd)
+{ /* Fill in the inode, device and link count of each entry in de, dfd
+   * being the dir they are in, and the type of those read without one.
+   * Entries that have gone since they were read get type 0.
+  */
+	size_t i;
+	if (de->ur) {	// all at once.
+		for (i = 0; i < de->count; i++) {
+			uring_op *op = &de->ops[i];
+			memset(op, 0, sizeof(uring_op));
+			op->op = URING_STATX;
+			op->dirfd = dfd;
+			op->path = dename(de, i);
+			op->flags = ENTFLAGS;
+			op->mode = ENTMASK;
+			op->stx = &de->stx[i];
+		}
+		uint64_t t = mt_start();
+		size_t failed = uring_run(de->ur, de->ops, de->count);
+		mt_end(MC_URING, t, 0);
+		mt_count(MC_STAT, de->count, failed);
+		for (i = 0; i < de->count; i++) {
+			fsent *fe = &de->ents[i];
+			struct statx *stx = &de->stx[i];
+			if (de->ops[i].res < 0) {
+				fe->type = 0;
+				continue;
+			}
+			fe->ino = stx->stx_ino;
+			fe->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+			fe->nlink = stx->stx_nlink;
+			if (!fe->type) resolvedirent(de, i, stx->stx_mode, rd);
+		}
+		return;
+	}
+	for (i = 0; i < de->count; i++) {	// one at a time.
+		fsent *fe = &de->ents[i];
+		struct statx stx;
+		uint64_t t = mt_start();
+		int res = statent(dfd, dename(de, i), &stx);
+		mt_end(MC_STAT, t, res == -1);
+		if (res == -1) {
+			fe->type = 0;
+			continue;
+		}
+		fe->ino = stx.stx_ino;
+		fe->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+		fe->nlink = stx.stx_nlink;
+		if (!fe->type) resolvedirent(de, i, stx.stx_mode, rd);
+	}
+} // statdirents()
+
+static int
+indexdirents(tindex *ti, const char *path, dirents *de, struct stat *sb)
+{ /* Fill de from the index entry of path if its times are those in sb.
+   * Returns 1 if so, 0 if the dir must be read.
+  */
+	tidir *td = tindex_finddir(ti, path);
+	if (!td || td->mtime == -1) return 0;
+	if (td->mtime != sb->st_mtim.tv_sec ||
+		td->mtimens != sb->st_mtim.tv_nsec ||
+		td->ctime != sb->st_ctim.tv_sec ||
+		td->ctimens != sb->st_ctim.tv_nsec) return 0;
+	de->used = 0;
+	de->count = 0;
+	size_t i;
+	for (i = 0; i < td->count; i++) {
+		tient *te = &ti->ents[td->first + i];
+		if (de->count == de->limit) growdirents(de);
+		char *name = tistr(ti, te->name);
+		size_t len = strlen(name) + 1;
+		growdebuf(de, len);
+		memcpy(de->buf + de->used, name, len);
+		de->names[de->count] = de->used;
+		de->used += len;
+		fsent *fe = &de->ents[de->count++];
+		memset(fe, 0, sizeof(fsent));
+		fe->ino = te->ino;
+		fe->dev = te->dev;
+		fe->nlink = te->nlink;
+		fe->type = te->type;
+	}
+	return 1;
+} // indexdirents()
+
+static void
+fetchdirents(DIR *dp, char *path, dirents *de, rd_data *rd,
+				const char *root, struct stat *sb)
+{ /* Fill de with the wanted entries of dp, from the index when it has
+   * dp unchanged, else by reading and stating them. Sb gets the stat of
+   * dp itself if the index or the fsdir records need it.
+  */
+	if (rd->index || rd->keepdirs) {
+		uint64_t t = mt_start();
+		int res = fstat(dirfd(dp), sb);
+		mt_end(MC_STAT, t, res == -1);
+		if (res == -1) {
+			perror((*path) ? path : root);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!rd->index || !indexdirents(rd->index, path, de, sb)) {
+		readdirents(dp, path, de, rd, root);
+		statdirents(dirfd(dp), de, rd);
+	}
+	mt_done(de->count);	// once a dir, for the progress report.
+} // fetchdirents()
+
+static void
+growfsdirs(fslist *fl)
+{ /* Make room for more dir records. */
+	fl->dlimit = (fl->dlimit) ? fl->dlimit * 2 : 1024;
+	fl->dirs = realloc(fl->dirs, fl->dlimit * sizeof(fsdir));
+	if (!fl->dirs) {
+		fputs("Out of memory.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+} // growfsdirs()
+
+static void
+addfsdir(fslist *fl, const char *path, size_t first, struct stat *sb)
+{ /* Record that the dir path holds the entries from first on. */
+	if (fl->ndirs == fl->dlimit) growfsdirs(fl);
+	fsdir *fd = &fl->dirs[fl->ndirs++];
+	fd->path = xstrdup((char *)path);
+	fd->first = first;
+	fd->count = fl->count - first;
+	fd->mtime = sb->st_mtim;
+	fd->ctime = sb->st_ctim;
+} // addfsdir()
+
+static int
+recursedirat(DIR *dp, char *path, fslist *fl, rd_data *rd,
+				const char *root, dirents *de, size_t self)
+{ /* Record the entries of the open dir dp, whose name relative to root
+   * is in path and whose own entry is self, then descend into its
+   * subdirs. Path is a PATH_MAX buffer shared by the whole recursion.
+   * Closes dp.
+  */
+	size_t plen = strlen(path);
+	size_t first = fl->count;
+	int recs = 0;
+	struct stat sb;
+	fetchdirents(dp, path, de, rd, root, &sb);
+	size_t i;
+	for (i = 0; i < de->count; i++) {
+		if (!de->ents[i].type) continue;	// gone since readdir().
+		de->ents[i].parent = self;
+		addfslist(fl, dename(de, i), &de->ents[i]);
+		recs++;
+	}
+	if (rd->keepdirs) addfsdir(fl, path, first, &sb);
+	// de is reused below, fl is not.
+	size_t last = (rd->shallow) ? first : fl->count;
+	for (i = first; i < last; i++) {
+		if (fl->ents[i].type != DT_DIR) continue;
+		strjoin(path, (plen) ? '/' : 0, fl->ents[i].name, PATH_MAX);
+		DIR *sub = opensubdir(dirfd(dp), fl->ents[i].name, path);
+		if (sub) recs += recursedirat(sub, path, fl, rd, root, de, i);
+		path[plen] = 0;
+	}
+	doclosedir(dp);
+	return recs;
+} // recursedirat()
+
 int
-recursedir(char *dirname, mdata *ddat, rd_data *rd)
+recursedir(char *dirname, fslist *fl, rd_data *rd)
 { /* Returns count of records recorded.
 	* Caller must init_recursedir() before calling this.
+	* Records are names with the index of the record of their dir, so
+	* that no path prefix is stored twice; fspath() makes the path
+	* relative to dirname. Each has the type, inode, device and link
+	* count, so that nothing need stat them again. Each
+	* dir is opened relative to its parent's fd so the kernel resolves
+	* only one path component per open no matter how deep the tree is.
 	*/
-	DIR *dp = dopendir(dirname);
-	static int recs = 0;
-	struct dirent *de;
-	while ((de = readdir(dp))) {
-		if (strcmp(de->d_name, ".") == 0 ) continue;
-		if (strcmp(de->d_name, "..") == 0) continue;
-		// Process only file system objects named in rd->fsobj[]
-		if (!in_uch_array(de->d_type, rd->fsobj)) continue;
-		char joinbuf[PATH_MAX];
-		strcpy(joinbuf, dirname);
-		strjoin(joinbuf, '/', de->d_name, PATH_MAX);
-		/* If there is list of paths to reject check that any dirs
-		 * found are not in rd->rejectlist[] */
-		if ((rd->rejectlist) && de->d_type == DT_DIR) {
-			if(inlist(joinbuf, rd->rejectlist)) continue;
+	return recursedirp(dopendir(dirname), dirname, fl, rd);
+} // recursedir()
+
+int
+recursedirp(DIR *dp, const char *dirname, fslist *fl, rd_data *rd)
+{ /* As recursedir() but on dp, already open on dirname. Closes dp. */
+	char path[PATH_MAX] = {0};
+	dirents *de = init_dirents(rd);
+	int recs = recursedirat(dp, path, fl, rd, dirname, de, NOPARENT);
+	free_dirents(de);
+	return recs;
+} // recursedirp()
+
+/* Parallel version of recursedir().
+ * Each worker thread owns a deque of directories still to be read. It
+ * takes work from the tail of its own deque, which keeps the walk
+ * depth first and cache friendly, and when that is empty it steals
+ * from the head of another worker's deque. Every worker records into
+ * its own fslist so the hot loop never contends on a lock; the
+ * lists are appended to the caller's list when the walk is done.
+ * Until then the parent of an entry is a reference to the worker list
+ * and index of its dir, made by WSREF().
+ * */
+
+#define WSREF(id, i) (((size_t)(id) << 40) | (i))
+#define WSID(ref) ((ref) >> 40)
+#define WSINDEX(ref) ((ref) & ((1UL << 40) - 1))
+
+typedef struct wsitem {	// a dir to be read.
+	size_t ref;		// WSREF() of its entry, NOPARENT for the root.
+	char path[];	// relative to the walk root.
+} wsitem;
+
+static wsitem
+*newwsitem(const char *path, size_t ref)
+{
+	wsitem *wi = xmalloc(sizeof(wsitem) + strlen(path) + 1);
+	wi->ref = ref;
+	strcpy(wi->path, path);
+	return wi;
+} // newwsitem()
+
+typedef struct wsdeque {
+	pthread_mutex_t lock;
+	wsitem **items;
+	size_t head;
+	size_t tail;
+	size_t limit;
+} wsdeque;
+
+typedef struct pwalk {
+	rd_data *rd;
+	const char *root;
+	int rootfd;
+	int nthreads;
+	wsdeque *dq;
+	fslist **fl;	// one per worker.
+	size_t pending;	// dirs queued or being read, atomic access only.
+	size_t recs;	// atomic access only.
+} pwalk;
+
+typedef struct pworker {
+	pwalk *pw;
+	int id;
+} pworker;
+
+static void
+wspush(wsdeque *dq, wsitem *wi)
+{ /* Put wi on the tail of dq, growing dq as required. */
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail == dq->limit) {
+		if (dq->head) {	// reuse the space left by thieves.
+			memmove(dq->items, dq->items + dq->head,
+					(dq->tail - dq->head) * sizeof(wsitem *));
+			dq->tail -= dq->head;
+			dq->head = 0;
+		} else {
+			dq->limit = (dq->limit) ? dq->limit * 2 : 64;
+			dq->items = realloc(dq->items, dq->limit * sizeof(wsitem *));
+			if (!dq->items) {
+				fputs("Out of memory.\n", stderr);
+				exit(EXIT_FAILURE);
+			}
 		}
-		meminsert(joinbuf, ddat, rd->meminc);
+	}
+	dq->items[dq->tail++] = wi;
+	pthread_mutex_unlock(&dq->lock);
+} // wspush()
+
+static wsitem
+*wspop(wsdeque *dq, int steal)
+{ /* Take a dir from the tail of dq, or from the head if stealing.
+   * Returns NULL if dq is empty.
+  */
+	wsitem *wi = NULL;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		if (steal) wi = dq->items[dq->head++];
+		else wi = dq->items[--dq->tail];
+		if (dq->tail == dq->head) dq->tail = dq->head = 0;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return wi;
+} // wspop()
+
+static void
+pwalkdir(pwalk *pw, int id, wsitem *wi, dirents *de)
+{ /* Read one dir, record its entries and queue its subdirs.
+   * Its path is relative to the walk root, "" being the root itself.
+  */
+	rd_data *rd = pw->rd;
+	char *dirname = wi->path;
+	DIR *dp = opensubdir(pw->rootfd, (*dirname) ? dirname : ".",
+							(*dirname) ? dirname : pw->root);
+	if (!dp) return;
+	char path[PATH_MAX];
+	strcpy(path, dirname);
+	size_t plen = strlen(path);
+	struct stat sb;
+	fetchdirents(dp, path, de, rd, pw->root, &sb);
+	fslist *fl = pw->fl[id];
+	size_t i, recs = 0, first = fl->count;
+	for (i = 0; i < de->count; i++) {
+		if (!de->ents[i].type) continue;	// gone since readdir().
+		de->ents[i].parent = wi->ref;
+		addfslist(fl, dename(de, i), &de->ents[i]);
 		recs++;
-		if (de->d_type == DT_DIR) {
-			recursedir(joinbuf, ddat, rd);
+		if (de->ents[i].type == DT_DIR && !rd->shallow) {
+			strjoin(path, (plen) ? '/' : 0, dename(de, i), PATH_MAX);
+			__atomic_add_fetch(&pw->pending, 1, __ATOMIC_ACQ_REL);
+			wspush(&pw->dq[id], newwsitem(path, WSREF(id, fl->count - 1)));
+			path[plen] = 0;
 		}
-	} // while()
+	}
+	if (rd->keepdirs) addfsdir(fl, path, first, &sb);
 	doclosedir(dp);
+	__atomic_add_fetch(&pw->recs, recs, __ATOMIC_RELAXED);
+} // pwalkdir()
+
+static void
+*pwalkworker(void *arg)
+{ /* Thread body: work own deque, steal when it runs dry, quit when
+   * no dir is queued or being read anywhere.
+  */
+	pworker *w = arg;
+	pwalk *pw = w->pw;
+	dirents *de = init_dirents(pw->rd);
+	while (1) {
+		wsitem *wi = wspop(&pw->dq[w->id], 0);
+		int i;
+		for (i = 1; !wi && i < pw->nthreads; i++)
+			wi = wspop(&pw->dq[(w->id + i) % pw->nthreads], 1);
+		if (!wi) {
+			if (__atomic_load_n(&pw->pending, __ATOMIC_ACQUIRE) == 0)
+				break;
+			sched_yield();
+			continue;
+		}
+		pwalkdir(pw, w->id, wi, de);
+		free(wi);
+		__atomic_sub_fetch(&pw->pending, 1, __ATOMIC_ACQ_REL);
+	}
+	free_dirents(de);
+	return NULL;
+} // pwalkworker()
+
+static void growfslist(fslist *fl);
+
+static void
+catfslist(fslist *to, fslist *fro)
+{ /* Move the entries of fro, and its dir records if any, to the end
+   * of to. No name is copied. The parents are left as they are, the
+   * caller must adjust them.
+  */
+	size_t i;
+	for (i = 0; i < fro->ndirs; i++) {
+		if (to->ndirs == to->dlimit) growfsdirs(to);
+		to->dirs[to->ndirs] = fro->dirs[i];
+		to->dirs[to->ndirs].first += to->count;
+		to->ndirs++;
+	}
+	fro->ndirs = 0;
+	arenaadopt(to->ar, fro->ar);	// the paths stay where they are.
+	for (i = 0; i < fro->count; i++) {
+		if (to->count == to->limit) growfslist(to);
+		to->ents[to->count++] = fro->ents[i];
+	}
+	fro->count = 0;
+} // catfslist()
+
+int
+precursedir(char *dirname, fslist *fl, rd_data *rd, int nthreads)
+{ /* Returns count of records recorded.
+   * Same output as recursedir() except that the order of the records
+   * is not defined; callers that need parents before children must
+   * sort the result. Dirs are opened relative to an fd on dirname.
+  */
+	if (nthreads < 1) nthreads = 1;
+	pwalk pw;
+	memset(&pw, 0, sizeof(pwalk));
+	pw.rd = rd;
+	pw.root = dirname;
+	pw.rootfd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (pw.rootfd == -1) {
+		perror(dirname);
+		exit(EXIT_FAILURE);
+	}
+	pw.nthreads = nthreads;
+	pw.dq = xmalloc(nthreads * sizeof(wsdeque));
+	pw.fl = xmalloc(nthreads * sizeof(fslist *));
+	pworker *w = xmalloc(nthreads * sizeof(pworker));
+	pthread_t *tids = xmalloc(nthreads * sizeof(pthread_t));
+	int i;
+	for (i = 0; i < nthreads; i++) {
+		memset(&pw.dq[i], 0, sizeof(wsdeque));
+		pthread_mutex_init(&pw.dq[i].lock, NULL);
+		pw.fl[i] = init_fslist();
+		pw.fl[i]->ar->huge = fl->ar->huge;
+		w[i].pw = &pw;
+		w[i].id = i;
+	}
+	pw.pending = 1;
+	wspush(&pw.dq[0], newwsitem("", NOPARENT));
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&tids[i], NULL, pwalkworker, &w[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < nthreads; i++) pthread_join(tids[i], NULL);
+	size_t *base = xmalloc(nthreads * sizeof(size_t));
+	size_t from = fl->count, j;
+	for (i = 0; i < nthreads; i++) {	// collect the worker output.
+		base[i] = fl->count;
+		catfslist(fl, pw.fl[i]);
+		free_fslist(pw.fl[i]);
+		free(pw.dq[i].items);
+		pthread_mutex_destroy(&pw.dq[i].lock);
+	}
+	for (j = from; j < fl->count; j++) {	// worker refs to indexes.
+		size_t ref = fl->ents[j].parent;
+		if (ref != NOPARENT)
+			fl->ents[j].parent = base[WSID(ref)] + WSINDEX(ref);
+	}
+	vfree(pw.dq, pw.fl, w, tids, base, NULL);
+	close(pw.rootfd);
+	return (int)pw.recs;
+} // precursedir()
+
+size_t
+streamtree(char *dirname, rd_data *rd, rd_emit emit, void *arg)
+{ /* Walk dirname as recursedir() does, but hand each entry with its
+   * path relative to dirname to emit() instead of keeping it, so that
+   * what the walk holds does not grow with the tree: only the paths of
+   * the dirs still to be read, on a stack. The order is depth first but
+   * otherwise not defined. Returns the count of entries.
+  */
+	int rootfd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (rootfd == -1) {
+		perror(dirname);
+		exit(EXIT_FAILURE);
+	}
+	dirents *de = init_dirents(rd);
+	size_t *offs = NULL, nstack = 0, slimit = 0, recs = 0;
+	char *stack = NULL;		// the paths pushed, nul separated.
+	size_t used = 0, size = 0;
+	char path[PATH_MAX];
+	path[0] = 0;
+	while (1) {
+		DIR *dp = opensubdir(rootfd, (*path) ? path : ".",
+								(*path) ? path : dirname);
+		if (dp) {
+			size_t plen = strlen(path), i;
+			struct stat sb;
+			fetchdirents(dp, path, de, rd, dirname, &sb);
+			for (i = 0; i < de->count; i++) {
+				fsent *fe = &de->ents[i];
+				if (!fe->type) continue;	// gone since readdir().
+				fe->parent = NOPARENT;
+				strjoin(path, (plen) ? '/' : 0, dename(de, i), PATH_MAX);
+				emit(arg, path, fe);
+				recs++;
+				if (fe->type == DT_DIR && !rd->shallow) {
+					size_t len = strlen(path) + 1;
+					if (used + len > size || nstack == slimit) {
+						size = (size + len) * 2;
+						slimit = (slimit) ? slimit * 2 : 256;
+						stack = realloc(stack, size);
+						offs = realloc(offs, slimit * sizeof(size_t));
+						if (!stack || !offs) {
+							fputs("Out of memory.\n", stderr);
+							exit(EXIT_FAILURE);
+						}
+					}
+					memcpy(stack + used, path, len);
+					offs[nstack++] = used;
+					used += len;
+				}
+				path[plen] = 0;
+			}
+			doclosedir(dp);
+		}
+		if (!nstack) break;
+		used = offs[--nstack];
+		strcpy(path, stack + used);
+	}
+	vfree(stack, offs, NULL);
+	free_dirents(de);
+	close(rootfd);
 	return recs;
-} // recursedir()
+} // streamtree()
+
+DIR
+*listdirat(int dirfd, const char *name, const char *path, fslist *fl,
+			rd_data *rd, const char *root)
+{ /* Open name in the dir open on dirfd, whose path relative to root is
+   * path, "" for root itself, and append its wanted entries to fl, each
+   * named by its path relative to root and with no parent. Only that
+   * dir is read. Returns it still open, so that what is in it may be
+   * opened relative to it, or NULL if it has gone since it was listed.
+  */
+	DIR *dp = (*path) ? opensubdir(dirfd, name, path)
+						: dopendirat(dirfd, name, root);
+	if (!dp) return NULL;
+	if (!rd->de) rd->de = init_dirents(rd);
+	dirents *de = rd->de;
+	char buf[PATH_MAX];
+	strcpy(buf, path);
+	size_t plen = strlen(buf), i;
+	struct stat sb;
+	fetchdirents(dp, buf, de, rd, root, &sb);
+	for (i = 0; i < de->count; i++) {
+		fsent *fe = &de->ents[i];
+		if (!fe->type) continue;	// gone since readdir().
+		fe->parent = NOPARENT;
+		strjoin(buf, (plen) ? '/' : 0, dename(de, i), PATH_MAX);
+		addfslist(fl, buf, fe);
+		buf[plen] = 0;
+	}
+	return dp;
+} // listdirat()
+
+fslist
+*init_fslist(void)
+{ /* An empty list for recursedir() to fill. */
+	fslist *fl = xmalloc(sizeof(fslist));
+	memset(fl, 0, sizeof(fslist));
+	fl->ar = init_arena(FSCHUNK);
+	return fl;
+} // init_fslist()
+
+void
+free_fslist(fslist *fl)
+{ /* Free the list and everything in it. */
+	clear_fslist(fl);
+	free_arena(fl->ar);
+	free(fl->ents);
+	free(fl->dirs);
+	free(fl);
+} // free_fslist()
+
+size_t
+fslistsize(fslist *fl)
+{ /* Bytes held by fl. */
+	return arenasize(fl->ar) + fl->limit * sizeof(fsent) +
+			fl->dlimit * sizeof(fsdir);
+} // fslistsize()
+
+void
+clear_fslist(fslist *fl)
+{ /* Empty the list but keep its memory for reuse. */
+	clear_arena(fl->ar);
+	fl->count = 0;
+	size_t i;
+	for (i = 0; i < fl->ndirs; i++) free(fl->dirs[i].path);
+	fl->ndirs = 0;
+} // clear_fslist()
+
+static void
+growfslist(fslist *fl)
+{ /* Make room for more entries. */
+	fl->limit = (fl->limit) ? fl->limit * 2 : 4096;
+	fl->ents = realloc(fl->ents, fl->limit * sizeof(fsent));
+	if (!fl->ents) {
+		fputs("Out of memory.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+} // growfslist()
+
+void
+addfslist(fslist *fl, const char *name, fsent *fe)
+{ /* Record name with the parent, type and stat data in fe. */
+	if (fl->count == fl->limit) growfslist(fl);
+	fsent *to = &fl->ents[fl->count++];
+	*to = *fe;
+	to->name = arenastr(fl->ar, name);
+} // addfslist()
+
+char
+*fspath(fslist *fl, size_t i, char *buf)
+{ /* Put the path of entry i in buf, which must hold PATH_MAX, and
+   * return buf.
+  */
+	const char *names[PATH_MAX / 2];
+	int n = 0;
+	size_t len = 0;
+	for (; i != NOPARENT && n < PATH_MAX / 2; i = fl->ents[i].parent) {
+		names[n++] = fl->ents[i].name;
+		len += strlen(fl->ents[i].name) + 1;
+	}
+	if (len > PATH_MAX) {
+		fprintf(stderr, "%s...: path too long\n", names[n - 1]);
+		exit(EXIT_FAILURE);
+	}
+	char *cp = buf;
+	while (n--) {
+		size_t nlen = strlen(names[n]);
+		memcpy(cp, names[n], nlen);
+		cp += nlen;
+		if (n) *cp++ = '/';
+	}
+	*cp = 0;
+	return buf;
+} // fspath()
+
+void
+dumpfslist(const char *tmpfn, fslist *fl)
+{ /* Write the paths in fl, in list order, one per line to tmpfn. */
+	FILE *fpo = dofopen(tmpfn, "w");
+	size_t i;
+	char path[PATH_MAX];
+	for (i = 0; i < fl->count; i++)
+		fprintf(fpo, "%s\n", fspath(fl, i, path));
+	dofclose(fpo);
+} // dumpfslist()
 
 /*
  * For fsobj below use DT_BLK, DT_CHR, DT_DIR, DT_FIFO, DT_LNK, DT_REG,
@@ -83,6 +905,7 @@ rd_data
 	rd_data *rd = xmalloc(sizeof(rd_data));
 	memset(rd, 0, sizeof(rd_data));
 	rd->meminc = meminc;
+	rd->dentbuf = 256 * 1024;
 	if (excludes) {	// excludes may be NULL
 		size_t i, n;
 		for (i = 0; excludes[i] ; i++);
@@ -114,11 +937,31 @@ free_recursedir(rd_data *rd, mdata *md)
 		for (i = 0; rd->rejectlist[i]; i++) free(rd->rejectlist[i]);
 		free(rd->rejectlist);
 	}
+	if (rd->de) free_dirents(rd->de);
 	free(rd);
-	free(md->fro);
-	free(md);
+	if (md) free_mdata(md);
 } // free_recursedir()
 
+uint64_t
+rd_signature(rd_data *rd)
+{ /* FNV-1a hash of the filters in rd, so that an index made with
+   * different filters is not used.
+  */
+	uint64_t h = 14695981039346656037ULL;
+	const unsigned char *p;
+	for (p = rd->fsobj; *p; p++) h = (h ^ *p) * 1099511628211ULL;
+	if (rd->match) h = (h ^ rd->match->sig) * 1099511628211ULL;
+	if (rd->rejectlist) {
+		char **rl;
+		for (rl = rd->rejectlist; *rl; rl++) {
+			h = (h ^ '\n') * 1099511628211ULL;
+			for (p = (unsigned char *)*rl; *p; p++)
+				h = (h ^ *p) * 1099511628211ULL;
+		}
+	}
+	return h;
+} // rd_signature()
+
 void
 doclosedir(DIR *dp)
 {	/* closedir() with error handling */
@@ -168,3 +1011,100 @@ exists_dir(const char *path)
 	}
 	return res;
 } // exists_dir()
+
+/* A dircache keeps open fds on the components of the last dir asked
+ * for, so that operations on a run of paths in the same or nearby dirs
+ * can use the *at() syscalls with a one component name. Moving to a new
+ * dir closes only the components no longer shared and opens only the
+ * new ones, one component per openat().
+ * */
+
+dircache
+*init_dircache(const char *root)
+{ /* Open root and prepare a cache of dir fds below it. */
+	dircache *dc = xmalloc(sizeof(dircache));
+	memset(dc, 0, sizeof(dircache));
+	dc->limit = 16;
+	dc->fds = xmalloc(dc->limit * sizeof(int));
+	dc->ends = xmalloc(dc->limit * sizeof(size_t));
+	dc->fds[0] = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dc->fds[0] == -1) {
+		perror(root);
+		exit(EXIT_FAILURE);
+	}
+	dc->ends[0] = 0;
+	dc->root = xstrdup((char *)root);
+	return dc;
+} // init_dircache()
+
+void
+free_dircache(dircache *dc)
+{ /* Close all fds held by dc and free it. */
+	int i;
+	for (i = dc->depth; i >= 0; i--) close(dc->fds[i]);
+	vfree(dc->fds, dc->ends, dc->root, dc, NULL);
+} // free_dircache()
+
+int
+dircache_at(dircache *dc, const char *relpath, const char **name)
+{ /* Return an fd on the parent dir of relpath, which is relative to
+   * the cache root, and set *name to the last component of relpath.
+   * Returns -1 with errno set if the parent can not be opened; the
+   * caller decides if that is an error.
+  */
+	const char *slash = strrchr(relpath, '/');
+	size_t plen = (slash) ? (size_t)(slash - relpath) : 0;
+	*name = (slash) ? slash + 1 : relpath;
+	/* Find the deepest cached component that is also in the parent. */
+	int k = dc->depth;
+	while (k > 0) {
+		size_t e = dc->ends[k];
+		if (e <= plen && strncmp(dc->path, relpath, e) == 0 &&
+				(e == plen || relpath[e] == '/')) break;
+		k--;
+	}
+	while (dc->depth > k) close(dc->fds[dc->depth--]);
+	size_t pos = dc->ends[k];
+	while (pos < plen) {	// open the rest one component at a time.
+		if (relpath[pos] == '/') pos++;
+		const char *cp = relpath + pos;
+		const char *ep = memchr(cp, '/', plen - pos);
+		size_t clen = (ep) ? (size_t)(ep - cp) : plen - pos;
+		char comp[NAME_MAX + 1];
+		if (clen > NAME_MAX) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(comp, cp, clen);
+		comp[clen] = 0;
+		uint64_t t = mt_start();
+		int fd = openat(dc->fds[dc->depth], comp,
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		mt_end(MC_OPEN, t, fd == -1);
+		if (fd == -1) return -1;
+		if (dc->depth + 1 == dc->limit) {
+			dc->limit *= 2;
+			dc->fds = realloc(dc->fds, dc->limit * sizeof(int));
+			dc->ends = realloc(dc->ends, dc->limit * sizeof(size_t));
+			if (!dc->fds || !dc->ends) {
+				fputs("Out of memory.\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+		}
+		memcpy(dc->path + pos, cp, clen);
+		if (pos) dc->path[pos - 1] = '/';
+		pos += clen;
+		dc->depth++;
+		dc->fds[dc->depth] = fd;
+		dc->ends[dc->depth] = pos;
+	}
+	return dc->fds[dc->depth];
+} // dircache_at()
+
+void
+flush_dircache(dircache *dc)
+{ /* Close all but the root, for when the dirs may have been replaced
+   * since they were opened.
+  */
+	while (dc->depth > 0) close(dc->fds[dc->depth--]);
+} // flush_dircache()
@@ -41,29 +41,128 @@
 #include <linux/limits.h>
 #include <libgen.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
 #include "str.h"
 #include "files.h"
+#include "uring.h"
+#include "tindex.h"
+#include "match.h"
 
 typedef struct rd_data {
 	char **rejectlist;
+	matcher *match;	// if not NULL, what it excludes is not listed.
+	const char *matchrel;	// where the walk starts in the tree match is
+						// of, NULL for its root.
 	size_t meminc;
+	int uring;		// batch the per entry stats through io_uring.
+	tindex *index;	// if not NULL, dirs unchanged since are not read.
+	int keepdirs;	// record an fsdir for each dir read.
+	int shallow;	// read only the top dir, do not descend.
+	size_t dentbuf;	// bytes asked of each getdents64() call.
+	struct dirents *de;	// reused by listdirat(), NULL till then.
 	unsigned char fsobj[9];
 } rd_data;
 
+#define NOPARENT ((size_t)-1)
+
+typedef struct fsent {
+	ino_t ino;
+	dev_t dev;
+	char *name;		// in the fslist arena, without the dir part.
+	size_t parent;	// index of the entry of its dir, or NOPARENT.
+	uint32_t nlink;
+	unsigned char type;	// DT_DIR, DT_REG etc.
+} fsent;
+
+typedef struct fsdir {	// one dir read, if rd_data keepdirs.
+	char *path;		// relative to the root, "" for the root itself.
+	size_t first;	// its entries are ents[first] to ents[first+count-1].
+	size_t count;
+	struct timespec mtime;
+	struct timespec ctime;
+} fsdir;
+
+#define FSCHUNK (2 * 1024 * 1024)	// fslist arena chunk, a huge page.
+
+typedef struct fslist {	// what recursedir() found.
+	arena *ar;		// the names as C strings.
+	fsent *ents;
+	size_t count;
+	size_t limit;
+	fsdir *dirs;
+	size_t ndirs;
+	size_t dlimit;
+} fslist;
+
+typedef struct dircache {
+	char *root;
+	int depth;		// number of components open below root.
+	int limit;
+	int *fds;		// fds[0] is on root, fds[i] on component i.
+	size_t *ends;	// ends[i] is where component i ends in path.
+	char path[PATH_MAX];	// the dir open at fds[depth], rel to root.
+} dircache;
+
+typedef void (*rd_emit)(void *arg, const char *path, fsent *fe);
+
 rd_data
 *init_recursedir(char **excludes, size_t meminc, ...);
 
 void
 free_recursedir(rd_data *rd, mdata *md);
 
+uint64_t
+rd_signature(rd_data *rd);
+
 DIR
 *dopendir(const char *dirname);
 
+DIR
+*dopendirat(int dirfd, const char *name, const char *errname);
+
 void
 doclosedir(DIR *dp);
 
 int
-recursedir(char *dirname, mdata *ddat, rd_data *rd);
+recursedir(char *dirname, fslist *fl, rd_data *rd);
+
+int
+recursedirp(DIR *dp, const char *dirname, fslist *fl, rd_data *rd);
+
+int
+precursedir(char *dirname, fslist *fl, rd_data *rd, int nthreads);
+
+size_t
+streamtree(char *dirname, rd_data *rd, rd_emit emit, void *arg);
+
+DIR
+*listdirat(int dirfd, const char *name, const char *path, fslist *fl,
+			rd_data *rd, const char *root);
+
+fslist
+*init_fslist(void);
+
+void
+free_fslist(fslist *fl);
+
+void
+clear_fslist(fslist *fl);
+
+size_t
+fslistsize(fslist *fl);
+
+void
+addfslist(fslist *fl, const char *name, fsent *fe);
+
+char
+*fspath(fslist *fl, size_t i, char *buf);
+
+void
+dumpfslist(const char *tmpfn, fslist *fl);
 
 void
 newdir(const char *dname, int mayexist);
@@ -74,4 +173,16 @@ xchdir(const char *);
 int
 exists_dir(const char *);
 
+dircache
+*init_dircache(const char *root);
+
+void
+free_dircache(dircache *dc);
+
+int
+dircache_at(dircache *dc, const char *relpath, const char **name);
+
+void
+flush_dircache(dircache *dc);
+
 #endif
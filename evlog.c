@@ -0,0 +1,289 @@
+/*    evlog.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of evlog.[h|c] is to keep a log of what a run does,
+ * each event put in a ring buffer by the thread it happens in and
+ * written out in large writes by a thread of its own. Events that do
+ * not fit are dropped and counted, never waited for.
+ * */
+
+#include "files.h"
+#include "evlog.h"
+
+#define EVRING (4 * 1024 * 1024)	// bytes buffered.
+#define EVLINE (3 * PATH_MAX)		// the most one event takes.
+
+typedef struct evring {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// there is enough to write, or stop.
+	pthread_cond_t drained;	// all that was put has been written.
+	int running;
+	int stop;
+	int fd;
+	int json;			// JSON lines, otherwise as -v always was.
+	char *buf;
+	size_t head;		// put at, both run on and are taken % EVRING.
+	size_t tail;		// written up to.
+	size_t writing;		// being written up to, outside the lock.
+	size_t dropped;
+} evring;
+
+int evlevel = -1;
+static evring ev;
+static const char *levelnames[] = {"error", "info", "action", "debug"};
+
+static void *evworker(void *arg);
+static void startworker(void);
+static void evprepare(void);
+static void evparent(void);
+static void evchild(void);
+static size_t jsonstr(char *to, size_t room, const char *s);
+
+void
+init_evlog(const char *fn, int level)
+{ /* Log events up to level to fn, or stderr if fn is NULL or "-".
+   * If fn ends in .json write JSON lines, one object an event.
+  */
+	evlevel = level;
+	memset(&ev, 0, sizeof(evring));
+	ev.fd = STDERR_FILENO;
+	if (fn && strcmp(fn, "-") != 0) {
+		ev.fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (ev.fd == -1) {
+			perror(fn);
+			exit(EXIT_FAILURE);
+		}
+		const char *dot = strrchr(fn, '.');
+		ev.json = dot && strcmp(dot, ".json") == 0;
+	}
+	ev.buf = xmalloc(EVRING);
+	pthread_mutex_init(&ev.lock, NULL);
+	pthread_cond_init(&ev.cond, NULL);
+	pthread_cond_init(&ev.drained, NULL);
+	pthread_atfork(evprepare, evparent, evchild);
+	atexit(close_evlog);	// what is buffered when exit() is called.
+} // init_evlog()
+
+void
+evlog(int level, const char *event, const char *fmt, ...)
+{ /* Put an event in the ring, or count it as dropped if there is no
+   * room. Event names its kind in JSON, the text is fmt as printf().
+  */
+	if (level > evlevel) return;
+	char msg[EVLINE], line[2 * EVLINE];
+	size_t len;
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(msg, EVLINE, fmt, ap);
+	va_end(ap);
+	if (ev.json) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		len = snprintf(line, sizeof(line), "{\"time\":%ld.%06ld,\"pid\":%d,"
+				"\"level\":\"%s\",\"event\":\"%s\",\"msg\":",
+				(long)ts.tv_sec, ts.tv_nsec / 1000, (int)getpid(),
+				levelnames[level], event);
+		len += jsonstr(line + len, sizeof(line) - len - 3, msg);
+		strcpy(line + len, "}\n");
+		len += 2;
+	} else {
+		len = strlen(msg);
+		memcpy(line, msg, len);
+		if (!len || line[len - 1] != '\n') line[len++] = '\n';
+	}
+	pthread_mutex_lock(&ev.lock);
+	if (!ev.running) startworker();
+	if (ev.head - ev.tail + len > EVRING) {
+		ev.dropped++;
+	} else {
+		size_t at = ev.head % EVRING;
+		size_t n = (len < EVRING - at) ? len : EVRING - at;
+		memcpy(ev.buf + at, line, n);
+		memcpy(ev.buf, line + n, len - n);
+		ev.head += len;
+		if (ev.head - ev.tail >= EVRING / 4 && ev.writing == ev.tail)
+			pthread_cond_signal(&ev.cond);	// else the timer will do.
+	}
+	pthread_mutex_unlock(&ev.lock);
+} // evlog()
+
+void
+flush_evlog(void)
+{ /* Wait until all that has been put is written, so that what is
+   * written to stderr next comes after it.
+  */
+	if (evlevel < 0) return;
+	pthread_mutex_lock(&ev.lock);
+	if (ev.running) {
+		while (ev.tail != ev.head) {
+			pthread_cond_signal(&ev.cond);
+			pthread_cond_wait(&ev.drained, &ev.lock);
+		}
+	}
+	pthread_mutex_unlock(&ev.lock);
+} // flush_evlog()
+
+void
+close_evlog(void)
+{ /* Write out what is left and stop, saying how many were dropped. */
+	if (evlevel < 0) return;
+	pthread_mutex_lock(&ev.lock);
+	int running = ev.running;
+	ev.stop = 1;
+	pthread_cond_signal(&ev.cond);
+	pthread_mutex_unlock(&ev.lock);
+	if (running) pthread_join(ev.tid, NULL);
+	if (ev.dropped) {	// the ring is empty now, write it straight out.
+		char line[256];
+		int len = (ev.json) ?
+			snprintf(line, sizeof(line), "{\"pid\":%d,\"level\":\"error\","
+				"\"event\":\"dropped\",\"count\":%zu}\n", (int)getpid(),
+				ev.dropped) :
+			snprintf(line, sizeof(line), "Log: %zu events dropped.\n",
+				ev.dropped);
+		if (write(ev.fd, line, len) != len) ev.dropped = 0;
+	}
+	evlevel = -1;
+	if (ev.fd != STDERR_FILENO) close(ev.fd);
+	free(ev.buf);
+} // close_evlog()
+
+void
+startworker(void)
+{ /* Start the writer, with ev.lock held. Done on the first event, and
+   * so again in a child after fork(), which has only the one thread.
+  */
+	ev.running = 1;
+	ev.stop = 0;
+	if (pthread_create(&ev.tid, NULL, evworker, NULL)) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+} // startworker()
+
+void
+*evworker(void *arg)
+{ /* Write out what is in the ring every 100ms, or when it is a
+   * quarter full, until told to stop. At most two write()s, as the ring
+   * wraps, however many events. The lock is not held while writing.
+  */
+	(void)arg;
+	pthread_mutex_lock(&ev.lock);
+	while (1) {
+		if (ev.tail == ev.head) {
+			pthread_cond_broadcast(&ev.drained);
+			if (ev.stop) break;
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&ev.cond, &ev.lock, &ts);
+			continue;
+		}
+		size_t from = ev.tail;
+		ev.writing = ev.head;
+		pthread_mutex_unlock(&ev.lock);
+		while (from < ev.writing) {
+			size_t at = from % EVRING;
+			size_t n = ev.writing - from;
+			if (n > EVRING - at) n = EVRING - at;
+			ssize_t res = write(ev.fd, ev.buf + at, n);
+			if (res == -1 && errno == EINTR) continue;
+			if (res <= 0) {	// nowhere to put them, count them dropped.
+				pthread_mutex_lock(&ev.lock);
+				ev.dropped++;
+				pthread_mutex_unlock(&ev.lock);
+				break;
+			}
+			from += res;
+		}
+		pthread_mutex_lock(&ev.lock);
+		ev.tail = ev.writing;
+	}
+	pthread_mutex_unlock(&ev.lock);
+	return NULL;
+} // evworker()
+
+void
+evprepare(void)
+{ /* fork() must not leave ev.lock held in the child. */
+	if (evlevel >= 0) pthread_mutex_lock(&ev.lock);
+} // evprepare()
+
+void
+evparent(void)
+{ /* After fork(), in the parent. */
+	if (evlevel >= 0) pthread_mutex_unlock(&ev.lock);
+} // evparent()
+
+void
+evchild(void)
+{ /* After fork(), in the child: the writer was not copied, and what is
+   * in the ring is the parent's to write.
+  */
+	if (evlevel < 0) return;
+	ev.running = 0;
+	ev.tail = ev.writing = ev.head;
+	ev.dropped = 0;
+	pthread_mutex_unlock(&ev.lock);
+} // evchild()
+
+size_t
+jsonstr(char *to, size_t room, const char *s)
+{ /* s as a JSON string in to, cut short to fit in room. Returns the
+   * length put.
+  */
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *cp;
+	size_t len = 0;
+	to[len++] = '"';
+	for (cp = (const unsigned char *)s; *cp && len + 8 < room; cp++) {
+		switch (*cp) {
+		case '"':
+		case '\\':
+			to[len++] = '\\';
+			to[len++] = *cp;
+			break;
+		case '\n':
+			to[len++] = '\\';
+			to[len++] = 'n';
+			break;
+		case '\t':
+			to[len++] = '\\';
+			to[len++] = 't';
+			break;
+		default:
+			if (*cp < 0x20) {
+				memcpy(to + len, "\\u00", 4);
+				to[len + 4] = hex[*cp >> 4];
+				to[len + 5] = hex[*cp & 15];
+				len += 6;
+			} else {
+				to[len++] = *cp;
+			}
+		}
+	}
+	to[len++] = '"';
+	return len;
+} // jsonstr()
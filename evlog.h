@@ -0,0 +1,55 @@
+/*    evlog.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of evlog.[h|c] is to keep a log of what a run does,
+ * each event put in a ring buffer by the thread it happens in and
+ * written out in large writes by a thread of its own. Events that do
+ * not fit are dropped and counted, never waited for.
+ * */
+#ifndef _EVLOG_H
+#define _EVLOG_H
+#define _GNU_SOURCE 1
+
+#include <pthread.h>
+#include <stdarg.h>
+
+enum {	// the levels, each logs those before it too.
+	EV_ERROR,
+	EV_INFO,		// phases and totals.
+	EV_ACTION,		// each change made to dst.
+	EV_DEBUG
+};
+
+extern int evlevel;	// events above it are not logged, -1 for none.
+
+void
+init_evlog(const char *fn, int level);
+
+void
+evlog(int level, const char *event, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+void
+flush_evlog(void);
+
+void
+close_evlog(void);
+
+#endif
@@ -23,8 +23,15 @@
  * latter see dirs.[h|c].
  * */
 
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 #include "files.h"
 
+static int copydata(int sfd, int dfd, int method);
+static int tempat(int dirfd, const char *path, char *tmp, mode_t mode);
+static int placeat(int dirfd, const char *tmp, const char *path);
+
 void
 writestrarray(char **list)
 { /* output the strings to console - must be NULL terminated. */
@@ -261,11 +268,130 @@ mdata
 
 void
 copyfile(const char *pathfro, const char *pathto)
-{/* Does a file copy in user space. */
-	mdata *fd = readfile(pathfro, 1, 0);
-	writefile(pathto, fd->fro, fd->to, "w");
+{/* Does a file copy in the kernel, replacing any file at pathto. */
+	int method = 0;
+	unlink(pathto);
+	if (copyat(AT_FDCWD, pathfro, AT_FDCWD, pathto, &method) == -1) {
+		perror(pathfro);
+		exit(EXIT_FAILURE);
+	}
 } // copyfile()
 
+int
+copyat(int sdirfd, const char *spath, int ddirfd, const char *dpath,
+			int *method)
+{ /* Copy file spath in sdirfd to a new file dpath in ddirfd, with the
+   * mode and times of spath. The data never passes through user space.
+   * Tries *method first, the first of them if 0, then each after it in
+   * turn, and leaves *method at the one that worked. The copy is made
+   * under a temporary name beside dpath and only renamed to it once
+   * whole, so dpath never names a part copy, even if the copy is
+   * killed. Returns 0, or -1 with errno set and no dpath left behind.
+  */
+	int sfd = openat(sdirfd, spath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (sfd == -1) return -1;
+	struct stat sb;
+	if (fstat(sfd, &sb) == -1) {
+		close(sfd);
+		return -1;
+	}
+	char tmp[PATH_MAX];
+	int dfd = tempat(ddirfd, dpath, tmp, sb.st_mode & 07777);
+	if (dfd == -1) {
+		close(sfd);
+		return -1;
+	}
+	int m, res = 1;
+	for (m = (*method) ? *method : COPY_CLONE; m <= COPY_SENDFILE; m++) {
+		res = copydata(sfd, dfd, m);
+		if (res != 1) break;
+	}
+	struct timespec ts[2] = {sb.st_atim, sb.st_mtim};
+	if (res == 0 && (fchmod(dfd, sb.st_mode & 07777) == -1 ||
+			futimens(dfd, ts) == -1)) res = -1;
+	if (res == 1) errno = EOPNOTSUPP;
+	int err = errno;
+	close(sfd);
+	if (close(dfd) == -1 && res == 0) {
+		err = errno;
+		res = -1;
+	}
+	if (res == 0 && placeat(ddirfd, tmp, dpath) == -1) {
+		err = errno;
+		res = -1;
+	}
+	if (res) {
+		unlinkat(ddirfd, tmp, 0);
+		errno = err;
+		return -1;
+	}
+	*method = m;
+	return 0;
+} // copyat()
+
+int
+tempat(int dirfd, const char *path, char *tmp, mode_t mode)
+{ /* Create a new file in dirfd in the dir of path, named in tmp, which
+   * must take PATH_MAX. Returns its fd, or -1 with errno set.
+  */
+	static unsigned serial;
+	const char *slash = strrchr(path, '/');
+	int dlen = (slash) ? slash - path + 1 : 0;
+	int fd;
+	do {
+		unsigned n = __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED);
+		if (snprintf(tmp, PATH_MAX, "%.*s.synclink.%d.%u", dlen, path,
+				(int)getpid(), n) >= PATH_MAX) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+					mode);
+	} while (fd == -1 && errno == EEXIST);
+	return fd;
+} // tempat()
+
+int
+placeat(int dirfd, const char *tmp, const char *path)
+{ /* Rename tmp to path, both in dirfd, failing with EEXIST if path is
+   * there. File systems without RENAME_NOREPLACE get a link and unlink.
+  */
+	if (renameat2(dirfd, tmp, dirfd, path, RENAME_NOREPLACE) == 0)
+		return 0;
+	if (errno != EINVAL) return -1;
+	if (linkat(dirfd, tmp, dirfd, path, 0) == -1) return -1;
+	unlinkat(dirfd, tmp, 0);
+	return 0;
+} // placeat()
+
+int
+copydata(int sfd, int dfd, int method)
+{ /* Copy all of sfd to dfd, both at offset 0, by method. Returns 0,
+   * 1 if method does not work between these two files and nothing has
+   * been written, or -1 with errno set.
+  */
+	ssize_t n;
+	size_t total = 0;
+	if (method == COPY_CLONE)
+		return (ioctl(dfd, FICLONE, sfd) == -1) ? 1 : 0;
+	while (1) {
+		if (method == COPY_RANGE)
+			n = copy_file_range(sfd, NULL, dfd, NULL, 1 << 30, 0);
+		else
+			n = sendfile(dfd, sfd, NULL, 1 << 30);
+		if (n == 0) return 0;	// to the end, however long it is now.
+		if (n > 0) {
+			total += n;
+			continue;
+		}
+		if (errno == EINTR) continue;
+		if (total == 0 && (errno == EXDEV || errno == EINVAL ||
+				errno == ENOSYS || errno == EOPNOTSUPP))
+			return 1;
+		return -1;
+	}
+} // copydata()
+
 void
 dolink(const char *fr, const char *to)
 {/* link() with error handling. */
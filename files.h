@@ -44,6 +44,13 @@
 #include <errno.h>
 
 #include "str.h"
+
+enum {	// copyat() methods, each falls back to the next.
+	COPY_CLONE = 1,	// FICLONE reflink, no data is copied at all.
+	COPY_RANGE,		// copy_file_range(), in the kernel.
+	COPY_SENDFILE	// sendfile(), in the kernel.
+};
+
 void
 writestrarray(char **list);
 
@@ -95,6 +102,10 @@ mdata
 void
 copyfile(const char *pathfro, const char *pathto);
 
+int
+copyat(int sdirfd, const char *spath, int ddirfd, const char *dpath,
+			int *method);
+
 void
 dolink(const char *fro, const char *to);
 
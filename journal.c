@@ -0,0 +1,155 @@
+/*    journal.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+#include "files.h"
+#include "metrics.h"
+#include "journal.h"
+
+#define JSYNCNS 1000000000ULL	// the most between checkpoints.
+
+static journal *openjn;	// to be synced at exit, if any.
+
+static void
+syncatexit(void)
+{ /* Write where a run got to when exit() is called, on a failure. */
+	if (openjn) journal_sync(openjn);
+} // syncatexit()
+
+static int
+cmpcursor(jcursor *a, int phase, int pass, size_t next)
+{ /* strcmp() like, of a and the cursor made of the rest. */
+	if (a->phase != phase) return (a->phase < phase) ? -1 : 1;
+	if (a->pass != pass) return (a->pass < pass) ? -1 : 1;
+	if (a->next != next) return (a->next < next) ? -1 : 1;
+	return 0;
+} // cmpcursor()
+
+journal
+*init_journal(const char *fn, int uring, uint64_t deadline)
+{ /* A journal to be written to fn by journal_plan() once it is known
+   * what is to be done. Deadline is when to stop, 0 for never.
+  */
+	journal *jn = xmalloc(sizeof(journal));
+	memset(jn, 0, sizeof(journal));
+	jn->fn = xstrdup((char *)fn);
+	jn->uring = uring;
+	jn->deadline = deadline;
+	return jn;
+} // init_journal()
+
+journal
+*resume_journal(const char *fn, plan *pl, int uring, uint64_t deadline)
+{ /* Carry on with the journal in fn, loaded as pl by readplan(), from
+   * its last checkpoint. Uring must be as it was, or the passes by
+   * depth would not be the same.
+  */
+	int ju;
+	journal *jn = init_journal(fn, uring, deadline);
+	if (!pl->at || sscanf(pl->at, "{\"at\":[%d,%d,%zu],\"uring\":%d}",
+				&jn->at.phase, &jn->at.pass, &jn->at.next, &ju) != 4) {
+		fprintf(stderr, "Not a finished journal: %s\n", fn);
+		exit(EXIT_FAILURE);
+	}
+	if (ju != uring) {
+		fprintf(stderr, "Journal %s was made %s -u, resume it so too.\n",
+				fn, (ju) ? "with" : "without");
+		exit(EXIT_FAILURE);
+	}
+	jn->from = jn->at;
+	jn->resumed = 1;
+	jn->fp = dofopen(fn, "a");
+	jn->written = metrics_now();
+	openjn = jn;
+	atexit(syncatexit);
+	return jn;
+} // resume_journal()
+
+void
+journal_plan(journal *jn, const char *src, const char *dst, actlist *al)
+{ /* Write al to the journal as its plan, with the first checkpoint, and
+   * make sure they are on disk before any of it is done.
+  */
+	writeplan(jn->fn, src, dst, al);
+	jn->fp = dofopen(jn->fn, "a");
+	jn->dirty = 1;
+	journal_sync(jn);
+	openjn = jn;
+	atexit(syncatexit);
+} // journal_plan()
+
+int
+journal_due(journal *jn)
+{ /* Whether journal_at() would now write a checkpoint or stop. */
+	uint64_t now = metrics_now();
+	return now - jn->written >= JSYNCNS ||
+			(jn->deadline && now >= jn->deadline);
+} // journal_due()
+
+int
+journal_at(journal *jn, int phase, int pass, size_t next)
+{ /* Note that all before next in pass of phase is done. The checkpoint
+   * is written at most JSYNCNS apart. Returns 1 if the deadline has
+   * passed, when the caller must stop.
+  */
+	jn->at.phase = phase;
+	jn->at.pass = pass;
+	jn->at.next = next;
+	jn->dirty = 1;
+	uint64_t now = metrics_now();
+	if (now - jn->written >= JSYNCNS) journal_sync(jn);
+	return jn->deadline && now >= jn->deadline;
+} // journal_at()
+
+int
+journal_done(journal *jn, int phase, int pass, size_t next)
+{ /* Whether next in pass of phase was done before the run resumed. */
+	return cmpcursor(&jn->from, phase, pass, next) > 0;
+} // journal_done()
+
+void
+journal_sync(journal *jn)
+{ /* Write the checkpoint if it has moved, and fsync it. */
+	if (!jn->fp || !jn->dirty) return;
+	fprintf(jn->fp, "{\"at\":[%d,%d,%zu],\"uring\":%d}\n", jn->at.phase,
+			jn->at.pass, jn->at.next, jn->uring);
+	if (fflush(jn->fp) == EOF || fdatasync(fileno(jn->fp)) == -1) {
+		openjn = NULL;	// no second try at exit.
+		perror(jn->fn);
+		exit(EXIT_FAILURE);
+	}
+	jn->dirty = 0;
+	jn->written = metrics_now();
+} // journal_sync()
+
+void
+close_journal(journal *jn, int finished)
+{ /* Write the last checkpoint, or remove the journal if finished. */
+	if (openjn == jn) openjn = NULL;
+	if (jn->fp) {
+		if (!finished) journal_sync(jn);
+		dofclose(jn->fp);
+		if (finished && unlink(jn->fn) == -1) {
+			perror(jn->fn);
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(jn->fn);
+	free(jn);
+} // close_journal()
@@ -0,0 +1,87 @@
+/*    journal.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of journal.[h|c] is to let a sync that is stopped, by a
+ * failure, a kill or its deadline, be resumed where it got to. The
+ * journal is a plan, see plan.[h|c], of what is to be done, followed by
+ * checkpoint lines each saying how far applyactions() had got. Both
+ * are fsync'd, the checkpoints at most a second apart.
+ * */
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+#define _GNU_SOURCE 1
+
+#include "str.h"
+#include "diff.h"
+#include "plan.h"
+
+#define EXIT_DEADLINE 3		// stopped at the deadline, resumable.
+
+enum {	// the passes of applyactions() over the actions, in order.
+	JP_UNLINK = 1,
+	JP_RMDIR,
+	JP_MKDIR,
+	JP_LINK
+};
+
+typedef struct jcursor {	// all before it is done.
+	int phase;		// JP_*, 0 before the first.
+	int pass;		// the depth done at a time with io_uring, else 0.
+	size_t next;	// the action to do next in that pass.
+} jcursor;
+
+typedef struct journal {
+	char *fn;
+	FILE *fp;		// NULL till the plan is written.
+	int uring;		// the passes are by depth.
+	jcursor at;		// how far it has got.
+	jcursor from;	// where it was resumed from.
+	int resumed;	// so what it did after its last checkpoint may be
+					// done again.
+	int dirty;		// at has moved since it was written.
+	uint64_t written;	// when, monotonic ns.
+	uint64_t deadline;	// 0 for none.
+} journal;
+
+journal
+*init_journal(const char *fn, int uring, uint64_t deadline);
+
+journal
+*resume_journal(const char *fn, plan *pl, int uring, uint64_t deadline);
+
+void
+journal_plan(journal *jn, const char *src, const char *dst, actlist *al);
+
+int
+journal_due(journal *jn);
+
+int
+journal_at(journal *jn, int phase, int pass, size_t next);
+
+int
+journal_done(journal *jn, int phase, int pass, size_t next);
+
+void
+journal_sync(journal *jn);
+
+void
+close_journal(journal *jn, int finished);
+
+#endif
@@ -0,0 +1,449 @@
+/*    match.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of match.[h|c] is to decide which entries of a tree are
+ * excluded by a list of glob patterns, all compiled into one DFA, so
+ * that each byte of a path is looked at once however many patterns
+ * there are. The DFA is built as paths need it, one state at a time.
+ *
+ * The patterns are as rsync's: '*' matches anything but '/', '**'
+ * anything at all, '?' one byte but '/', [...] one of a set and '\'
+ * makes the next byte literal. A pattern starting with '/' matches
+ * paths from the root of the tree, any other the last components of a
+ * path. One ending in '/' matches only dirs.
+ * */
+
+#include "files.h"
+#include "match.h"
+
+enum {	// mtok kinds.
+	T_CLASS,	// one byte of the class.
+	T_STAR,		// any bytes but '/'.
+	T_DSTAR,	// any bytes.
+	T_FLOATA,	// the start of any component, a floating pattern starts
+	T_FLOATB,	// with these two, the second part way into a component.
+	T_END		// the whole rule matched.
+};
+
+#define NORULE INT32_MAX
+#define MAXSTATES 65536
+#define STATEBUDGET (256 * 1024 * 1024)	// bytes of states at most.
+
+typedef struct mstate {
+	int acceptdir;	// the first rule matched if a dir, or NORULE.
+	int acceptfile;	// and if not.
+	int next[];		// by byte class, -1 until worked out.
+} mstate;
+
+#define STATE(m, s) ((mstate *)((m)->states + (size_t)(s) * (m)->ssize))
+#define STATESET(m, s) ((uint64_t *)((m)->states + (size_t)(s) * \
+						(m)->ssize + (m)->ssize - (m)->words * 8))
+
+static void addtok(matcher *m, unsigned char kind, int arg);
+static int newclass(matcher *m);
+static int litclass(matcher *m, unsigned char c);
+static const char *parseclass(matcher *m, const char *cp);
+static void closure(matcher *m, uint64_t *set, size_t i);
+static int findstate(matcher *m, uint64_t *set);
+static int addnext(matcher *m, int s, int bc);
+
+matcher
+*init_matcher(void)
+{ /* An empty matcher, excluding nothing. */
+	matcher *m = xmalloc(sizeof(matcher));
+	memset(m, 0, sizeof(matcher));
+	memset(m->litcls, -1, sizeof(m->litcls));
+	m->sig = 14695981039346656037ULL;
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+} // init_matcher()
+
+void
+free_matcher(matcher *m)
+{ /* free resources allocated to m */
+	free(m->rules);
+	free(m->toks);
+	free(m->cls);
+	free(m->states);
+	free(m->htab);
+	free(m->scratch);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+} // free_matcher()
+
+void
+add_pattern(matcher *m, const char *pat, int include)
+{ /* Add the rule pat, which excludes what it matches unless include.
+   * Rules are tried in the order they are added.
+  */
+	const char *cp;
+	for (cp = pat; *cp; cp++) m->sig = (m->sig ^ *cp) * 1099511628211ULL;
+	m->sig = (m->sig ^ ((include) ? '+' : '-')) * 1099511628211ULL;
+	size_t len = strlen(pat);
+	int dironly = 0;
+	while (len > 1 && pat[len - 1] == '/' &&
+			(len < 2 || pat[len - 2] != '\\')) {
+		dironly = 1;
+		len--;
+	}
+	if (strspn(pat, "/") >= len) return;	// nothing to match.
+	if (m->nrules == m->rlimit) {
+		m->rlimit = (m->rlimit) ? m->rlimit * 2 : 16;
+		m->rules = realloc(m->rules, m->rlimit * sizeof(mrule));
+		if (!m->rules) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	int r = m->nrules++;
+	m->rules[r].include = include;
+	m->rules[r].dironly = dironly;
+	const char *end = pat + len;
+	cp = pat;
+	if (*cp == '/') {	// anchored at the root.
+		while (cp < end && *cp == '/') cp++;
+	} else {
+		addtok(m, T_FLOATA, 0);
+		addtok(m, T_FLOATB, 0);
+	}
+	while (cp < end) {
+		if (*cp == '*') {
+			int n = 0;
+			while (cp < end && *cp == '*') cp++, n++;
+			addtok(m, (n > 1) ? T_DSTAR : T_STAR, 0);
+		} else if (*cp == '?') {
+			int k = newclass(m);
+			memset(m->cls[k], 0xff, sizeof(m->cls[k]));
+			m->cls[k]['/' / 64] &= ~(1ULL << ('/' % 64));
+			addtok(m, T_CLASS, k);
+			cp++;
+		} else if (*cp == '[') {
+			const char *after = parseclass(m, cp);
+			if (after && after <= end) {
+				addtok(m, T_CLASS, m->ncls - 1);
+				cp = after;
+			} else {	// no closing ']', a literal '['.
+				if (after) m->ncls--;
+				addtok(m, T_CLASS, litclass(m, *cp++));
+			}
+		} else {
+			if (*cp == '\\' && cp + 1 < end) cp++;
+			addtok(m, T_CLASS, litclass(m, *cp++));
+		}
+	}
+	addtok(m, T_END, r);
+} // add_pattern()
+
+void
+add_patternfile(matcher *m, const char *fn, int include)
+{ /* Add the rules in fn, one a line. Blank lines and those starting
+   * with '#' are skipped. A line starting with "+ " is an include and
+   * one with "- " an exclude whatever include is.
+  */
+	FILE *fpi = fopen(fn, "r");
+	if (!fpi) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+	char line[PATH_MAX + 3];
+	while (fgets(line, sizeof(line), fpi)) {
+		size_t len = strlen(line);
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		if (!len || line[0] == '#') continue;
+		if ((line[0] == '+' || line[0] == '-') && line[1] == ' ') {
+			add_pattern(m, line + 2, line[0] == '+');
+		} else {
+			add_pattern(m, line, include);
+		}
+	}
+	fclose(fpi);
+} // add_patternfile()
+
+void
+compile_matcher(matcher *m)
+{ /* Work out the byte classes and the start state, once all the rules
+   * are in. Only the states paths reach are made, by match_*().
+  */
+	int map[256], remap[512];
+	size_t b, k;
+	for (b = 0; b < 256; b++) map[b] = (b == '/');
+	for (k = 0; k < m->ncls; k++) {	// split the classes by each set.
+		int n = 0;
+		memset(remap, -1, sizeof(remap));
+		for (b = 0; b < 256; b++) {
+			int in = (m->cls[k][b / 64] >> (b % 64)) & 1;
+			int *to = &remap[map[b] * 2 + in];
+			if (*to == -1) *to = n++;
+			map[b] = *to;
+		}
+	}
+	m->nbc = 0;
+	for (b = 0; b < 256; b++) {
+		m->bytecls[b] = map[b];
+		if (map[b] >= m->nbc) {
+			m->nbc = map[b] + 1;
+			m->rep[map[b]] = b;
+		}
+	}
+	m->words = (m->ntoks + 63) / 64;
+	if (!m->words) m->words = 1;
+	m->ssize = (sizeof(mstate) + m->nbc * sizeof(int) + 7) / 8 * 8 +
+				m->words * 8;
+	m->slimit = STATEBUDGET / m->ssize;
+	if (m->slimit > MAXSTATES) m->slimit = MAXSTATES;
+	if (m->slimit < 2) m->slimit = 2;
+	// malloc() maps this much, only the states made are ever touched.
+	m->states = xmalloc((size_t)m->slimit * m->ssize);
+	m->hsize = 2 * m->slimit;
+	m->htab = xmalloc(m->hsize * sizeof(int));
+	memset(m->htab, -1, m->hsize * sizeof(int));
+	m->scratch = xmalloc(m->words * 8);
+	memset(m->scratch, 0, m->words * 8);
+	size_t i;
+	for (i = 0; i < m->ntoks; i++)	// the start of every rule.
+		if (i == 0 || m->toks[i - 1].kind == T_END)
+			closure(m, m->scratch, i);
+	findstate(m, m->scratch);	// state 0.
+} // compile_matcher()
+
+static inline int
+nextstate(matcher *m, int s, unsigned char c)
+{ /* The state after s on c. Lock free once it has been worked out. */
+	int bc = m->bytecls[c];
+	int n = __atomic_load_n(&STATE(m, s)->next[bc], __ATOMIC_ACQUIRE);
+	return (n >= 0) ? n : addnext(m, s, bc);
+} // nextstate()
+
+static inline int
+excluded(matcher *m, int s, int isdir)
+{ /* Whether the first rule to match, if any, at s excludes. */
+	mstate *ms = STATE(m, s);
+	int r = (isdir) ? ms->acceptdir : ms->acceptfile;
+	return r != NORULE && !m->rules[r].include;
+} // excluded()
+
+int
+match_dirstate(matcher *m, const char *path)
+{ /* The state to match the entries of the dir path, relative to the
+   * root, from with match_name(). Path is taken not to be excluded.
+  */
+	int s = 0;
+	if (!*path) return s;
+	const unsigned char *cp;
+	for (cp = (const unsigned char *)path; *cp; cp++)
+		s = nextstate(m, s, *cp);
+	return nextstate(m, s, '/');
+} // match_dirstate()
+
+int
+match_name(matcher *m, int state, const char *name, int isdir)
+{ /* Whether name, in the dir whose match_dirstate() is state, is
+   * excluded.
+  */
+	const unsigned char *cp;
+	for (cp = (const unsigned char *)name; *cp; cp++)
+		state = nextstate(m, state, *cp);
+	return excluded(m, state, isdir);
+} // match_name()
+
+int
+match_path(matcher *m, const char *path, int isdir)
+{ /* Whether path, relative to the root, or any dir it is in is
+   * excluded.
+  */
+	const unsigned char *cp;
+	int s = 0;
+	for (cp = (const unsigned char *)path; *cp; cp++) {
+		if (*cp == '/' && excluded(m, s, 1)) return 1;
+		s = nextstate(m, s, *cp);
+	}
+	return excluded(m, s, isdir);
+} // match_path()
+
+void
+addtok(matcher *m, unsigned char kind, int arg)
+{ /* Append a token to the last rule. */
+	if (m->ntoks == m->tlimit) {
+		m->tlimit = (m->tlimit) ? m->tlimit * 2 : 64;
+		m->toks = realloc(m->toks, m->tlimit * sizeof(mtok));
+		if (!m->toks) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	m->toks[m->ntoks].kind = kind;
+	m->toks[m->ntoks].arg = arg;
+	m->ntoks++;
+} // addtok()
+
+int
+newclass(matcher *m)
+{ /* A new empty byte class, returns its number. */
+	if (m->ncls == m->climit) {
+		m->climit = (m->climit) ? m->climit * 2 : 32;
+		m->cls = realloc(m->cls, m->climit * sizeof(m->cls[0]));
+		if (!m->cls) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	memset(m->cls[m->ncls], 0, sizeof(m->cls[0]));
+	return m->ncls++;
+} // newclass()
+
+int
+litclass(matcher *m, unsigned char c)
+{ /* The class of the one byte c, made once. */
+	if (m->litcls[c] == -1) {
+		m->litcls[c] = newclass(m);
+		m->cls[m->litcls[c]][c / 64] |= 1ULL << (c % 64);
+	}
+	return m->litcls[c];
+} // litclass()
+
+const char
+*parseclass(matcher *m, const char *cp)
+{ /* Make a class of the set at cp, which is on its '['. Returns where
+   * the set ends, or NULL if it has no closing ']' and no class was
+   * made.
+  */
+	const unsigned char *up = (const unsigned char *)cp + 1;
+	int negate = 0;
+	if (*up == '!' || *up == '^') {
+		negate = 1;
+		up++;
+	}
+	const unsigned char *first = up;
+	while (*up && (*up != ']' || up == first)) up++;
+	if (!*up) return NULL;
+	int k = newclass(m);
+	const unsigned char *end = up;
+	for (up = first; up < end; up++) {
+		unsigned c = *up, hi = c;
+		if (up + 2 < end && up[1] == '-') {
+			hi = up[2];
+			up += 2;
+		}
+		for (; c <= hi; c++) m->cls[k][c / 64] |= 1ULL << (c % 64);
+	}
+	if (negate) {
+		int w;
+		for (w = 0; w < 4; w++) m->cls[k][w] = ~m->cls[k][w];
+	}
+	m->cls[k]['/' / 64] &= ~(1ULL << ('/' % 64));	// never matches '/'.
+	return (const char *)end + 1;
+} // parseclass()
+
+void
+closure(matcher *m, uint64_t *set, size_t i)
+{ /* Put token i in set, and those that can be reached from it
+   * without taking a byte.
+  */
+	while (!(set[i / 64] & (1ULL << (i % 64)))) {
+		set[i / 64] |= 1ULL << (i % 64);
+		unsigned char kind = m->toks[i].kind;
+		if (kind == T_STAR || kind == T_DSTAR) i++;
+		else if (kind == T_FLOATA) i += 2;
+		else break;
+	}
+} // closure()
+
+int
+findstate(matcher *m, uint64_t *set)
+{ /* The state of the token set, made if there is not one yet. Called
+   * with the lock held, or before there can be other threads.
+  */
+	uint64_t h = 14695981039346656037ULL;
+	size_t w;
+	for (w = 0; w < m->words; w++) h = (h ^ set[w]) * 1099511628211ULL;
+	size_t at = h % m->hsize;
+	while (m->htab[at] != -1) {
+		if (memcmp(STATESET(m, m->htab[at]), set, m->words * 8) == 0)
+			return m->htab[at];
+		at = (at + 1) % m->hsize;
+	}
+	if (m->nstates == m->slimit) {
+		fprintf(stderr, "Exclude patterns too complex: over %d states."
+				" Use fewer or simpler patterns.\n", m->slimit);
+		exit(EXIT_FAILURE);
+	}
+	int s = m->nstates;
+	mstate *ms = STATE(m, s);
+	memset(ms->next, -1, m->nbc * sizeof(int));
+	memcpy(STATESET(m, s), set, m->words * 8);
+	ms->acceptdir = ms->acceptfile = NORULE;
+	size_t i;
+	for (i = 0; i < m->ntoks; i++) {
+		if (!(set[i / 64] & (1ULL << (i % 64)))) continue;
+		if (m->toks[i].kind != T_END) continue;
+		int r = m->toks[i].arg;
+		if (r < ms->acceptdir) ms->acceptdir = r;
+		if (!m->rules[r].dironly && r < ms->acceptfile) ms->acceptfile = r;
+	}
+	m->htab[at] = s;
+	__atomic_store_n(&m->nstates, s + 1, __ATOMIC_RELEASE);
+	return s;
+} // findstate()
+
+int
+addnext(matcher *m, int s, int bc)
+{ /* Work out the state after s on a byte of class bc, and record it. */
+	pthread_mutex_lock(&m->lock);
+	mstate *ms = STATE(m, s);
+	int n = ms->next[bc];
+	if (n >= 0) {	// another thread got there first.
+		pthread_mutex_unlock(&m->lock);
+		return n;
+	}
+	unsigned char c = m->rep[bc];
+	uint64_t *from = STATESET(m, s), *to = m->scratch;
+	memset(to, 0, m->words * 8);
+	size_t w;
+	for (w = 0; w < m->words; w++) {
+		uint64_t bits = from[w];
+		while (bits) {
+			size_t i = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			mtok *t = &m->toks[i];
+			switch (t->kind) {
+			case T_CLASS:
+				if ((m->cls[t->arg][c / 64] >> (c % 64)) & 1)
+					closure(m, to, i + 1);
+				break;
+			case T_STAR:
+				if (c != '/') closure(m, to, i);
+				break;
+			case T_DSTAR:
+				closure(m, to, i);
+				break;
+			case T_FLOATA:
+			case T_FLOATB:
+				if (t->kind == T_FLOATB) i--;
+				closure(m, to, (c == '/') ? i : i + 1);
+				break;
+			}
+		}
+	}
+	n = findstate(m, to);
+	__atomic_store_n(&ms->next[bc], n, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&m->lock);
+	return n;
+} // addnext()
@@ -0,0 +1,94 @@
+/*    match.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of match.[h|c] is to decide which entries of a tree are
+ * excluded by a list of glob patterns, all compiled into one DFA, so
+ * that each byte of a path is looked at once however many patterns
+ * there are. The DFA is built as paths need it, one state at a time.
+ * */
+#ifndef _MATCH_H
+#define _MATCH_H
+#define _GNU_SOURCE 1
+
+#include <stdint.h>
+#include <pthread.h>
+
+typedef struct mrule {
+	int include;	// a match is not excluded.
+	int dironly;	// matches only dirs, the pattern ended in '/'.
+} mrule;
+
+typedef struct mtok {	// one step of a pattern.
+	unsigned char kind;
+	int arg;		// the class of T_CLASS, the rule of T_END.
+} mtok;
+
+typedef struct matcher {
+	mrule *rules;	// in the order given, the first to match decides.
+	size_t nrules;
+	size_t rlimit;
+	mtok *toks;		// every rule, each ended by a T_END.
+	size_t ntoks;
+	size_t tlimit;
+	uint64_t (*cls)[4];	// the byte sets of the T_CLASS tokens.
+	size_t ncls;
+	size_t climit;
+	int litcls[256];	// the class of each literal byte, -1 if none.
+	uint64_t sig;		// hash of the patterns.
+	// the DFA, each state the set of tokens a path so far could be at.
+	unsigned char bytecls[256];	// bytes no pattern tells apart.
+	unsigned char rep[256];		// a byte of each such class.
+	int nbc;
+	size_t words;		// in the token set of a state.
+	size_t ssize;		// bytes a state takes.
+	char *states;		// never moved, read without the lock.
+	int nstates;
+	int slimit;
+	int *htab;			// the states by their token set.
+	size_t hsize;
+	uint64_t *scratch;
+	pthread_mutex_t lock;	// held to add states.
+} matcher;
+
+matcher
+*init_matcher(void);
+
+void
+free_matcher(matcher *m);
+
+void
+add_pattern(matcher *m, const char *pat, int include);
+
+void
+add_patternfile(matcher *m, const char *fn, int include);
+
+void
+compile_matcher(matcher *m);
+
+int
+match_dirstate(matcher *m, const char *path);
+
+int
+match_name(matcher *m, int state, const char *name, int isdir);
+
+int
+match_path(matcher *m, const char *path, int isdir);
+
+#endif
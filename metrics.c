@@ -0,0 +1,272 @@
+/*    metrics.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of metrics.[h|c] is to time each phase of a run and
+ * count, and time, the syscalls it makes, then write it all out as JSON
+ * or as a Prometheus textfile. Only the phase and the work done in it
+ * are kept track of unless more is asked for.
+ * */
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "files.h"
+#include "metrics.h"
+
+metrics mtr = { .phase = -1 };
+
+static const char *callnames[MC_NCALLS] = {
+	"stat", "getdents", "open", "link", "unlink", "mkdir", "rmdir",
+	"rename", "copy", "uring_batch"
+};
+
+static const char *phasenames[MP_NPHASES] = {
+	"src_walk", "src_sort", "pool", "dst_walk", "dst_sort", "diff",
+	"rename", "verify", "unlink", "rmdir", "mkdir", "link"
+};
+
+static void writejson(FILE *fpo);
+static void writeprom(FILE *fpo);
+static double secs(uint64_t ns);
+
+void
+init_metrics(void)
+{ /* Start recording. */
+	mtr.on = 1;
+	mtr.phase = -1;
+	mtr.t0 = metrics_now();
+} // init_metrics()
+
+uint64_t
+metrics_now(void)
+{ /* Monotonic ns. */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+} // metrics_now()
+
+void
+metrics_phase(int phase)
+{ /* End the current phase and start phase, none if -1. A phase may be
+   * entered more than once, its times add up. Always kept, it costs
+   * next to nothing and the progress report needs it.
+  */
+	uint64_t now = metrics_now();
+	if (mtr.phase >= 0) mtr.wall[mtr.phase] += now - mtr.start;
+	mtr.phase = phase;
+	mtr.start = now;
+} // metrics_phase()
+
+uint64_t
+mt_start(void)
+{ /* The time a syscall is made, 0 if not recording. */
+	return (mtr.on) ? metrics_now() : 0;
+} // mt_start()
+
+void
+mt_end(int call, uint64_t t0, int failed)
+{ /* Record a syscall of kind call made at t0. Safe from any thread. */
+	if (!mtr.on) return;
+	uint64_t ns = metrics_now() - t0;
+	int b = (ns) ? 64 - __builtin_clzll(ns) : 0;
+	if (b >= MHIST) b = MHIST - 1;
+	mcall *mc = &mtr.total[call];
+	__atomic_add_fetch(&mc->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&mc->nsec, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&mc->hist[b], 1, __ATOMIC_RELAXED);
+	if (failed) __atomic_add_fetch(&mc->errors, 1, __ATOMIC_RELAXED);
+	if (mtr.phase >= 0)
+		__atomic_add_fetch(&mtr.calls[mtr.phase][call], 1, __ATOMIC_RELAXED);
+} // mt_end()
+
+void
+mt_count(int call, uint64_t n, uint64_t errors)
+{ /* Record n syscalls of kind call made as a batch, not timed one by
+   * one.
+  */
+	if (!mtr.on) return;
+	mcall *mc = &mtr.total[call];
+	__atomic_add_fetch(&mc->count, n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&mc->errors, errors, __ATOMIC_RELAXED);
+	if (mtr.phase >= 0)
+		__atomic_add_fetch(&mtr.calls[mtr.phase][call], n, __ATOMIC_RELAXED);
+} // mt_count()
+
+void
+mt_done(uint64_t n)
+{ /* Count n more units of work done in the current phase, entries
+   * walked or actions done. Safe from any thread.
+  */
+	int phase = mtr.phase;
+	if (phase >= 0) __atomic_add_fetch(&mtr.done[phase], n, __ATOMIC_RELAXED);
+} // mt_done()
+
+const char
+*phasename(int phase)
+{ /* The name of phase, as in the metrics. */
+	return (phase >= 0 && phase < MP_NPHASES) ? phasenames[phase] : "idle";
+} // phasename()
+
+void
+metrics_listmem(size_t bytes)
+{ /* Note the bytes held by the listings now, keeping the most. */
+	if (mtr.on && bytes > mtr.listmem) mtr.listmem = bytes;
+} // metrics_listmem()
+
+void
+metrics_write(const char *fn)
+{ /* Write what has been recorded to fn, '-' for stdout, as a Prometheus
+   * textfile if fn ends in ".prom", else as JSON. Written to a temp
+   * file then renamed so that a collector never reads half of it.
+  */
+	if (!mtr.on) return;
+	metrics_phase(mtr.phase);	// bring the current one up to date.
+	size_t len = strlen(fn);
+	int prom = (len > 5 && strcmp(fn + len - 5, ".prom") == 0);
+	if (strcmp(fn, "-") == 0) {
+		writejson(stdout);
+		fflush(stdout);
+		return;
+	}
+	char tmpfn[PATH_MAX];
+	snprintf(tmpfn, PATH_MAX, "%s.%d", fn, getpid());
+	FILE *fpo = dofopen(tmpfn, "w");
+	if (prom) writeprom(fpo);
+	else writejson(fpo);
+	if (ferror(fpo)) {
+		perror(tmpfn);
+		exit(EXIT_FAILURE);
+	}
+	dofclose(fpo);
+	if (rename(tmpfn, fn) == -1) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+} // metrics_write()
+
+double
+secs(uint64_t ns)
+{
+	return ns / 1e9;
+} // secs()
+
+void
+writejson(FILE *fpo)
+{ /* All of it as one JSON object. */
+	struct rusage ru, rc;
+	getrusage(RUSAGE_SELF, &ru);
+	getrusage(RUSAGE_CHILDREN, &rc);
+	int p, c, b;
+	fprintf(fpo, "{\"run_seconds\":%.6f,\"peak_rss_bytes\":%ld,"
+			"\"children_peak_rss_bytes\":%ld,\"listing_bytes\":%zu,",
+			secs(metrics_now() - mtr.t0), ru.ru_maxrss * 1024L,
+			rc.ru_maxrss * 1024L, mtr.listmem);
+	fputs("\"phases\":{", fpo);
+	for (p = 0; p < MP_NPHASES; p++) {
+		fprintf(fpo, "%s\"%s\":{\"seconds\":%.6f,\"done\":%llu,"
+				"\"calls\":{", (p) ? "," : "", phasenames[p],
+				secs(mtr.wall[p]), (unsigned long long)mtr.done[p]);
+		for (c = 0; c < MC_NCALLS; c++)
+			fprintf(fpo, "%s\"%s\":%llu", (c) ? "," : "", callnames[c],
+					(unsigned long long)mtr.calls[p][c]);
+		fputs("}}", fpo);
+	}
+	fputs("},\"calls\":{", fpo);
+	for (c = 0; c < MC_NCALLS; c++) {
+		mcall *mc = &mtr.total[c];
+		fprintf(fpo, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,"
+				"\"seconds\":%.6f,\"histogram_ns\":{", (c) ? "," : "",
+				callnames[c], (unsigned long long)mc->count,
+				(unsigned long long)mc->errors, secs(mc->nsec));
+		int first = 1;
+		for (b = 0; b < MHIST; b++) {	// only the buckets used.
+			if (!mc->hist[b]) continue;
+			fprintf(fpo, "%s\"%llu\":%llu", (first) ? "" : ",",
+					1ULL << b, (unsigned long long)mc->hist[b]);
+			first = 0;
+		}
+		fputs("}}", fpo);
+	}
+	fputs("}}\n", fpo);
+} // writejson()
+
+void
+writeprom(FILE *fpo)
+{ /* All of it in the Prometheus text format. */
+	struct rusage ru, rc;
+	getrusage(RUSAGE_SELF, &ru);
+	getrusage(RUSAGE_CHILDREN, &rc);
+	int p, c, b;
+	fputs("# HELP synclink_run_seconds Wall time of the run.\n"
+			"# TYPE synclink_run_seconds gauge\n", fpo);
+	fprintf(fpo, "synclink_run_seconds %.6f\n",
+			secs(metrics_now() - mtr.t0));
+	fputs("# HELP synclink_last_run_timestamp_seconds When the run"
+			" ended.\n# TYPE synclink_last_run_timestamp_seconds gauge\n",
+			fpo);
+	fprintf(fpo, "synclink_last_run_timestamp_seconds %ld\n",
+			(long)time(NULL));
+	fputs("# HELP synclink_peak_rss_bytes Peak resident set size.\n"
+			"# TYPE synclink_peak_rss_bytes gauge\n", fpo);
+	fprintf(fpo, "synclink_peak_rss_bytes{process=\"main\"} %ld\n",
+			ru.ru_maxrss * 1024L);
+	fprintf(fpo, "synclink_peak_rss_bytes{process=\"children\"} %ld\n",
+			rc.ru_maxrss * 1024L);
+	fputs("# HELP synclink_listing_bytes Most memory held by the tree"
+			" listings.\n# TYPE synclink_listing_bytes gauge\n", fpo);
+	fprintf(fpo, "synclink_listing_bytes %zu\n", mtr.listmem);
+	fputs("# HELP synclink_phase_seconds Wall time of each phase.\n"
+			"# TYPE synclink_phase_seconds gauge\n", fpo);
+	for (p = 0; p < MP_NPHASES; p++)
+		fprintf(fpo, "synclink_phase_seconds{phase=\"%s\"} %.6f\n",
+				phasenames[p], secs(mtr.wall[p]));
+	fputs("# HELP synclink_phase_calls Syscalls made in each phase.\n"
+			"# TYPE synclink_phase_calls gauge\n", fpo);
+	for (p = 0; p < MP_NPHASES; p++)
+		for (c = 0; c < MC_NCALLS; c++)
+			if (mtr.calls[p][c]) fprintf(fpo,
+					"synclink_phase_calls{phase=\"%s\",call=\"%s\"} %llu\n",
+					phasenames[p], callnames[c],
+					(unsigned long long)mtr.calls[p][c]);
+	fputs("# HELP synclink_call_errors Syscalls that failed.\n"
+			"# TYPE synclink_call_errors gauge\n", fpo);
+	for (c = 0; c < MC_NCALLS; c++)
+		fprintf(fpo, "synclink_call_errors{call=\"%s\"} %llu\n",
+				callnames[c], (unsigned long long)mtr.total[c].errors);
+	fputs("# HELP synclink_call_duration_seconds Latency of the syscalls"
+			" timed one by one.\n"
+			"# TYPE synclink_call_duration_seconds histogram\n", fpo);
+	for (c = 0; c < MC_NCALLS; c++) {
+		mcall *mc = &mtr.total[c];
+		uint64_t sum = 0, timed = 0;
+		for (b = 0; b < MHIST; b++) timed += mc->hist[b];
+		for (b = 0; b < MHIST; b++) {	// the same buckets every run.
+			sum += mc->hist[b];
+			fprintf(fpo, "synclink_call_duration_seconds_bucket{call=\"%s\","
+					"le=\"%g\"} %llu\n", callnames[c], secs(1ULL << b),
+					(unsigned long long)sum);
+		}
+		fprintf(fpo, "synclink_call_duration_seconds_bucket{call=\"%s\","
+				"le=\"+Inf\"} %llu\n", callnames[c], (unsigned long long)timed);
+		fprintf(fpo, "synclink_call_duration_seconds_sum{call=\"%s\"} %.9f\n",
+				callnames[c], secs(mc->nsec));
+		fprintf(fpo, "synclink_call_duration_seconds_count{call=\"%s\"}"
+				" %llu\n", callnames[c], (unsigned long long)timed);
+	}
+} // writeprom()
@@ -0,0 +1,117 @@
+/*    metrics.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of metrics.[h|c] is to time each phase of a run and
+ * count, and time, the syscalls it makes, then write it all out as JSON
+ * or as a Prometheus textfile. Only the phase and the work done in it
+ * are kept track of unless more is asked for.
+ * */
+#ifndef _METRICS_H
+#define _METRICS_H
+#define _GNU_SOURCE 1
+
+#include <stdint.h>
+#include <time.h>
+#include "str.h"
+
+enum {	// the syscalls metered.
+	MC_STAT,
+	MC_GETDENTS,
+	MC_OPEN,
+	MC_LINK,
+	MC_UNLINK,
+	MC_MKDIR,
+	MC_RMDIR,
+	MC_RENAME,
+	MC_COPY,		// a whole file copied by copyat().
+	MC_URING,		// an io_uring batch, its ops are counted as above.
+	MC_NCALLS
+};
+
+enum {	// the phases of a sync.
+	MP_SRCWALK,
+	MP_SRCSORT,
+	MP_POOL,
+	MP_DSTWALK,
+	MP_DSTSORT,
+	MP_DIFF,
+	MP_RENAME,
+	MP_VERIFY,
+	MP_UNLINK,
+	MP_RMDIR,
+	MP_MKDIR,
+	MP_LINK,
+	MP_NPHASES
+};
+
+#define MHIST 36	// latency buckets, bucket i is under 2^i ns.
+
+typedef struct mcall {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t nsec;		// of those timed.
+	uint64_t hist[MHIST];
+} mcall;
+
+typedef struct metrics {
+	int on;
+	int phase;			// -1 if none.
+	uint64_t start;		// of the phase.
+	uint64_t t0;		// of the run.
+	uint64_t wall[MP_NPHASES];
+	uint64_t done[MP_NPHASES];	// entries walked or actions done.
+	uint64_t calls[MP_NPHASES][MC_NCALLS];
+	mcall total[MC_NCALLS];
+	size_t listmem;		// the most bytes held by the tree listings.
+} metrics;
+
+extern metrics mtr;
+
+void
+init_metrics(void);
+
+uint64_t
+metrics_now(void);
+
+void
+metrics_phase(int phase);
+
+uint64_t
+mt_start(void);
+
+void
+mt_end(int call, uint64_t t0, int failed);
+
+void
+mt_count(int call, uint64_t n, uint64_t errors);
+
+void
+mt_done(uint64_t n);
+
+const char
+*phasename(int phase);
+
+void
+metrics_listmem(size_t bytes);
+
+void
+metrics_write(const char *fn);
+
+#endif
@@ -0,0 +1,348 @@
+/*    mkbenchtree.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of mkbenchtree.c is to make source and destination trees
+ * of any size and shape for benchmarking synclink, and to run and time
+ * synclink on them.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "str.h"
+
+typedef struct gendata {
+	int depth;			// levels of dirs below the root.
+	int fanout;			// subdirs in each dir.
+	size_t files;		// spread evenly over all dirs.
+	size_t huge;		// files in the one huge dir.
+	size_t size;		// bytes in each file.
+	int link;			// percent of files linked in dst.
+	int copy;			// percent copied in dst, the rest are missing.
+	int extra;			// percent more files in dst only.
+	uint64_t seed;
+	size_t ndirs;
+	size_t dirno;		// dirs made so far.
+	char *buf;			// file content.
+	// what was made.
+	size_t nfiles, nlinks, ncopies, nmissing, nextras;
+} gendata;
+
+static void dohelp(int forced);
+static void gentree(gendata *gd, int sfd, int dfd, int level);
+static void genfiles(gendata *gd, int sfd, int dfd, size_t count);
+static void genfile(gendata *gd, int dirfd, const char *name, size_t n);
+static int subdir(int dirfd, const char *name);
+static uint64_t rnd(gendata *gd);
+static int runtimed(const char *label, char **argv);
+static double now(void);
+
+static const char *helpmsg =
+  "\n\tUsage:\tmkbenchtree [option] outdir\n"
+  "\t\tmkbenchtree -r label command [arg...]\n"
+  "\n\tMakes outdir/src and outdir/dst for synclink to sync.\n"
+  "\n\tOptions:\n"
+  "\t-h outputs this help message.\n"
+  "\t-d N Levels of dirs below the root. Default 3.\n"
+  "\t-f N Subdirs in each dir. Default 10.\n"
+  "\t-n N Files, spread evenly over the dirs. Default 100000.\n"
+  "\t-H N Files in one more dir at the root, 'huge'. Default 0.\n"
+  "\t-s N Bytes in each file. Default 0.\n"
+  "\t-l P Percent of the files already linked in dst. Default 90.\n"
+  "\t-c P Percent copied in dst. Default 5. Those neither linked nor\n"
+  "\t   copied are missing from dst.\n"
+  "\t-e P Percent more files in dst that are not in src. Default 5.\n"
+  "\t-S N Seed for the choices. Default 1.\n"
+  "\t-r label Run command, not make a tree. Its stderr sentences\n"
+  "\t   that hold no path are shown timed, as are its wall time, cpu\n"
+  "\t   times and peak RSS.\n"
+  ;
+
+int main(int argc, char **argv)
+{
+	int opt;
+	char *label = NULL;
+	gendata gd;
+	memset(&gd, 0, sizeof(gendata));
+	// set defaults
+	gd.depth = 3;
+	gd.fanout = 10;
+	gd.files = 100000;
+	gd.link = 90;
+	gd.copy = 5;
+	gd.extra = 5;
+	gd.seed = 1;
+
+	while((opt = getopt(argc, argv, "+hd:f:n:H:s:l:c:e:S:r:")) != -1) {
+		switch(opt){
+		case 'h':
+			dohelp(0);
+		break;
+		case 'd':
+		gd.depth = strtol(optarg, NULL, 10);
+		break;
+		case 'f':
+		gd.fanout = strtol(optarg, NULL, 10);
+		break;
+		case 'n':
+		gd.files = strtoull(optarg, NULL, 10);
+		break;
+		case 'H':
+		gd.huge = strtoull(optarg, NULL, 10);
+		break;
+		case 's':
+		gd.size = strtoull(optarg, NULL, 10);
+		break;
+		case 'l':
+		gd.link = strtol(optarg, NULL, 10);
+		break;
+		case 'c':
+		gd.copy = strtol(optarg, NULL, 10);
+		break;
+		case 'e':
+		gd.extra = strtol(optarg, NULL, 10);
+		break;
+		case 'S':
+		gd.seed = strtoull(optarg, NULL, 10);
+		break;
+		case 'r':
+		label = optarg;
+		break;
+		default:
+			dohelp(1);
+		break;
+		} //switch()
+	}//while()
+
+	if (label) {
+		if (!argv[optind]) dohelp(1);
+		return runtimed(label, argv + optind);
+	}
+	if (!argv[optind] || gd.depth < 0 || gd.fanout < 0 ||
+			gd.link < 0 || gd.copy < 0 || gd.link + gd.copy > 100 ||
+			gd.extra < 0) {
+		fputs("Bad or missing argument.\n", stderr);
+		dohelp(1);
+	}
+	if (!gd.seed) gd.seed = 1;	// xorshift sticks at 0.
+	// dirs in the tree, 1 + f + f^2 ... f^depth.
+	size_t level = 1;
+	int i;
+	gd.ndirs = 1;
+	for (i = 0; i < gd.depth && gd.fanout; i++) {
+		level *= gd.fanout;
+		gd.ndirs += level;
+	}
+	gd.buf = xmalloc(gd.size + 8);
+	for (i = 0; (size_t)i < gd.size + 8; i++) gd.buf[i] = rnd(&gd);
+	double t0 = now();
+	if (mkdir(argv[optind], 0775) == -1 && errno != EEXIST) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	int ofd = subdir(AT_FDCWD, argv[optind]);
+	int sfd = subdir(ofd, "src");
+	int dfd = subdir(ofd, "dst");
+	gentree(&gd, sfd, dfd, 0);
+	if (gd.huge) {
+		int hsfd = subdir(sfd, "huge");
+		int hdfd = subdir(dfd, "huge");
+		genfiles(&gd, hsfd, hdfd, gd.huge);
+		close(hsfd);
+		close(hdfd);
+	}
+	close(sfd);
+	close(dfd);
+	close(ofd);
+	fprintf(stderr, "%zu dirs, %zu files: %zu linked, %zu copied, %zu"
+			" missing, %zu extra in %.1fs\n", gd.ndirs + (gd.huge > 0),
+			gd.nfiles, gd.nlinks, gd.ncopies, gd.nmissing, gd.nextras,
+			now() - t0);
+	free(gd.buf);
+	return 0;
+}//main()
+
+void dohelp(int forced)
+{
+  fputs(helpmsg, stderr);
+  exit(forced);
+}
+
+void gentree(gendata *gd, int sfd, int dfd, int level)
+{	/* Fill the dir sfd and its copy dfd with their share of the files,
+	 * then make the subdirs and fill them the same way.
+	*/
+	size_t count = gd->files / gd->ndirs;
+	if (gd->dirno++ < gd->files % gd->ndirs) count++;
+	genfiles(gd, sfd, dfd, count);
+	if (level == gd->depth) return;
+	int i;
+	char name[32];
+	for (i = 0; i < gd->fanout; i++) {
+		sprintf(name, "d%d", i);
+		int s = subdir(sfd, name);
+		int d = subdir(dfd, name);
+		gentree(gd, s, d, level + 1);
+		close(s);
+		close(d);
+	}
+} // gentree()
+
+void genfiles(gendata *gd, int sfd, int dfd, size_t count)
+{	/* Make count files in sfd and in dfd each one linked, copied or
+	 * not there at all; then the extra files in dfd only.
+	*/
+	size_t i;
+	char name[32];
+	for (i = 0; i < count; i++) {
+		sprintf(name, "f%zu", i);
+		genfile(gd, sfd, name, gd->nfiles);
+		int r = rnd(gd) % 100;
+		if (r < gd->link) {
+			if (linkat(sfd, name, dfd, name, 0) == -1) {
+				perror(name);
+				exit(EXIT_FAILURE);
+			}
+			gd->nlinks++;
+		} else if (r < gd->link + gd->copy) {
+			genfile(gd, dfd, name, gd->nfiles);
+			gd->ncopies++;
+		} else {
+			gd->nmissing++;
+		}
+		gd->nfiles++;
+	}
+	// as many as keep the total right, small dirs get none otherwise.
+	size_t extras = gd->nfiles * gd->extra / 100 - gd->nextras;
+	for (i = 0; i < extras; i++) {
+		sprintf(name, "x%zu", i);
+		genfile(gd, dfd, name, ~gd->nextras);
+		gd->nextras++;
+	}
+} // genfiles()
+
+void genfile(gendata *gd, int dirfd, const char *name, size_t n)
+{	/* Make file name of gd->size bytes, its content set by n. */
+	int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					0664);
+	if (fd == -1) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	if (gd->size) {
+		memcpy(gd->buf, &n, (gd->size < sizeof(n)) ? gd->size : sizeof(n));
+		if (write(fd, gd->buf, gd->size) != (ssize_t)gd->size) {
+			perror(name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(fd);
+} // genfile()
+
+int subdir(int dirfd, const char *name)
+{	/* Make dir name in dirfd if it is not there and open it. */
+	if (mkdirat(dirfd, name, 0775) == -1 && errno != EEXIST) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+} // subdir()
+
+uint64_t rnd(gendata *gd)
+{	/* xorshift64, the same trees for the same seed. */
+	gd->seed ^= gd->seed << 13;
+	gd->seed ^= gd->seed >> 7;
+	gd->seed ^= gd->seed << 17;
+	return gd->seed;
+} // rnd()
+
+int runtimed(const char *label, char **argv)
+{	/* Run argv and report on it. Each line it writes to stderr that
+	 * is a sentence with no '/' in it, a progress message rather than
+	 * one on a path it works on, is shown with the time it was written.
+	 * Returns the exit status of the command.
+	*/
+	int pfd[2];
+	if (pipe(pfd) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	double t0 = now();
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (!pid) {
+		close(pfd[0]);
+		dup2(pfd[1], STDERR_FILENO);
+		close(pfd[1]);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	close(pfd[1]);
+	FILE *fpi = fdopen(pfd[0], "r");
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n;
+	while ((n = getline(&line, &len, fpi)) != -1) {
+		if (strchr(line, '/') || n < 2 || line[n - 2] != '.') continue;
+		fprintf(stderr, "%s: %8.3fs %s", label, now() - t0, line);
+	}
+	free(line);
+	fclose(fpi);
+	int status;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) == -1) {
+		perror("wait4");
+		exit(EXIT_FAILURE);
+	}
+	double wall = now() - t0;
+	int res = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+	printf("%s: wall %.3fs user %.3fs sys %.3fs maxrss %ld KiB exit %d\n",
+			label, wall,
+			ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+			ru.ru_maxrss, res);
+	return res;
+} // runtimed()
+
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+} // now()
@@ -40,3 +40,17 @@ ln Test/from/Linked/linked Test/to/Linked
 echo tolink > Test/from/Tolink/tolink
 echo deletethis > Test/to/DeleteThis/deletethis
 echo level2 > Test/from/Level1/Level2/level2
+
+# more relinks than files to link, and a move among them
+mkdir -p Test/from/Relinked Test/to/Relinked/gone
+for f in a1 $(seq -f r%g 12); do echo $f > Test/from/Relinked/$f; done
+for f in $(seq -f r%g 12); do cp Test/from/Relinked/$f Test/to/Relinked; done
+ln Test/from/Relinked/a1 Test/to/Relinked/gone/old
+
+# a link moved onto the path of a copy that differs, which must be
+# relinked, not renamed over
+mkdir -p Test/from/Moved Test/to/Moved/gone
+echo new > Test/from/Moved/p
+echo n > Test/from/Moved/n
+echo diverged > Test/to/Moved/p
+ln Test/from/Moved/p Test/to/Moved/gone/old
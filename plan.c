@@ -0,0 +1,237 @@
+/*    plan.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of plan.[h|c] is to save an action list to a file and to
+ * load it again, so that the changes can be reviewed before they are
+ * made and made later without walking either tree again.
+ * The file is JSON lines: a header object with the roots, the count of
+ * each kind of action and the syscalls they will cost, then one object
+ * per action in the order difffslists() made them. A journal is a
+ * plan with checkpoint lines after it, see journal.[h|c].
+ * */
+
+#include "plan.h"
+
+void
+fputjson(const char *s, FILE *fp)
+{ /* Write s as a quoted JSON string. Bytes above 0x7f are passed
+   * through as they are, file names need not be valid UTF-8.
+  */
+	const unsigned char *cp = (const unsigned char *)s;
+	putc('"', fp);
+	for (; *cp; cp++) {
+		switch(*cp) {
+		case '"':
+			fputs("\\\"", fp);
+			break;
+		case '\\':
+			fputs("\\\\", fp);
+			break;
+		case '\n':
+			fputs("\\n", fp);
+			break;
+		case '\t':
+			fputs("\\t", fp);
+			break;
+		default:
+			if (*cp < 0x20) fprintf(fp, "\\u%04x", *cp);
+			else putc(*cp, fp);
+		}
+	}
+	putc('"', fp);
+} // fputjson()
+
+void
+writeplan(const char *fn, const char *src, const char *dst, actlist *al)
+{ /* Write al to fn, fn may be "-" for stdout. */
+	size_t count[ACT_RMDIR + 1] = {0};
+	size_t i;
+	for (i = 0; i < al->count; i++) count[al->acts[i].op]++;
+	// A relink is an unlink and a link, everything else one syscall.
+	size_t syscalls = al->count + count[ACT_RELINK];
+	FILE *fpo = (strcmp(fn, "-") == 0) ? stdout : dofopen(fn, "w");
+	fputs("{\"synclink\":1,\"src\":", fpo);
+	fputjson(src, fpo);
+	fputs(",\"dst\":", fpo);
+	fputjson(dst, fpo);
+	unsigned char op;
+	for (op = ACT_MKDIR; op <= ACT_RMDIR; op++)
+		fprintf(fpo, ",\"%s\":%zu", actname(op), count[op]);
+	fprintf(fpo, ",\"syscalls\":%zu}\n", syscalls);
+	char path[PATH_MAX];
+	for (i = 0; i < al->count; i++) {
+		fprintf(fpo, "{\"op\":\"%s\",\"path\":", actname(al->acts[i].op));
+		fputjson(actpath(&al->acts[i], path), fpo);
+		fputs("}\n", fpo);
+	}
+	if (fpo == stdout) fflush(fpo);
+	else dofclose(fpo);
+} // writeplan()
+
+static char
+*jsonstr(char **cpp)
+{ /* *cpp points at the opening quote of a JSON string. Unescape it in
+   * place, NUL terminate it and return it, leaving *cpp past it.
+   * Returns NULL if it is not a string.
+  */
+	char *cp = *cpp;
+	if (*cp != '"') return NULL;
+	char *ret = ++cp;
+	char *to = cp;
+	while (*cp && *cp != '"') {
+		if (*cp != '\\') {
+			*to++ = *cp++;
+			continue;
+		}
+		cp++;
+		switch(*cp) {
+		case 'n':
+			*to++ = '\n';
+			break;
+		case 't':
+			*to++ = '\t';
+			break;
+		case 'r':
+			*to++ = '\r';
+			break;
+		case 'b':
+			*to++ = '\b';
+			break;
+		case 'f':
+			*to++ = '\f';
+			break;
+		case 'u': {
+			char hex[5] = {0};
+			strncpy(hex, cp + 1, 4);
+			unsigned long u = strtoul(hex, NULL, 16);
+			cp += 4;
+			if (u < 0x80) {	// what fputjson() writes.
+				*to++ = u;
+			} else if (u < 0x800) {	// from a hand edited plan.
+				*to++ = 0xc0 | (u >> 6);
+				*to++ = 0x80 | (u & 0x3f);
+			} else {
+				*to++ = 0xe0 | (u >> 12);
+				*to++ = 0x80 | ((u >> 6) & 0x3f);
+				*to++ = 0x80 | (u & 0x3f);
+			}
+			}
+			break;
+		default:	// '"', '\\' and '/'.
+			*to++ = *cp;
+		}
+		if (*cp) cp++;
+	}
+	if (*cp != '"') return NULL;
+	*to = 0;
+	*cpp = cp + 1;
+	return ret;
+} // jsonstr()
+
+static char
+*jsonfield(char *line, const char *key)
+{ /* Return the unescaped string value of key in the object in line.
+   * Returns NULL if there is no such string value.
+  */
+	char find[NAME_MAX];
+	sprintf(find, "\"%s\":", key);
+	char *cp = strstr(line, find);
+	if (!cp) return NULL;
+	cp += strlen(find);
+	return jsonstr(&cp);
+} // jsonfield()
+
+static unsigned char
+opcode(const char *name)
+{ /* Reverse of actname(). Returns 0 if name is unknown. */
+	unsigned char op;
+	for (op = ACT_MKDIR; op <= ACT_RMDIR; op++)
+		if (strcmp(actname(op), name) == 0) return op;
+	return 0;
+} // opcode()
+
+static int
+relpath(const char *path)
+{ /* Whether path is relative and names something within the dir it
+   * is relative to: not empty, and no component empty, "." or "..".
+  */
+	const char *cp = path;
+	while (1) {
+		size_t len = strcspn(cp, "/");
+		if (len == 0 || (len == 1 && cp[0] == '.') ||
+				(len == 2 && cp[0] == '.' && cp[1] == '.')) return 0;
+		if (!cp[len]) return 1;
+		cp += len + 1;
+	}
+} // relpath()
+
+plan
+*readplan(const char *fn)
+{ /* Load the plan in fn. Any malformed line is fatal, as is any path
+   * that could reach outside dst.
+  */
+	plan *pl = xmalloc(sizeof(plan));
+	pl->md = readfile(fn, 1, 1);	// 1 extra to NUL terminate.
+	pl->al = init_actlist();
+	pl->at = NULL;
+	size_t n = memlinestostr(pl->md);
+	char *line = pl->md->fro;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		char *next = line + strlen(line) + 1;
+		if (i == 0) {
+			// The path strings are unescaped in place, so the header's
+			// dst must be taken before its src is NUL terminated.
+			pl->dst = jsonfield(line, "dst");
+			pl->src = jsonfield(line, "src");
+			if (!pl->src || !pl->dst || !strstr(line, "\"synclink\":1")) {
+				fprintf(stderr, "Not a synclink plan: %s\n", fn);
+				exit(EXIT_FAILURE);
+			}
+		} else if (strncmp(line, "{\"at\":", 6) == 0) {
+			// one cut short by a crash is not a checkpoint.
+			if (line[strlen(line) - 1] == '}') pl->at = line;
+		} else {
+			char *path = jsonfield(line, "path");
+			char *name = jsonfield(line, "op");
+			unsigned char op = (name) ? opcode(name) : 0;
+			if (!path || !op || !relpath(path)) {
+				fprintf(stderr, "Malformed line %zu in plan: %s\n",
+						i + 1, fn);
+				exit(EXIT_FAILURE);
+			}
+			addaction(pl->al, op, path);
+		}
+		line = next;
+	}
+	if (!n) {
+		fprintf(stderr, "Empty plan: %s\n", fn);
+		exit(EXIT_FAILURE);
+	}
+	return pl;
+} // readplan()
+
+void
+free_plan(plan *pl)
+{
+	free_actlist(pl->al);
+	free_mdata(pl->md);
+	free(pl);
+} // free_plan()
@@ -0,0 +1,57 @@
+/*    plan.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of plan.[h|c] is to save an action list to a file and to
+ * load it again, so that the changes can be reviewed before they are
+ * made and made later without walking either tree again.
+ * The file is JSON lines: a header object with the roots, the count of
+ * each kind of action and the syscalls they will cost, then one object
+ * per action in the order difffslists() made them. A journal is a
+ * plan with checkpoint lines after it, see journal.[h|c].
+ * */
+#ifndef _PLAN_H
+#define _PLAN_H
+#define _GNU_SOURCE 1
+
+#include "str.h"
+#include "files.h"
+#include "diff.h"
+
+typedef struct plan {
+	mdata *md;		// the plan file; the strings below point into it.
+	char *src;
+	char *dst;
+	actlist *al;
+	char *at;		// the last checkpoint, if a journal.c journal.
+} plan;
+
+void
+writeplan(const char *fn, const char *src, const char *dst, actlist *al);
+
+plan
+*readplan(const char *fn);
+
+void
+free_plan(plan *pl);
+
+void
+fputjson(const char *s, FILE *fp);
+
+#endif
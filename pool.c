@@ -0,0 +1,472 @@
+/*    pool.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of pool.[h|c] is to keep a content addressed pool of
+ * files: one link per distinct content, named by its hash and size, so
+ * that every file of the same content can be linked to the one inode.
+ * The hash of each file is cached by inode, size and mtime so that a
+ * file not changed since is never read again. Sets of files can also
+ * be hashed on many threads at once.
+ * */
+
+#include "pool.h"
+
+static const char phmagic[8] = "SLHASH01";
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static uint64_t rotl(uint64_t x, int r);
+static uint64_t xround(uint64_t acc, uint64_t in);
+static uint64_t get64(const unsigned char *p);
+static uint32_t get32(const unsigned char *p);
+static phent *phfind(pool *p, uint64_t dev, uint64_t ino);
+static void phgrow(pool *p);
+static void loadcache(pool *p);
+static void savecache(pool *p);
+static int samemap(int fd1, int fd2, size_t size);
+static void *hashworker(void *arg);
+
+typedef struct hashwork {
+	hashjob *jobs;
+	size_t n;
+	size_t next;		// the next job to take.
+} hashwork;
+
+uint64_t
+xxh64(const void *data, size_t len, uint64_t seed)
+{ /* XXH64 of data. Four independent lanes over each 32 byte stripe
+   * keep the multipliers busy; no vector instructions are needed for
+   * it to run at memory speed.
+  */
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t h;
+	if (len >= 32) {
+		uint64_t v1 = seed + P1 + P2;
+		uint64_t v2 = seed + P2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - P1;
+		const unsigned char *limit = end - 32;
+		do {
+			v1 = xround(v1, get64(p));
+			v2 = xround(v2, get64(p + 8));
+			v3 = xround(v3, get64(p + 16));
+			v4 = xround(v4, get64(p + 24));
+			p += 32;
+		} while (p <= limit);
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = (h ^ xround(0, v1)) * P1 + P4;
+		h = (h ^ xround(0, v2)) * P1 + P4;
+		h = (h ^ xround(0, v3)) * P1 + P4;
+		h = (h ^ xround(0, v4)) * P1 + P4;
+	} else {
+		h = seed + P5;
+	}
+	h += len;
+	for (; p + 8 <= end; p += 8) {
+		h ^= xround(0, get64(p));
+		h = rotl(h, 27) * P1 + P4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)get32(p) * P1;
+		h = rotl(h, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= (*p) * P5;
+		h = rotl(h, 11) * P1;
+	}
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+} // xxh64()
+
+uint64_t
+rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+} // rotl()
+
+uint64_t
+xround(uint64_t acc, uint64_t in)
+{
+	acc += in * P2;
+	return rotl(acc, 31) * P1;
+} // xround()
+
+uint64_t
+get64(const unsigned char *p)
+{ /* Little endian, as the hash is defined. */
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+} // get64()
+
+uint32_t
+get32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+} // get32()
+
+int
+hashfile(int dirfd, const char *path, struct stat *sb, uint64_t *hash)
+{ /* Hash the file path in dirfd, mapped rather than read; sb is its
+   * stat as it was before the read. Returns 0, or -1 with errno set.
+  */
+	int fd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) return -1;
+	if (fstat(fd, sb) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (sb->st_size == 0) {
+		*hash = xxh64(NULL, 0, 0);
+	} else {
+		void *map = mmap(NULL, sb->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise(map, sb->st_size, MADV_SEQUENTIAL);
+		*hash = xxh64(map, sb->st_size, 0);
+		munmap(map, sb->st_size);
+	}
+	close(fd);
+	return 0;
+} // hashfile()
+
+void
+hashfiles(hashjob *jobs, size_t n, int nthreads)
+{ /* Hash the n files of jobs using nthreads threads, each taking the
+   * next job as it finishes the last, so one big file does not hold
+   * up the rest.
+  */
+	hashwork hw;
+	hw.jobs = jobs;
+	hw.n = n;
+	hw.next = 0;
+	if ((size_t)nthreads > n) nthreads = n;
+	if (nthreads <= 1) {
+		hashworker(&hw);
+		return;
+	}
+	pthread_t *tids = xmalloc(nthreads * sizeof(pthread_t));
+	int i;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&tids[i], NULL, hashworker, &hw)) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < nthreads; i++) pthread_join(tids[i], NULL);
+	free(tids);
+} // hashfiles()
+
+void
+*hashworker(void *arg)
+{
+	hashwork *hw = arg;
+	size_t i;
+	while ((i = __atomic_fetch_add(&hw->next, 1, __ATOMIC_RELAXED)) < hw->n) {
+		hashjob *hj = &hw->jobs[i];
+		struct stat sb;
+		hj->err = 0;
+		if (hashfile(hj->dirfd, hj->path, &sb, &hj->hash) == -1)
+			hj->err = errno;
+	}
+	return NULL;
+} // hashworker()
+
+pool
+*init_pool(const char *root)
+{ /* Open the pool in root, which must exist, and load its hash cache.
+   * A missing or damaged cache just means every file is read again.
+  */
+	pool *p = xmalloc(sizeof(pool));
+	memset(p, 0, sizeof(pool));
+	p->root = xstrdup((char *)root);
+	p->fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (p->fd == -1) {
+		perror(root);
+		exit(EXIT_FAILURE);
+	}
+	p->cachefn = xmalloc(strlen(root) + 12);
+	sprintf(p->cachefn, "%s/.hashcache", root);
+	p->limit = 4096;
+	p->ents = xmalloc(p->limit * sizeof(phent));
+	memset(p->ents, 0, p->limit * sizeof(phent));
+	loadcache(p);
+	return p;
+} // init_pool()
+
+void
+free_pool(pool *p)
+{ /* Save the cache and close the pool. */
+	savecache(p);
+	close(p->fd);
+	free(p->ents);
+	free(p->cachefn);
+	free(p->root);
+	free(p);
+} // free_pool()
+
+void
+pool_name(uint64_t hash, uint64_t size, char *pname)
+{ /* The pool entry for content of hash and size, relative to the pool
+   * root. The top byte of the hash picks one of 256 dirs.
+  */
+	sprintf(pname, "%02x/%016llx-%llx", (unsigned)(hash >> 56),
+			(unsigned long long)hash, (unsigned long long)size);
+} // pool_name()
+
+int
+pool_hash(pool *p, int dirfd, const char *name, struct stat *sb,
+			uint64_t *hash)
+{ /* The hash of the file name in dirfd, sb being its stat. From the
+   * cache if its inode is there with the same size and mtime, else the
+   * file is read and the cache updated. Returns 0, or -1 with errno
+   * set if it can not be read or is no longer the file of sb.
+  */
+	phent *pe = phfind(p, sb->st_dev, sb->st_ino);
+	if (pe->ino && pe->size == (uint64_t)sb->st_size &&
+			pe->mtime == sb->st_mtim.tv_sec &&
+			pe->mtimens == sb->st_mtim.tv_nsec) {
+		pe->seen = 1;
+		*hash = pe->hash;
+		return 0;
+	}
+	struct stat fsb;	// the times as they were before the read.
+	if (hashfile(dirfd, name, &fsb, hash) == -1) return -1;
+	if (fsb.st_ino != sb->st_ino || fsb.st_dev != sb->st_dev) {
+		errno = ESTALE;
+		return -1;
+	}
+	p->hashed++;
+	if (!pe->ino) {
+		p->count++;
+		pe->dev = fsb.st_dev;
+		pe->ino = fsb.st_ino;
+	}
+	pe->size = fsb.st_size;
+	pe->mtime = fsb.st_mtim.tv_sec;
+	pe->mtimens = fsb.st_mtim.tv_nsec;
+	pe->hash = *hash;
+	pe->seen = 1;
+	*sb = fsb;
+	if (p->count * 2 >= p->limit) phgrow(p);
+	return 0;
+} // pool_hash()
+
+int
+pool_add(pool *p, int dirfd, const char *name, struct stat *sb,
+			uint64_t *hash)
+{ /* Find the pool entry of the content of file name in dirfd, sb
+   * being its stat, linking the file into the pool if there is none.
+   * On return sb is the stat of the pool entry and hash its hash.
+   * An entry whose file has been written to since it was pooled no
+   * longer holds the content it is named for and is replaced. Returns
+   * 0, or -1 with errno set.
+  */
+	if (pool_hash(p, dirfd, name, sb, hash) == -1) return -1;
+	char pname[POOLNAME_MAX];
+	pool_name(*hash, sb->st_size, pname);
+	int tries;
+	for (tries = 0; tries < 3; tries++) {
+		struct stat psb;
+		if (fstatat(p->fd, pname, &psb, AT_SYMLINK_NOFOLLOW) == 0) {
+			uint64_t phash;
+			if (psb.st_ino == sb->st_ino && psb.st_dev == sb->st_dev)
+				return 0;	// the file is the pool entry.
+			if (S_ISREG(psb.st_mode) &&
+				pool_hash(p, p->fd, pname, &psb, &phash) == 0 &&
+				phash == *hash && psb.st_size == sb->st_size) {
+				*sb = psb;
+				return 0;
+			}
+			if (unlinkat(p->fd, pname, 0) == -1 && errno != ENOENT)
+				return -1;	// stale, replace it.
+		} else if (errno != ENOENT) {
+			return -1;
+		}
+		char dname[3];
+		memcpy(dname, pname, 2);
+		dname[2] = 0;
+		if (mkdirat(p->fd, dname, 0775) == -1 && errno != EEXIST)
+			return -1;
+		if (linkat(dirfd, name, p->fd, pname, 0) == 0) {
+			struct stat psb;	// the file may be another since sb.
+			if (fstatat(p->fd, pname, &psb, AT_SYMLINK_NOFOLLOW) == -1)
+				return -1;
+			if (psb.st_ino != sb->st_ino || psb.st_dev != sb->st_dev) {
+				unlinkat(p->fd, pname, 0);
+				errno = ESTALE;
+				return -1;
+			}
+			p->added++;
+			return 0;
+		}
+		if (errno != EEXIST) return -1;	// else pooled by another run.
+	}
+	errno = EBUSY;
+	return -1;
+} // pool_add()
+
+int
+pool_same(pool *p, int dirfd, const char *name, const char *pname)
+{ /* Returns 1 if file name in dirfd has the same content as pool entry
+   * pname, 0 if not, -1 with errno set if either can not be read. The
+   * hash names the entry but it is the bytes that are compared before
+   * a file is replaced by a link to another inode.
+  */
+	int fd1 = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd1 == -1) return -1;
+	int fd2 = openat(p->fd, pname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd2 == -1) {
+		close(fd1);
+		return -1;
+	}
+	struct stat sb1, sb2;
+	int res;
+	if (fstat(fd1, &sb1) == -1 || fstat(fd2, &sb2) == -1) {
+		res = -1;
+	} else if (sb1.st_ino == sb2.st_ino && sb1.st_dev == sb2.st_dev) {
+		res = 1;
+	} else if (sb1.st_size != sb2.st_size) {
+		res = 0;
+	} else {
+		res = samemap(fd1, fd2, sb1.st_size);
+	}
+	close(fd1);
+	close(fd2);
+	return res;
+} // pool_same()
+
+int
+samemap(int fd1, int fd2, size_t size)
+{ /* Compare size bytes of two open files. */
+	if (size == 0) return 1;
+	void *m1 = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd1, 0);
+	if (m1 == MAP_FAILED) return -1;
+	void *m2 = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd2, 0);
+	if (m2 == MAP_FAILED) {
+		munmap(m1, size);
+		return -1;
+	}
+	madvise(m1, size, MADV_SEQUENTIAL);
+	madvise(m2, size, MADV_SEQUENTIAL);
+	int res = (memcmp(m1, m2, size) == 0);
+	munmap(m1, size);
+	munmap(m2, size);
+	return res;
+} // samemap()
+
+phent
+*phfind(pool *p, uint64_t dev, uint64_t ino)
+{ /* The slot of dev and ino, an empty one if it is not there. */
+	size_t i = ((ino * P1) ^ (dev * P2)) >> 20;
+	for (i &= p->limit - 1; ; i = (i + 1) & (p->limit - 1)) {
+		phent *pe = &p->ents[i];
+		if (!pe->ino || (pe->ino == ino && pe->dev == dev)) return pe;
+	}
+} // phfind()
+
+void
+phgrow(pool *p)
+{ /* Double the table. */
+	phent *old = p->ents;
+	size_t i, n = p->limit;
+	p->limit *= 2;
+	p->ents = xmalloc(p->limit * sizeof(phent));
+	memset(p->ents, 0, p->limit * sizeof(phent));
+	for (i = 0; i < n; i++)
+		if (old[i].ino) *phfind(p, old[i].dev, old[i].ino) = old[i];
+	free(old);
+} // phgrow()
+
+void
+loadcache(pool *p)
+{ /* Read the cache file into the table, if it is a good one. */
+	FILE *fpi = fopen(p->cachefn, "r");
+	if (!fpi) return;
+	phhead hd;
+	if (fread(&hd, sizeof(phhead), 1, fpi) != 1 ||
+			memcmp(hd.magic, phmagic, sizeof(phmagic)) != 0) {
+		fclose(fpi);
+		return;
+	}
+	phent pe;
+	uint64_t i;
+	for (i = 0; i < hd.count; i++) {
+		if (fread(&pe, sizeof(phent), 1, fpi) != 1 || !pe.ino) break;
+		phent *slot = phfind(p, pe.dev, pe.ino);
+		if (!slot->ino) p->count++;
+		*slot = pe;
+		slot->seen = 0;
+		if (p->count * 2 >= p->limit) phgrow(p);
+	}
+	fclose(fpi);
+} // loadcache()
+
+void
+savecache(pool *p)
+{ /* Write the entries used this run, so that the cache does not keep
+   * the hashes of files long gone.
+  */
+	phhead hd;
+	size_t i;
+	memcpy(hd.magic, phmagic, sizeof(phmagic));
+	hd.count = 0;
+	for (i = 0; i < p->limit; i++)
+		if (p->ents[i].ino && p->ents[i].seen) hd.count++;
+	char tmpfn[PATH_MAX];
+	sprintf(tmpfn, "%s.%d", p->cachefn, getpid());
+	FILE *fpo = dofopen(tmpfn, "w");
+	if (fwrite(&hd, sizeof(phhead), 1, fpo) != 1) {
+		perror(tmpfn);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < p->limit; i++) {
+		if (!p->ents[i].ino || !p->ents[i].seen) continue;
+		if (fwrite(&p->ents[i], sizeof(phent), 1, fpo) != 1) {
+			perror(tmpfn);
+			exit(EXIT_FAILURE);
+		}
+	}
+	dofclose(fpo);
+	if (rename(tmpfn, p->cachefn) == -1) {
+		perror(p->cachefn);
+		exit(EXIT_FAILURE);
+	}
+} // savecache()
@@ -0,0 +1,104 @@
+/*    pool.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of pool.[h|c] is to keep a content addressed pool of
+ * files: one link per distinct content, named by its hash and size, so
+ * that every file of the same content can be linked to the one inode.
+ * The hash of each file is cached by inode, size and mtime so that a
+ * file not changed since is never read again. Sets of files can also
+ * be hashed on many threads at once.
+ * */
+#ifndef _POOL_H
+#define _POOL_H
+#define _GNU_SOURCE 1
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "str.h"
+#include "files.h"
+
+/* On disk the cache is a phhead then the phents, in no order. */
+
+typedef struct phhead {
+	char magic[8];		// "SLHASH01"
+	uint64_t count;
+} phhead;
+
+typedef struct phent {
+	uint64_t dev;
+	uint64_t ino;		// 0 for an empty slot.
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtimens;
+	uint64_t hash;
+	uint64_t seen;		// used this run, only those are saved.
+} phent;
+
+typedef struct pool {
+	char *root;
+	int fd;				// of root.
+	char *cachefn;
+	phent *ents;		// open addressed on dev and ino.
+	size_t count;
+	size_t limit;		// a power of 2.
+	size_t hashed;		// files read this run.
+	size_t added;		// new pool entries this run.
+} pool;
+
+typedef struct hashjob {	// for hashfiles().
+	int dirfd;
+	const char *path;	// relative to dirfd.
+	uint64_t hash;
+	int err;			// errno, 0 if hashed.
+} hashjob;
+
+#define POOLNAME_MAX 48
+
+uint64_t
+xxh64(const void *data, size_t len, uint64_t seed);
+
+int
+hashfile(int dirfd, const char *path, struct stat *sb, uint64_t *hash);
+
+void
+hashfiles(hashjob *jobs, size_t n, int nthreads);
+
+pool
+*init_pool(const char *root);
+
+void
+free_pool(pool *p);
+
+void
+pool_name(uint64_t hash, uint64_t size, char *pname);
+
+int
+pool_hash(pool *p, int dirfd, const char *name, struct stat *sb,
+			uint64_t *hash);
+
+int
+pool_add(pool *p, int dirfd, const char *name, struct stat *sb,
+			uint64_t *hash);
+
+int
+pool_same(pool *p, int dirfd, const char *name, const char *pname);
+
+#endif
@@ -0,0 +1,243 @@
+/*    progress.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of progress.[h|c] is to report, from a thread of its
+ * own, the phase a run is in, how much it has done, how fast and how
+ * long it has to go judged by the run before. The hot loops only bump
+ * the counters in metrics.[h|c].
+ * */
+
+#include "files.h"
+#include "progress.h"
+
+typedef struct progress {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int stop;
+	char *fn;			// the status file, NULL for stderr.
+	int tty;			// stderr is one, rewrite the one line.
+	int interval;		// seconds between reports.
+	char *histfn;		// totals of the last run, NULL if none.
+	int haveprev;
+	uint64_t prevdone[MP_NPHASES];
+	uint64_t prevnsec[MP_NPHASES];
+	uint64_t t0;
+	int lastphase;		// the last phase seen, for the ETA when idle.
+	int ratephase;
+	uint64_t ratedone;	// done and time of the last report.
+	uint64_t ratet;
+	double rate;		// per second, smoothed.
+} progress;
+
+static progress pg;
+
+static void *progressworker(void *arg);
+static void report(int final);
+static void loadhistory(void);
+static void savehistory(void);
+static void hms(char *buf, double secs);
+
+void
+start_progress(const char *fn, const char *key)
+{ /* Start reporting, to the status file fn, or stderr if fn is "-".
+   * Key names the pair of trees, the last run of which sets the ETA.
+  */
+	memset(&pg, 0, sizeof(progress));
+	if (strcmp(fn, "-") != 0) pg.fn = xstrdup((char *)fn);
+	pg.tty = !pg.fn && isatty(STDERR_FILENO);
+	pg.interval = (pg.fn || pg.tty) ? 1 : 10;
+	pg.lastphase = -1;
+	pg.ratephase = -1;
+	pg.t0 = pg.ratet = metrics_now();
+	const char *home = getenv("HOME");
+	if (home) {
+		uint64_t h = 14695981039346656037ULL;	// FNV-1a
+		const unsigned char *cp;
+		for (cp = (const unsigned char *)key; *cp; cp++)
+			h = (h ^ *cp) * 1099511628211ULL;
+		char buf[PATH_MAX];
+		snprintf(buf, PATH_MAX, "%s/.config", home);
+		mkdir(buf, 0775);	// may well be there.
+		strcat(buf, "/synclink");
+		mkdir(buf, 0775);
+		snprintf(buf, PATH_MAX, "%s/.config/synclink/progress-%016llx",
+					home, (unsigned long long)h);
+		pg.histfn = xstrdup(buf);
+		loadhistory();
+	}
+	pthread_mutex_init(&pg.lock, NULL);
+	pthread_cond_init(&pg.cond, NULL);
+	if (pthread_create(&pg.tid, NULL, progressworker, NULL)) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	pg.running = 1;
+} // start_progress()
+
+void
+stop_progress(int ok)
+{ /* Stop reporting, with a last report. If the run went through keep
+   * its totals for the ETA of the next.
+  */
+	if (!pg.running) return;
+	pthread_mutex_lock(&pg.lock);
+	pg.stop = 1;
+	pthread_cond_signal(&pg.cond);
+	pthread_mutex_unlock(&pg.lock);
+	pthread_join(pg.tid, NULL);
+	pg.running = 0;
+	report(1);
+	if (ok && pg.histfn) savehistory();
+	pthread_mutex_destroy(&pg.lock);
+	pthread_cond_destroy(&pg.cond);
+	free(pg.fn);
+	free(pg.histfn);
+} // stop_progress()
+
+void
+*progressworker(void *arg)
+{ /* Report every interval until told to stop. */
+	(void)arg;
+	pthread_mutex_lock(&pg.lock);
+	while (!pg.stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += pg.interval;
+		pthread_cond_timedwait(&pg.cond, &pg.lock, &ts);
+		if (!pg.stop) report(0);
+	}
+	pthread_mutex_unlock(&pg.lock);
+	return NULL;
+} // progressworker()
+
+void
+report(int final)
+{ /* Work out the rate and ETA and write them out. Only write(2) is
+   * used: stdio would take locks that a fork() from the main thread
+   * might leave held in the child.
+  */
+	uint64_t now = metrics_now();
+	int phase = mtr.phase;
+	uint64_t done = (phase >= 0) ?
+				__atomic_load_n(&mtr.done[phase], __ATOMIC_RELAXED) : 0;
+	if (phase >= 0) pg.lastphase = phase;
+	if (phase != pg.ratephase) {	// start over, from the phase start.
+		uint64_t start = mtr.start;
+		pg.ratephase = phase;
+		pg.rate = (phase >= 0 && now > start) ?
+					done / ((now - start) / 1e9) : 0;
+	} else if (now > pg.ratet) {
+		double r = (done - pg.ratedone) / ((now - pg.ratet) / 1e9);
+		pg.rate = (pg.rate) ? 0.7 * pg.rate + 0.3 * r : r;
+	}
+	pg.ratedone = done;
+	pg.ratet = now;
+	double eta = -1;
+	if (pg.haveprev) {
+		int p;
+		eta = 0;
+		if (phase >= 0 && pg.prevdone[phase] > done) {
+			uint64_t left = pg.prevdone[phase] - done;
+			eta += (pg.rate > 0) ? left / pg.rate :
+				pg.prevnsec[phase] / 1e9 * left / pg.prevdone[phase];
+		}
+		for (p = pg.lastphase + 1; p < MP_NPHASES; p++)
+			eta += pg.prevnsec[p] / 1e9;
+	}
+	double elapsed = (now - pg.t0) / 1e9;
+	char buf[256], el[32], et[32];
+	int len;
+	if (pg.fn) {
+		char tmpfn[PATH_MAX];
+		len = snprintf(buf, sizeof(buf), "phase=%s done=%llu rate=%.0f"
+				" elapsed=%.0f eta=%.0f\n",
+				(final) ? "finished" : phasename(phase),
+				(unsigned long long)done, pg.rate, elapsed,
+				(final) ? 0 : eta);
+		snprintf(tmpfn, PATH_MAX, "%s.%d", pg.fn, getpid());
+		int fd = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1) return;	// try again next time.
+		int res = write(fd, buf, len);
+		close(fd);
+		if (res != len || rename(tmpfn, pg.fn) == -1) unlink(tmpfn);
+		return;
+	}
+	hms(el, elapsed);
+	if (final) {
+		len = snprintf(buf, sizeof(buf), "%ssynclink: finished in %s%s\n",
+				(pg.tty) ? "\r" : "", el, (pg.tty) ? "\033[K" : "");
+	} else {
+		if (eta < 0) strcpy(et, "?");
+		else hms(et, eta);
+		len = snprintf(buf, sizeof(buf), "%ssynclink: %s %llu done, %.0f/s,"
+				" %s elapsed, ETA %s%s", (pg.tty) ? "\r" : "",
+				phasename(phase), (unsigned long long)done, pg.rate, el, et,
+				(pg.tty) ? "\033[K" : "\n");	// a tty keeps to one line.
+	}
+	if (write(STDERR_FILENO, buf, len) != len) return;
+} // report()
+
+void
+hms(char *buf, double secs)
+{ /* secs as h:mm:ss. */
+	long t = secs + 0.5;
+	sprintf(buf, "%ld:%02ld:%02ld", t / 3600, t / 60 % 60, t % 60);
+} // hms()
+
+void
+loadhistory(void)
+{ /* The totals of the last run, one line a phase of its name, what
+   * was done and how many ns it took.
+  */
+	FILE *fpi = fopen(pg.histfn, "r");
+	if (!fpi) return;
+	char name[64];
+	unsigned long long done, nsec;
+	while (fscanf(fpi, "%63s %llu %llu", name, &done, &nsec) == 3) {
+		int p;
+		for (p = 0; p < MP_NPHASES; p++) {
+			if (strcmp(name, phasename(p)) != 0) continue;
+			pg.prevdone[p] = done;
+			pg.prevnsec[p] = nsec;
+			pg.haveprev = 1;
+		}
+	}
+	fclose(fpi);
+} // loadhistory()
+
+void
+savehistory(void)
+{ /* Keep the totals of this run for the next. Not fatal if it can not
+   * be done, there is just no ETA next time.
+  */
+	char tmpfn[PATH_MAX];
+	snprintf(tmpfn, PATH_MAX, "%s.%d", pg.histfn, getpid());
+	FILE *fpo = fopen(tmpfn, "w");
+	if (!fpo) return;
+	int p;
+	for (p = 0; p < MP_NPHASES; p++)
+		fprintf(fpo, "%s %llu %llu\n", phasename(p),
+				(unsigned long long)mtr.done[p],
+				(unsigned long long)mtr.wall[p]);
+	if (fclose(fpo) == EOF || rename(tmpfn, pg.histfn) == -1)
+		unlink(tmpfn);
+} // savehistory()
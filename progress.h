@@ -0,0 +1,39 @@
+/*    progress.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of progress.[h|c] is to report, from a thread of its
+ * own, the phase a run is in, how much it has done, how fast and how
+ * long it has to go judged by the run before. The hot loops only bump
+ * the counters in metrics.[h|c].
+ * */
+#ifndef _PROGRESS_H
+#define _PROGRESS_H
+#define _GNU_SOURCE 1
+
+#include <pthread.h>
+#include "metrics.h"
+
+void
+start_progress(const char *fn, const char *key);
+
+void
+stop_progress(int ok);
+
+#endif
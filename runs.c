@@ -0,0 +1,316 @@
+/*    runs.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of runs.[h|c] is to sort a tree listing too big to hold
+ * in memory: entries are gathered in a buffer of bounded size, which is
+ * sorted and written out as a run each time it fills, and the runs are
+ * then merged back in cmppath() order as they are read.
+ * */
+
+#include "files.h"
+#include "srt.h"
+#include "runs.h"
+
+#define RUNBUF (256 * 1024)	// stdio buffer of each run, at most.
+#define MINRUNBUF (16 * 1024)	// and at least, before fewer are merged.
+#define MAXFANIN 64			// runs merged at once.
+#define RECFIELDS 21		// type, nlink, ino and dev, packed.
+
+static FILE *newrun(size_t bufsize);
+static void spill(runset *rs);
+static void mergeruns(runset *rs);
+static void putrec(FILE *fp, const char *path, size_t len,
+					const unsigned char *fields);
+static int getrec(FILE *fp, runrec *rr);
+static runmerge *openmerge(FILE **fps, size_t n);
+static void siftdown(runmerge *rm, size_t i);
+
+runset
+*init_runset(size_t budget)
+{ /* An empty set of runs that takes at most budget bytes. A quarter of
+   * it is kept for the open runs: the stdio buffer of each and the entry
+   * each has in a merge, with one more run for the merge to write. The
+   * runs are merged into one whenever there are fanin of them, so that
+   * neither they nor the fds they hold grow with the tree. The rest is
+   * the buffer the entries are sorted in.
+  */
+	runset *rs = xmalloc(sizeof(runset));
+	memset(rs, 0, sizeof(runset));
+	rs->fanin = MAXFANIN;
+	rs->runbuf = RUNBUF;
+	size_t cost;
+	while ((cost = (rs->fanin + 1) * (rs->runbuf + sizeof(runrec) +
+			sizeof(size_t))) > budget / 4) {
+		if (rs->runbuf > MINRUNBUF) rs->runbuf /= 2;
+		else if (rs->fanin > 2) rs->fanin /= 2;
+		else break;
+	}
+	rs->budget = (cost < budget / 2) ? budget - cost : budget / 2;
+	return rs;
+} // init_runset()
+
+void
+free_runset(runset *rs)
+{ /* Close, and so delete, the runs and free rs. */
+	size_t i;
+	for (i = 0; i < rs->nruns; i++) fclose(rs->runs[i]);
+	free(rs->buf);	// any may be NULL, so not vfree().
+	free(rs->recs);
+	free(rs->work);
+	free(rs->runs);
+	free(rs);
+} // free_runset()
+
+void
+runs_add(runset *rs, const char *path, fsent *fe)
+{ /* Add the entry fe, path being relative to the root walked. Writes
+   * out a run first if there is no room for it.
+  */
+	size_t len = strlen(path) + 1;
+	size_t need = len + RECFIELDS;
+	if (rs->count && (rs->used + need > rs->budget / 2 || rs->used + need +
+			(rs->count + 1) * 2 * sizeof(char *) > rs->budget))
+		spill(rs);	// half for the entries, the rest for pointers.
+	if (rs->used + need > rs->size) {	// the offsets stay good.
+		rs->size = (rs->size) ? rs->size * 2 : 1024 * 1024;
+		if (rs->size > rs->budget / 2) rs->size = rs->budget / 2;
+		if (rs->size < rs->used + need) rs->size = rs->used + need;
+		rs->buf = realloc(rs->buf, rs->size);
+		if (!rs->buf) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (rs->count == rs->limit) {
+		rs->limit = (rs->limit) ? rs->limit * 2 : 16384;
+		rs->recs = realloc(rs->recs, rs->limit * sizeof(char *));
+		if (!rs->recs) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	char *cp = rs->buf + rs->used;
+	memcpy(cp, path, len);
+	cp += len;
+	uint32_t nlink = fe->nlink;
+	uint64_t ino = fe->ino, dev = fe->dev;
+	*cp = fe->type;
+	memcpy(cp + 1, &nlink, 4);
+	memcpy(cp + 5, &ino, 8);
+	memcpy(cp + 13, &dev, 8);
+	rs->recs[rs->count++] = (char *)rs->used;	// an offset until sorted.
+	rs->used += need;
+	rs->total++;
+} // runs_add()
+
+void
+runs_finish(runset *rs)
+{ /* Write out what is buffered and free the buffer. There are then
+   * few enough runs to merge all at once.
+  */
+	if (rs->count) spill(rs);
+	free(rs->buf);
+	free(rs->recs);
+	free(rs->work);
+	rs->buf = NULL;
+	rs->recs = rs->work = NULL;
+	rs->size = rs->limit = 0;
+} // runs_finish()
+
+runmerge
+*init_runmerge(runset *rs)
+{ /* Start reading the entries of rs back in cmppath() order. May be
+   * done again once the last merge is freed.
+  */
+	return openmerge(rs->runs, rs->nruns);
+} // init_runmerge()
+
+void
+free_runmerge(runmerge *rm)
+{ /* free resources allocated to rm, the runs stay open. */
+	vfree(rm->recs, rm->heap, NULL);
+	free(rm);
+} // free_runmerge()
+
+runrec
+*runs_next(runmerge *rm)
+{ /* The next entry, NULL when there are no more. It stays good until
+   * the next call.
+  */
+	if (rm->last >= 0) {	// move the run handed out last on.
+		if (!getrec(rm->fps[rm->last], &rm->recs[rm->last]))
+			rm->heap[0] = rm->heap[--rm->n];
+		if (rm->n) siftdown(rm, 0);
+	}
+	if (!rm->n) {
+		rm->last = -1;
+		return NULL;
+	}
+	rm->last = rm->heap[0];
+	return &rm->recs[rm->last];
+} // runs_next()
+
+FILE
+*newrun(size_t bufsize)
+{ /* A temporary file for a run, deleted as soon as it is made so that
+   * it goes when closed, however the program ends.
+  */
+	char fn[PATH_MAX];
+	const char *dir = getenv("TMPDIR");
+	snprintf(fn, PATH_MAX, "%s/synclinkXXXXXX", (dir && *dir) ? dir : "/tmp");
+	int fd = mkstemp(fn);
+	if (fd == -1) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+	unlink(fn);
+	FILE *fp = fdopen(fd, "w+");
+	if (!fp) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+	setvbuf(fp, NULL, _IOFBF, bufsize);
+	return fp;
+} // newrun()
+
+void
+spill(runset *rs)
+{ /* Sort the buffered entries and write them out as a run. */
+	size_t i;
+	for (i = 0; i < rs->count; i++)	// offsets to pointers, buf is final.
+		rs->recs[i] = rs->buf + (size_t)rs->recs[i];
+	rs->work = realloc(rs->work, rs->limit * sizeof(char *));
+	if (!rs->work) {
+		fputs("Out of memory.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	mergesort(rs->recs, 0, rs->count - 1, rs->work, cmppath);
+	if (!rs->runs) rs->runs = xmalloc(rs->fanin * sizeof(FILE *));
+	FILE *fp = newrun(rs->runbuf);
+	for (i = 0; i < rs->count; i++) {
+		size_t len = strlen(rs->recs[i]);
+		putrec(fp, rs->recs[i], len,
+				(unsigned char *)rs->recs[i] + len + 1);
+	}
+	if (fflush(fp) == EOF) {
+		perror("run");
+		exit(EXIT_FAILURE);
+	}
+	rs->runs[rs->nruns++] = fp;
+	rs->count = 0;
+	rs->used = 0;
+	if (rs->nruns == rs->fanin) mergeruns(rs);
+} // spill()
+
+void
+mergeruns(runset *rs)
+{ /* Merge all the runs into one. */
+	runmerge *rm = openmerge(rs->runs, rs->nruns);
+	FILE *fp = newrun(rs->runbuf);
+	runrec *rr;
+	unsigned char fields[RECFIELDS];
+	while ((rr = runs_next(rm))) {
+		fields[0] = rr->type;
+		memcpy(fields + 1, &rr->nlink, 4);
+		memcpy(fields + 5, &rr->ino, 8);
+		memcpy(fields + 13, &rr->dev, 8);
+		putrec(fp, rr->path, strlen(rr->path), fields);
+	}
+	free_runmerge(rm);
+	if (fflush(fp) == EOF) {
+		perror("run");
+		exit(EXIT_FAILURE);
+	}
+	size_t i;
+	for (i = 0; i < rs->nruns; i++) fclose(rs->runs[i]);
+	rs->runs[0] = fp;
+	rs->nruns = 1;
+} // mergeruns()
+
+void
+putrec(FILE *fp, const char *path, size_t len, const unsigned char *fields)
+{ /* Write one entry to a run: the path length, the fields, the path. */
+	uint16_t plen = len;
+	if (fwrite(&plen, 2, 1, fp) != 1 ||
+		fwrite(fields, RECFIELDS, 1, fp) != 1 ||
+		fwrite(path, len, 1, fp) != 1) {
+		perror("run");
+		exit(EXIT_FAILURE);
+	}
+} // putrec()
+
+int
+getrec(FILE *fp, runrec *rr)
+{ /* Read the next entry of a run into rr. Returns 0 at the end. */
+	uint16_t plen;
+	unsigned char fields[RECFIELDS];
+	if (fread(&plen, 2, 1, fp) != 1) {
+		if (ferror(fp)) {
+			perror("run");
+			exit(EXIT_FAILURE);
+		}
+		return 0;
+	}
+	if (plen >= PATH_MAX || fread(fields, RECFIELDS, 1, fp) != 1 ||
+		fread(rr->path, plen, 1, fp) != (plen != 0)) {
+		fputs("Corrupt run file.\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	rr->path[plen] = 0;
+	rr->type = fields[0];
+	memcpy(&rr->nlink, fields + 1, 4);
+	memcpy(&rr->ino, fields + 5, 8);
+	memcpy(&rr->dev, fields + 13, 8);
+	return 1;
+} // getrec()
+
+runmerge
+*openmerge(FILE **fps, size_t n)
+{ /* A k-way merge of the n runs fps, each read from its start. */
+	runmerge *rm = xmalloc(sizeof(runmerge));
+	memset(rm, 0, sizeof(runmerge));
+	rm->fps = fps;
+	rm->recs = xmalloc((n + 1) * sizeof(runrec));
+	rm->heap = xmalloc((n + 1) * sizeof(size_t));
+	rm->last = -1;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		rewind(fps[i]);
+		if (getrec(fps[i], &rm->recs[i])) rm->heap[rm->n++] = i;
+	}
+	for (i = rm->n / 2; i > 0; i--) siftdown(rm, i - 1);
+	return rm;
+} // openmerge()
+
+void
+siftdown(runmerge *rm, size_t i)
+{ /* Move heap[i] down until neither child has a lesser path. */
+	while (1) {
+		size_t least = i, c;
+		for (c = 2 * i + 1; c <= 2 * i + 2 && c < rm->n; c++)
+			if (cmppath(rm->recs[rm->heap[c]].path,
+						rm->recs[rm->heap[least]].path) < 0) least = c;
+		if (least == i) return;
+		size_t t = rm->heap[i];
+		rm->heap[i] = rm->heap[least];
+		rm->heap[least] = t;
+		i = least;
+	}
+} // siftdown()
@@ -0,0 +1,87 @@
+/*    runs.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of runs.[h|c] is to sort a tree listing too big to hold
+ * in memory: entries are gathered in a buffer of bounded size, which is
+ * sorted and written out as a run each time it fills, and the runs are
+ * then merged back in cmppath() order as they are read.
+ * */
+#ifndef _RUNS_H
+#define _RUNS_H
+#define _GNU_SOURCE 1
+
+#include <stdint.h>
+#include "str.h"
+#include "dirs.h"
+
+typedef struct runrec {	// one entry as merged back.
+	uint64_t ino;
+	uint64_t dev;
+	uint32_t nlink;
+	unsigned char type;
+	char path[PATH_MAX];	// relative to the root walked.
+} runrec;
+
+typedef struct runset {
+	size_t budget;	// bytes the buffer and its pointers may take.
+	size_t fanin;	// runs kept before they are merged into one.
+	size_t runbuf;	// stdio buffer of each run.
+	char *buf;		// the entries not yet written, each its path, a
+	size_t used;	// nul and then its fields.
+	size_t size;
+	char **recs;	// the entries in buf, and as much again to sort.
+	char **work;
+	size_t count;
+	size_t limit;
+	FILE **runs;	// the runs written, unlinked already.
+	size_t nruns;
+	size_t total;	// entries added.
+} runset;
+
+typedef struct runmerge {
+	FILE **fps;		// the runs being merged.
+	runrec *recs;	// the current entry of each.
+	size_t *heap;	// the runs with entries left, least path first.
+	size_t n;
+	int last;		// the run of the entry handed out last, or -1.
+} runmerge;
+
+runset
+*init_runset(size_t budget);
+
+void
+free_runset(runset *rs);
+
+void
+runs_add(runset *rs, const char *path, fsent *fe);
+
+void
+runs_finish(runset *rs);
+
+runmerge
+*init_runmerge(runset *rs);
+
+void
+free_runmerge(runmerge *rm);
+
+runrec
+*runs_next(runmerge *rm);
+
+#endif
@@ -55,8 +55,9 @@ void
 sortmemstr(mdata *md, int direction)
 {	/* Uses qsort() to sort a block of C strings in memory.
 	 * If direction is 0 the sort is ascending, otherwise descending.
-	 * This creates the data structures needed by qsort() and frees
-	 * them on completion.
+	 * The pointers sorted are to the strings where they are; they are
+	 * then copied in order to a block the size of md and back, so
+	 * nothing is duplicated one string at a time or leaked.
 	*/
 	size_t count = countmemstr(md);	/* get strings count */
 	/* Allocate strings arrays */
@@ -64,7 +65,7 @@ sortmemstr(mdata *md, int direction)
 	char *cp = md->fro;
 	size_t i;
 	for (i = 0; i < count; i++) {	/* Fill in strings array */
-		strlist[i] = xstrdup(cp);
+		strlist[i] = cp;
 		cp += strlen(cp) + 1;
 	}
 	if (direction) { // descending
@@ -72,43 +73,158 @@ sortmemstr(mdata *md, int direction)
 	} else { // ascending
 		qsort(strlist, count, sizeof(char *), cmpstringp);
 	}
-	cp = md->fro;
+	size_t size = cp - md->fro;
+	char *sorted = xmalloc(size);
+	cp = sorted;
 	for (i = 0; i < count; i++) {
-		strcpy(cp, strlist[i]);
-		cp += strlen(cp) + 1;
+		size_t len = strlen(strlist[i]) + 1;
+		memcpy(cp, strlist[i], len);
+		cp += len;
 	}
-	/* The strings in strlist[] become unfreeable after qsort(), I guess
-	 * because each separate string becomes a different length.
-	 * For the moment I will simply let memory leak. It's no big deal
-	 * because this is a short run program anyway. */
-	// destroystrarray(strlist, count);
+	memcpy(md->fro, sorted, size);
+	free(sorted);
 	free(strlist);
 } // sortmemstr()
 
-void mergesort(char **a, int i, int j, char **work)
-{
-	int mid;
+int
+cmppath(const char *p1, const char *p2)
+{/* strcmp() except that '/' sorts before every other byte. That is the
+  * order of the paths of a tree listed dir by dir, each dir followed
+  * by what is in it and the entries of a dir in strcmp() order.
+  */
+	const unsigned char *s1 = (const unsigned char *)p1;
+	const unsigned char *s2 = (const unsigned char *)p2;
+	while (*s1 && *s1 == *s2) {
+		s1++;
+		s2++;
+	}
+	int c1 = (*s1 == '/') ? 1 : (*s1) ? *s1 + 1 : 0;
+	int c2 = (*s2 == '/') ? 1 : (*s2) ? *s2 + 1 : 0;
+	return c1 - c2;
+} // cmppath()
+
+static int
+cmpfsname(const void *p1, const void *p2, void *arg)
+{/* For qsort_r() ascending on the names of the fslist entries whose
+  * indexes are p1 and p2.
+  */
+	const fsent *ents = arg;
+	return strcmp(ents[* (const size_t *) p1].name,
+					ents[* (const size_t *) p2].name);
+} // cmpfsname()
+
+static int
+cmpfsnamed(const void *p1, const void *p2, void *arg)
+{/* See cmpfsname(). This version is to sort descending. */
+	return cmpfsname(p2, p1, arg);
+} // cmpfsnamed()
+
+void
+sortfslist(fslist *fl, int direction)
+{	/* Put fl in tree order: each dir followed by what is in it, the
+	 * entries of a dir in name order, ascending if direction is 0,
+	 * otherwise descending. Ascending, that is cmppath() order on the
+	 * paths. The names stay where they are, the parents are renumbered.
+	 * Any dir records no longer apply.
+	*/
+	size_t n = fl->count, i;
+	if (!n) return;
+	/* The entries of dir i are kids[start[i]] to kids[start[i+1]-1];
+	 * those at the top are listed as in a dir n. */
+	size_t *start = xmalloc((n + 2) * sizeof(size_t));
+	size_t *kids = xmalloc(n * sizeof(size_t));
+	memset(start, 0, (n + 2) * sizeof(size_t));
+	for (i = 0; i < n; i++) {
+		size_t p = fl->ents[i].parent;
+		start[((p == NOPARENT) ? n : p) + 1]++;
+	}
+	for (i = 1; i < n + 2; i++) start[i] += start[i - 1];
+	size_t *pos = xmalloc((n + 1) * sizeof(size_t));
+	memcpy(pos, start, (n + 1) * sizeof(size_t));
+	for (i = 0; i < n; i++) {
+		size_t p = fl->ents[i].parent;
+		kids[pos[(p == NOPARENT) ? n : p]++] = i;
+	}
+	for (i = 0; i <= n; i++) {
+		if (start[i + 1] - start[i] > 1)
+			qsort_r(kids + start[i], start[i + 1] - start[i],
+					sizeof(size_t), (direction) ? cmpfsnamed : cmpfsname,
+					fl->ents);
+	}
+	/* Depth first, pushing the entries of each dir last first so they
+	 * come off in order. pos is the stack, newidx the order found. */
+	size_t *newidx = xmalloc(n * sizeof(size_t));
+	size_t top = 0, k = 0, j;
+	for (j = start[n + 1]; j > start[n]; j--) pos[top++] = kids[j - 1];
+	while (top) {
+		i = pos[--top];
+		newidx[i] = k++;
+		for (j = start[i + 1]; j > start[i]; j--) pos[top++] = kids[j - 1];
+	}
+	vfree(start, kids, pos, NULL);
+	for (i = 0; i < n; i++) {
+		size_t p = fl->ents[i].parent;
+		if (p != NOPARENT) fl->ents[i].parent = newidx[p];
+	}
+	for (i = 0; i < n; i++) {	// move each into place, a cycle at a time.
+		while (newidx[i] != i) {
+			size_t to = newidx[i];
+			fsent fe = fl->ents[to];
+			fl->ents[to] = fl->ents[i];
+			fl->ents[i] = fe;
+			newidx[i] = newidx[to];
+			newidx[to] = to;
+		}
+	}
+	free(newidx);
+} // sortfslist()
+
+ssize_t
+findfslist(fslist *fl, const char *path)
+{	/* Binary search for path in fl, which must be sorted ascending.
+	 * Returns the entry index or -1 if not found.
+	*/
+	char buf[PATH_MAX];
+	size_t lo = 0, hi = fl->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int res = cmppath(fspath(fl, mid, buf), path);
+		if (res == 0) return (ssize_t)mid;
+		if (res < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return -1;
+} // findfslist()
+
+void mergesort(char **a, size_t i, size_t j, char **work,
+				int (*cmp)(const char *, const char *))
+{	/* Sort a[i] to a[j] by cmp, strcmp() if NULL, using work, which
+	 * must be as big. Stable, and never worse than n log n.
+	*/
+	size_t mid;
 
 	if(i < j)
 	{
-		mid = (i + j) / 2;
-		mergesort(a, i, mid, work);	//left recursion
-		mergesort(a, mid+1, j, work);	//right recursion
-		merge(a, i, mid, mid+1, j, work);	//merge sorted sub-arrays
+		mid = i + (j - i) / 2;
+		mergesort(a, i, mid, work, cmp);	//left recursion
+		mergesort(a, mid+1, j, work, cmp);	//right recursion
+		merge(a, i, mid, mid+1, j, work, cmp);	//merge sorted sub-arrays
 	}
 } // mergesort()
 
-void merge(char **a, int i1, int j1, int i2, int j2, char **work)
+void merge(char **a, size_t i1, size_t j1, size_t i2, size_t j2,
+			char **work, int (*cmp)(const char *, const char *))
 {
 	char **temp = work;	//array used for merging
-	int i, j, k;
+	size_t i, j, k;
+	if (!cmp) cmp = strcmp;
 	i = i1;	//beginning of the first list
 	j = i2;	//beginning of the second list
 	k = 0;
 
 	while(i <= j1 && j <= j2)	//while elements in both lists
 	{
-		if(strcmp(a[i], a[j]) < 0)
+		if(cmp(a[i], a[j]) <= 0)	// the first of equals first.
 			temp[k++] = a[i++];
 		else
 			temp[k++] = a[j++];
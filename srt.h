@@ -25,6 +25,7 @@
 #define _GNU_SOURCE 1
 
 #include "str.h"	// should cover all required bases
+#include "dirs.h"
 
 int
 strrcmp(const char *s1, const char *s2);	// sort descending
@@ -38,10 +39,21 @@ cmpstringd(const void *p1, const void *p2);	// for qsort() decsending
 void
 sortmemstr(mdata *md, int direction);
 
+int
+cmppath(const char *p1, const char *p2);
+
+void
+sortfslist(fslist *fl, int direction);
+
+ssize_t
+findfslist(fslist *fl, const char *path);
+
 void
-mergesort(char **a, int i, int j, char **work);
+mergesort(char **a, size_t i, size_t j, char **work,
+				int (*cmp)(const char *, const char *));
 
 void
-merge(char **a, int i1, int j1, int i2, int j2, char **work);
+merge(char **a, size_t i1, size_t j1, size_t i2, size_t j2,
+			char **work, int (*cmp)(const char *, const char *));
 
 #endif
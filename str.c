@@ -132,6 +132,130 @@ meminsert(const char *line, mdata *dd, size_t meminc)
 	dd->to += len+1;
 } // meminsert()
 
+arena
+*init_arena(size_t chunksize)
+{ /* An empty arena. No memory is mapped until it is first used. */
+	arena *ar = xmalloc(sizeof(arena));
+	memset(ar, 0, sizeof(arena));
+	ar->chunksize = chunksize;
+	return ar;
+} // init_arena()
+
+static void
+unmapchunks(achunk *ac)
+{
+	while (ac) {
+		achunk *next = ac->next;
+		munmap(ac, ac->size);
+		ac = next;
+	}
+} // unmapchunks()
+
+void
+free_arena(arena *ar)
+{ /* Unmap every chunk and free ar. */
+	unmapchunks(ar->chunks);
+	unmapchunks(ar->spare);
+	free(ar);
+} // free_arena()
+
+void
+clear_arena(arena *ar)
+{ /* Empty ar, keeping its chunks for reuse. */
+	achunk *ac = ar->chunks;
+	while (ac) {
+		achunk *next = ac->next;
+		ac->next = ar->spare;
+		ar->spare = ac;
+		ac = next;
+	}
+	ar->chunks = NULL;
+	ar->next = ar->end = NULL;
+} // clear_arena()
+
+static achunk
+*mapchunk(size_t size, int huge)
+{ /* Map a chunk of size bytes, from huge pages if so asked and there
+   * are any, failing that asking for transparent huge pages.
+  */
+	void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (huge) p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+#ifdef MADV_HUGEPAGE
+		if (huge) madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+	achunk *ac = p;
+	ac->size = size;
+	return ac;
+} // mapchunk()
+
+char
+*arenastr(arena *ar, const char *s)
+{ /* Copy s into ar and return where it now is, which will not change
+   * until ar is cleared or freed.
+  */
+	size_t len = strlen(s) + 1;
+	if ((size_t)(ar->end - ar->next) < len) {
+		achunk *ac = ar->spare;
+		size_t need = len + sizeof(achunk);
+		if (ac && ac->size >= need) {
+			ar->spare = ac->next;
+		} else {	// a string too big for any chunk gets its own.
+			size_t size = (need > ar->chunksize) ? need : ar->chunksize;
+			ac = mapchunk(size, ar->huge);
+		}
+		ac->next = ar->chunks;
+		ar->chunks = ac;
+		ar->next = (char *)(ac + 1);
+		ar->end = (char *)ac + ac->size;
+	}
+	char *p = ar->next;
+	memcpy(p, s, len);
+	ar->next += len;
+	return p;
+} // arenastr()
+
+void
+arenaadopt(arena *to, arena *fro)
+{ /* Move the strings of fro into to, where they keep their addresses.
+   * Fro is left empty. The current chunk of to remains current.
+  */
+	achunk *ac = fro->chunks;
+	while (ac) {
+		achunk *next = ac->next;
+		if (to->chunks) {	// behind the current chunk.
+			ac->next = to->chunks->next;
+			to->chunks->next = ac;
+		} else {
+			ac->next = NULL;
+			to->chunks = ac;	// full as far as to is concerned.
+		}
+		ac = next;
+	}
+	fro->chunks = NULL;
+	fro->next = fro->end = NULL;
+} // arenaadopt()
+
+size_t
+arenasize(arena *ar)
+{ /* Bytes mapped by ar, spare chunks included. */
+	size_t size = 0;
+	achunk *ac;
+	for (ac = ar->chunks; ac; ac = ac->next) size += ac->size;
+	for (ac = ar->spare; ac; ac = ac->next) size += ac->size;
+	return size;
+} // arenasize()
+
 /* There's a bug in memreplace(). It manifests as dofopen() segfaulting
  * when run immediately after a run of memreplace(). dofopen() should
  * never segfault, it can and should abort when there is some problem
@@ -40,12 +40,31 @@
 #include <linux/limits.h>
 #include <libgen.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 typedef struct mdata {
 	char *fro;
 	char *to;
 	char *limit;
 } mdata;
+
+/* An arena hands out strings from large chunks that are never moved
+ * or grown, so that what is in it stays put and nothing is copied as
+ * it fills. Emptying it keeps the chunks for reuse.
+ * */
+typedef struct achunk {
+	struct achunk *next;
+	size_t size;	// of the mapping, this header included.
+} achunk;
+
+typedef struct arena {
+	achunk *chunks;	// in use, the current one first.
+	achunk *spare;	// emptied by clear_arena(), for reuse.
+	char *next;		// free space in the current chunk.
+	char *end;
+	size_t chunksize;
+	int huge;		// back new chunks with huge pages if possible.
+} arena;
 char
 *getcfgfn(const char *prg, const char *fn);
 
@@ -82,6 +101,24 @@ void
 void
 meminsert(const char *line, mdata *md, size_t meminc);
 
+arena
+*init_arena(size_t chunksize);
+
+void
+free_arena(arena *ar);
+
+void
+clear_arena(arena *ar);
+
+char
+*arenastr(arena *ar, const char *s);
+
+void
+arenaadopt(arena *to, arena *fro);
+
+size_t
+arenasize(arena *ar);
+
 void
 memreplace(mdata *md, char *find , char *repl, off_t meminc);
 
@@ -28,11 +28,22 @@
 #include <ctype.h>
 #include <limits.h>
 #include <libgen.h>
+#include <sys/wait.h>
 
 #include "dirs.h"
 #include "files.h"
 #include "str.h"
 #include "srt.h"
+#include "diff.h"
+#include "plan.h"
+#include "watch.h"
+#include "pool.h"
+#include "metrics.h"
+#include "progress.h"
+#include "evlog.h"
+#include "match.h"
+#include "runs.h"
+#include "journal.h"
 
 typedef struct fsdata {
 	int exists;	// 0 = no, 1 = yes
@@ -49,46 +60,287 @@ struct lp {
 
 static void dohelp(int forced);
 static void checkarg(char *in, const char *fail);
-static void checkdstdirs(size_t srclen, mdata *md, char *dsthead);
-static void checkdstfiles(size_t srclen, mdata *md, char *dsthead);
-static void checksrcfiles(size_t dstlen, mdata *md, char *srchead);
-static void checksrcdirs(size_t dstlen, mdata *md, char *srchead);
+static void applyactions(actlist *al);
 static void myunlink(const char *path);
-static void makelink(const char *src, const char *dst);
+static void makelink(const char *path, const char *from);
 static void dormdir(const char *path);
+static void makedir(const char *path);
+static int reached(int phase, int pass, size_t next);
+static int redone(const char *path, int err, int already);
+static int renamedst(const char *path, const char *to);
+static void findmoves(fslist *src, fslist *dst, actlist *al);
+static void walktree(char *dirname, fslist *fl, rd_data *rd);
+static void poolfiles(fslist *src);
+static const char *poolfrom(action *act, const char *path, char *pname);
+static void verifyrelinks(actlist *al, unsigned char *skip);
+static void keepcopies(actlist *al, unsigned char *skip);
+static int copylink(int sfd, const char *sname, int dfd,
+						const char *dname);
+static void checkpool(const char *pooldir, char *srcdir, char **dstdirs,
+						int ndst);
+static void syncdirs(char *srcdir, char **dstdirs, int ndst,
+						const char *planfn, int useuring);
+static void syncdst(fslist *src, rd_data *rd, char *dstdir,
+						const char *planfn);
+static void fanout(fslist *src, rd_data *rd, char **dstdirs, int ndst);
+static void syncbig(char *srcdir, char **dstdirs, int ndst, int useuring);
+static void spillent(void *arg, const char *path, fsent *fe);
+static void bigaction(void *arg, unsigned char op, const char *path);
+static void setdst(const char *dstdir);
+static void synclockstep(char **dstdirs, int ndst);
+static void watchdirs(char *srcdir, char *dstdir, int useuring);
+static void syncpath(const char *rel, int deep, int useuring);
+static void walkpath(dircache *dc, const char *rel, fslist *fl,
+						rd_data *rd);
+static void pathfail(const char *root, const char *path);
+static int keptdir(const char *path, int err);
+static void writemetrics(int child);
+static void queueop(unsigned char op, const char *path, int flags);
+static void flushops(void);
 
-static int verbose, listwork;
+static int verbose, listwork, nthreads;
 static char *srcroot, *dstroot;
+static char *indexfn;	// tree index of the source, NULL if none.
+static int keepgoing;	// report failures but carry on, when watching.
+static int reconcile;	// seconds between full syncs when watching.
+static size_t dirbuf;	// getdents64() buffer size, 0 for the default.
+static size_t maxmem;	// bytes the listings may take, 0 for no limit.
+static int lockstep;	// walk src and dst together a dir at a time.
+static journal *jnl;	// NULL unless keeping a journal.
+static int hugepages;	// back the listings with huge pages.
+static int verify;		// only replace dst files of the same content.
+static char *metricsfn;	// where to write the metrics, NULL for none.
+static dircache *srcdc, *dstdc;
+static uring *ur;	// NULL unless the io_uring backend is in use.
+static uring_op *ops;	// the batch waiting for flushops().
+static arena *opspaths;	// their paths.
+static size_t nops, opslimit;
+static struct devpair {	// how to copy from one file system to another.
+	dev_t sdev;
+	dev_t ddev;
+	int method;			// a copyat() method, 0 until one has worked.
+} *devpairs;
+static size_t ndevpairs;
+static matcher *cmatch;	// NULL unless there are patterns to exclude.
+static pool *cpool;	// NULL unless linking through a pool.
+static fslist *poolsrc;	// the listing pooled.
+static struct poolref {	// the pool entry of each of its entries.
+	uint64_t hash;
+	uint64_t size;		// NOPOOL if not pooled.
+} *poolrefs;
+#define NOPOOL ((uint64_t)-1)
 static const char *helpmsg =
-  "\n\tUsage:\tsynclink [option] srcdir dstdir\n"
+  "\n\tUsage:\tsynclink [option] srcdir dstdir [dstdir...]\n"
+  "\t\tsynclink [option] --apply planfile\n"
   "\n\tOptions:\n"
   "\t-h outputs this help message.\n"
   "\t-D Debug mode. List contents of source and target dirs in /tmp,\n"
   "\t   with file names '$USERsynclink$PID[srcdir|dstdir].txt'\n"
-  "\t-v Set verbose on. Only 2 level of verbosity and it goes to"
-  " stderr.\n"
+  "\t-H, --hugepages Keep the tree listings in huge pages.\n"
+  "\t-x, --exclude pattern Leave out what matches pattern, in both\n"
+  "\t   trees. Dirs that match are not read. May be repeated.\n"
+  "\t-X, --exclude-from file Read exclude patterns from file.\n"
+  "\t-i, --include pattern Do not leave out what matches pattern. The\n"
+  "\t   first of -x, -X and -i to match decides.\n"
+  "\t-I, --index indexfile Keep an index of the source tree in\n"
+  "\t   indexfile so that the next run need not read unchanged dirs.\n"
+  "\t-b, --dirbuf K Read dirs K KiB at a time. Default is 256.\n"
+  "\t-j N Walk the directory trees using N threads. Default is 1.\n"
+  "\t-L, --log file Write the log of what is done to file, as JSON\n"
+  "\t   lines if it ends in .json. Each action unless -v is given.\n"
+  "\t-l, --lockstep Walk the source and destination together, one dir\n"
+  "\t   at a time, making each match before going into its subdirs.\n"
+  "\t   What is held grows with the depth of the trees, not their size.\n"
+  "\t-m, --max-memory size Keep the listings within size MiB, or\n"
+  "\t   K, M or G if it ends so, by sorting them on disk in /tmp or\n"
+  "\t   $TMPDIR.\n"
+  "\t-M, --metrics file Write phase times, syscall counts and latencies\n"
+  "\t   to file as JSON, or as a Prometheus textfile if it ends in\n"
+  "\t   .prom, at exit.\n"
+  "\t-P, --pool pooldir Link each destination file to the one file of\n"
+  "\t   its content in pooldir, so that copies are stored once.\n"
+  "\t-p, --plan planfile Work out what has to be done and write it to\n"
+  "\t   planfile, '-' for stdout, but change nothing.\n"
+  "\t-a, --apply planfile Do what planfile says without walking either\n"
+  "\t   tree. The source and destination dirs come from the plan.\n"
+  "\t-J, --journal file Write what is to be done to file before doing\n"
+  "\t   it, then how far it has got every second, so that a sync that\n"
+  "\t   is stopped can be resumed. The file is removed when done.\n"
+  "\t-r, --resume file Carry on with the sync in the journal file from\n"
+  "\t   where it was stopped, without walking either tree.\n"
+  "\t-T, --deadline time Stop once time, in seconds or ending in m or\n"
+  "\t   h, has passed, leaving the journal to resume. The exit status\n"
+  "\t   is then 3. Needs --journal or --resume.\n"
+  "\t-w, --watch After the sync keep watching srcdir and apply each\n"
+  "\t   change as it is made. Runs until killed.\n"
+  "\t-R, --reconcile N When watching, sync the whole trees again every\n"
+  "\t   N seconds. Default is 3600.\n"
+  "\t-V, --verify Only replace a destination file by a link if it has\n"
+  "\t   the same content as the source file. Report the others.\n"
+  "\t-s, --status file Report the phase, progress, rate and ETA every\n"
+  "\t   second in file, or on stderr if file is '-'.\n"
+  "\t-u Use io_uring to batch stats, links, unlinks and mkdirs.\n"
+  "\t-v Log the phases and totals, -vv each action as well, -vvv\n"
+  "\t   everything. The log goes to stderr unless -L is given.\n"
   ;
 
 int main(int argc, char **argv)
 {
-	int opt;
-	char *srcdir, *dstdir;
+	int opt, useuring, watch;
+	char *srcdir, *dstdir, *planfn, *applyfn, **dstdirs, *pooldir;
+	char *statusfn, *logfn, *journalfn, *resumefn;
+	int ndst, i;
+	uint64_t deadline = 0;
+	const struct option longopts[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"plan", required_argument, NULL, 'p'},
+		{"apply", required_argument, NULL, 'a'},
+		{"index", required_argument, NULL, 'I'},
+		{"watch", no_argument, NULL, 'w'},
+		{"dirbuf", required_argument, NULL, 'b'},
+		{"hugepages", no_argument, NULL, 'H'},
+		{"reconcile", required_argument, NULL, 'R'},
+		{"pool", required_argument, NULL, 'P'},
+		{"verify", no_argument, NULL, 'V'},
+		{"metrics", required_argument, NULL, 'M'},
+		{"status", required_argument, NULL, 's'},
+		{"log", required_argument, NULL, 'L'},
+		{"exclude", required_argument, NULL, 'x'},
+		{"max-memory", required_argument, NULL, 'm'},
+		{"lockstep", no_argument, NULL, 'l'},
+		{"journal", required_argument, NULL, 'J'},
+		{"resume", required_argument, NULL, 'r'},
+		{"deadline", required_argument, NULL, 'T'},
+		{"exclude-from", required_argument, NULL, 'X'},
+		{"include", required_argument, NULL, 'i'},
+		{NULL, 0, NULL, 0}
+	};
 
 	// set defaults
 	listwork = 0;
 	verbose = 0;
+	nthreads = 1;
+	useuring = 0;
+	watch = 0;
+	reconcile = 3600;
+	planfn = applyfn = indexfn = pooldir = statusfn = logfn = NULL;
+	journalfn = resumefn = NULL;
+	dirbuf = 0;
+	hugepages = 0;
+	verify = 0;
 
-	while((opt = getopt(argc, argv, ":hDv")) != -1) {
+	while((opt = getopt_long(argc, argv, ":hb:DHi:I:j:J:lL:m:M:P:r:s:T:uVvp:a:wR:x:X:", longopts,
+			NULL)) != -1) {
 		switch(opt){
 		case 'h':
 			dohelp(0);
 		break;
+		case 'b': // Dir read buffer size.
+		dirbuf = strtoul(optarg, NULL, 10) * 1024;
+		if (dirbuf < 32 * 1024 || dirbuf > 1024 * 1024 * 1024) {
+			fprintf(stderr, "Dir buffer must be 32 to 1048576 KiB: %s\n",
+					optarg);
+			dohelp(1);
+		}
+		break;
 		case 'D': // Debug mode, record src and dst dir lists in /tmp
 		listwork = 1;
 		break;
+		case 'H': // Huge page backed listings.
+		hugepages = 1;
+		break;
+		case 'x': // Exclude patterns, in the order given.
+		case 'X':
+		case 'i':
+		if (!cmatch) cmatch = init_matcher();
+		if (opt == 'X') add_patternfile(cmatch, optarg, 0);
+		else add_pattern(cmatch, optarg, opt == 'i');
+		break;
+		case 'I': // Source tree index.
+		indexfn = optarg;
+		break;
+		case 'j': // Number of walker threads.
+		nthreads = strtol(optarg, NULL, 10);
+		if (nthreads < 1) {
+			fprintf(stderr, "Thread count must be 1 or more: %s\n",
+					optarg);
+			dohelp(1);
+		}
+		break;
+		case 'L': // Event log file.
+		logfn = optarg;
+		break;
+		case 'l': // Lockstep walk.
+		lockstep = 1;
+		break;
+		case 'm': { // Memory limit for the listings.
+		char *end;
+		maxmem = strtoull(optarg, &end, 10);
+		int shift = 20;
+		if (*end == 'K' || *end == 'k') shift = 10;
+		else if (*end == 'G' || *end == 'g') shift = 30;
+		else if (*end && *end != 'M' && *end != 'm') maxmem = 0;
+		maxmem <<= shift;
+		if (maxmem < 16 * 1024 * 1024) {
+			fprintf(stderr, "Memory limit must be 16M or more: %s\n",
+					optarg);
+			dohelp(1);
+		}
+		} break;
+		case 'M': // Metrics file.
+		metricsfn = optarg;
+		break;
+		case 'P': // Content addressed pool.
+		pooldir = optarg;
+		break;
+		case 'p': // Plan only.
+		planfn = optarg;
+		break;
+		case 'a': // Apply a saved plan.
+		applyfn = optarg;
+		break;
+		case 'J': // Journal to resume from.
+		journalfn = optarg;
+		break;
+		case 'r': // Resume a journal.
+		resumefn = optarg;
+		break;
+		case 'T': { // Time to stop by.
+		char *end;
+		double secs = strtod(optarg, &end);
+		if (*end == 'm') secs *= 60;
+		else if (*end == 'h') secs *= 3600;
+		else if (*end && *end != 's') secs = 0;
+		if (secs <= 0) {
+			fprintf(stderr, "Deadline must be a time such as 90, 90s,"
+					" 30m or 8h: %s\n", optarg);
+			dohelp(1);
+		}
+		deadline = metrics_now() + (uint64_t)(secs * 1e9);
+		} break;
+		case 'w': // Watch mode.
+		watch = 1;
+		break;
+		case 'R': // Full sync interval when watching.
+		reconcile = strtol(optarg, NULL, 10);
+		if (reconcile < 1 || reconcile > INT_MAX / 1000) {
+			fprintf(stderr, "Reconcile interval out of range: %s\n",
+					optarg);
+			dohelp(1);
+		}
+		break;
+		case 's': // Progress reports.
+		statusfn = optarg;
+		break;
+		case 'u': // io_uring backend.
+		useuring = 1;
+		break;
+		case 'V': // Verify before relinking.
+		verify = 1;
+		break;
 		case 'v': // Make verbose.
-		verbose++;	// I will only process 3 levels of verbosity, 1 - 3
-		if (verbose > 3) verbose = 3;
+		verbose++;	// the log level, EV_INFO to EV_DEBUG.
+		if (verbose > EV_DEBUG) verbose = EV_DEBUG;
 		break;
 		case ':':
 			fprintf(stderr, "Option %c requires an argument\n",optopt);
@@ -101,185 +353,1273 @@ int main(int argc, char **argv)
 		} //switch()
 	}//while()
 
-	// now process the non-option arguments
-	checkarg(argv[optind], "source dir");
-	srcdir = realpath(argv[optind], NULL);
+	if (planfn && applyfn) {
+		fputs("Options --plan and --apply are exclusive.\n", stderr);
+		dohelp(EXIT_FAILURE);
+	}
+	if (watch && (planfn || applyfn)) {
+		fputs("Option --watch can not be used with --plan or --apply.\n",
+				stderr);
+		dohelp(EXIT_FAILURE);
+	}
+	if (journalfn && resumefn) {
+		fputs("Options --journal and --resume are exclusive.\n", stderr);
+		dohelp(EXIT_FAILURE);
+	}
+	if ((journalfn || resumefn) && (planfn || applyfn || watch || pooldir ||
+			lockstep || maxmem)) {
+		fputs("Options --journal and --resume can not be used with --plan,"
+				" --apply, --watch, --pool, --lockstep or --max-memory.\n",
+				stderr);
+		dohelp(EXIT_FAILURE);
+	}
+	if (deadline && !journalfn && !resumefn) {
+		fputs("Option --deadline needs --journal or --resume.\n", stderr);
+		dohelp(EXIT_FAILURE);
+	}
+	if (metricsfn) init_metrics();
+	if (cmatch) compile_matcher(cmatch);
+	if (verbose || logfn) init_evlog(logfn, (verbose) ? verbose : EV_ACTION);
+	if (pooldir && (watch || planfn || applyfn)) {
+		fputs("Option --pool can not be used with --watch, --plan or"
+				" --apply.\n", stderr);
+		dohelp(EXIT_FAILURE);
+	}
+	if (maxmem && (pooldir || indexfn || watch || planfn || applyfn)) {
+		fputs("Option --max-memory can not be used with --pool, --index,"
+				" --watch, --plan or --apply.\n", stderr);
+		dohelp(EXIT_FAILURE);
+	}
+	if (lockstep && (maxmem || pooldir || indexfn || watch || planfn ||
+					applyfn)) {
+		fputs("Option --lockstep can not be used with --max-memory, --pool,"
+				" --index, --watch, --plan or --apply.\n", stderr);
+		dohelp(EXIT_FAILURE);
+	}
+	plan *pl = NULL;
+	if (resumefn) applyfn = resumefn;	// a journal is a plan.
+	if (applyfn) {	// the dirs come from the plan.
+		pl = readplan(applyfn);
+		checkarg(pl->src, "source dir");
+		checkarg(pl->dst, "destination dir");
+		srcdir = xstrdup(pl->src);
+		ndst = 1;
+		dstdirs = xmalloc(sizeof(char *));
+		dstdirs[0] = xstrdup(pl->dst);
+	} else {	// now process the non-option arguments
+		checkarg(argv[optind], "source dir");
+		srcdir = realpath(argv[optind], NULL);
+		optind++;
+		checkarg(argv[optind], "destination dir");
+		ndst = argc - optind;
+		dstdirs = xmalloc(ndst * sizeof(char *));
+		for (i = 0; i < ndst; i++) {
+			checkarg(argv[optind + i], "destination dir");
+			dstdirs[i] = realpath(argv[optind + i], NULL);
+		}
+	}
+	if (ndst > 1 && (planfn || watch || journalfn)) {
+		fputs("Options --plan, --watch and --journal take one destination"
+				" dir.\n", stderr);
+		dohelp(EXIT_FAILURE);
+	}
+	dstdir = dstdirs[0];
+	if (pooldir) {
+		checkarg(pooldir, "pool dir");
+		pooldir = realpath(pooldir, NULL);
+		checkpool(pooldir, srcdir, dstdirs, ndst);
+		cpool = init_pool(pooldir);
+		free(pooldir);
+	}
 	srcroot = xstrdup(srcdir);
-	optind++;
-	checkarg(argv[optind], "destination dir");
-	dstdir = realpath(argv[optind], NULL);
 	dstroot = xstrdup(dstdir);
+	// All paths from here on are relative to srcroot or dstroot.
+	srcdc = init_dircache(srcroot);
+	dstdc = init_dircache(dstroot);
+	if (useuring) {
+		ur = init_uring(256);
+		if (!ur) {
+			fprintf(stderr, "io_uring not usable, %s. Carrying on"
+					" without it.\n", strerror(errno));
+			useuring = 0;
+		}
+	}
+	if (statusfn) {	// the last run of the same trees sets the ETA.
+		char key[PATH_MAX * 4];
+		strcpy(key, srcroot);
+		for (i = 0; i < ndst && strlen(key) + strlen(dstdirs[i]) + 2 <
+				sizeof(key); i++) strjoin(key, '\n', dstdirs[i], sizeof(key));
+		start_progress(statusfn, key);
+	}
+	if (journalfn) jnl = init_journal(journalfn, ur != NULL, deadline);
+	if (resumefn) jnl = resume_journal(resumefn, pl, ur != NULL, deadline);
+	if (pl) {	// the work is already worked out.
+		applyactions(pl->al);
+		free_plan(pl);
+	} else if (watch) {
+		watchdirs(srcdir, dstdir, useuring);
+	} else if (maxmem) {
+		syncbig(srcdir, dstdirs, ndst, useuring);
+	} else if (lockstep) {
+		synclockstep(dstdirs, ndst);
+	} else {
+		syncdirs(srcdir, dstdirs, ndst, planfn, useuring);
+	}
+	if (jnl) close_journal(jnl, 1);
+	stop_progress(1);
+	writemetrics(0);
+	// free the workfile data
+	if (cpool) {
+		evlog(EV_INFO, "pool", "Pool: %zu files read, %zu added.",
+								cpool->hashed, cpool->added);
+		free_pool(cpool);	// saves the hash cache.
+	}
+	free(poolrefs);
+	free(devpairs);
+	if (ur) free_uring(ur);
+	free(ops);
+	if (opspaths) free_arena(opspaths);
+	free_dircache(srcdc);
+	free_dircache(dstdc);
+	if (cmatch) free_matcher(cmatch);
+	for (i = 0; i < ndst; i++) free(dstdirs[i]);
+	vfree(srcdir, dstdirs, srcroot, dstroot, NULL);
+	return 0;
+}//main()
+
+void dohelp(int forced)
+{
+  fputs(helpmsg, stderr);
+  exit(forced);
+}
+
+void syncdirs(char *srcdir, char **dstdirs, int ndst,
+				const char *planfn, int useuring)
+{	/* Walk the source and each destination, work out what has to be
+	 * done and do it, or if planfn is not NULL write it there instead.
+	 * The source is walked once however many destinations there are.
+	*/
 	// prepare dir recursion.
-	mdata *md = init_mdata();
+	fslist *src = init_fslist();
+	src->ar->huge = hugepages;
 	size_t meminc = 1024 * 1024;	// 1 meg seems good for this app.
 	rd_data *rd = init_recursedir((char **)NULL, meminc,
 								DT_DIR, DT_REG, 0);
-	// make source dir list.
-	recursedir(srcdir, md, rd);
+	rd->uring = useuring;
+	rd->match = cmatch;
+	if (dirbuf) rd->dentbuf = dirbuf;
+	// make source and destination dir lists, sorted alike.
+	if (indexfn) {	// only the source, the sync itself changes dst.
+		uint64_t sig = rd_signature(rd);
+		rd->index = open_tindex(indexfn, srcdir, sig);
+		rd->keepdirs = 1;
+		metrics_phase(MP_SRCWALK);
+		walktree(srcdir, src, rd);
+		writetindex(indexfn, srcdir, sig, src);	// before the sort.
+		if (rd->index) close_tindex(rd->index);
+		rd->index = NULL;
+		rd->keepdirs = 0;
+	} else {
+		metrics_phase(MP_SRCWALK);
+		walktree(srcdir, src, rd);
+	}
+	metrics_listmem(fslistsize(src));
+	metrics_phase(MP_SRCSORT);
+	sortfslist(src, 0);
+	if (cpool) {
+		metrics_phase(MP_POOL);
+		poolfiles(src);
+	}
+	metrics_phase(-1);
 	if (listwork) {
 		char tfn[PATH_MAX];
-		dumpstrblock(mktmpfn("synclink", "source", tfn), md);
-	}
-	// 1. Create destination dirs as needed.
-	checkdstdirs(strlen(srcroot), md, dstroot);
-	// 2. Check files in destination; link new, delete and link copies.
-	checkdstfiles(strlen(srcroot), md, dstroot);
-	// prepare to make destination dir list
-	memset(md->fro, 0, md->limit - md->fro);
-	md->to = md->fro;
-	// make destination dir list.
-	recursedir(dstdir, md, rd);
+		dumpfslist(mktmpfn("synclink", "source", tfn), src);
+	}
+	if (ndst == 1) {
+		syncdst(src, rd, dstdirs[0], planfn);
+	} else {
+		fanout(src, rd, dstdirs, ndst);
+	}
+	free_fslist(src);
+	free_recursedir(rd, NULL);
+} // syncdirs()
+
+void syncdst(fslist *src, rd_data *rd, char *dstdir, const char *planfn)
+{	/* Walk dstdir, which must be dstroot, and make it match the sorted
+	 * source listing src, or write the plan to do so to planfn.
+	*/
+	fslist *dst = init_fslist();
+	dst->ar->huge = hugepages;
+	metrics_phase(MP_DSTWALK);
+	walktree(dstdir, dst, rd);
+	metrics_listmem(fslistsize(src) + fslistsize(dst));
+	metrics_phase(MP_DSTSORT);
+	sortfslist(dst, 0);
 	if (listwork) {
 		char tfn[PATH_MAX];
-		dumpstrblock(mktmpfn("synclink", "destin", tfn), md);
-	}
-	// 3. Delete files in destination that don't exist in source.
-	checksrcfiles(strlen(dstroot), md, srcroot);
-	// 4. Delete dirs in destination that don't exist in source.
-	// Must sort destination in reverse order so that deletions work.
-	size_t countin = countmemstr(md);
-	sortmemstr(md, 1);
-	size_t countout = countmemstr(md);
-	if (countin != countout) {
-		fprintf(stderr, "Sort failed on destination dir: %s\n", dstdir);
-		exit(EXIT_FAILURE);
+		dumpfslist(mktmpfn("synclink", "destin", tfn), dst);
 	}
+	// work out what has to be done in one pass over both lists.
+	metrics_phase(MP_DIFF);
+	actlist *al = init_actlist();
+	difffslists(src, dst, al);
+	if (!planfn) findmoves(src, dst, al);
+	metrics_phase(-1);
 	if (listwork) {
 		char tfn[PATH_MAX];
-		dumpstrblock(mktmpfn("synclink", "revdst", tfn), md);
+		dumpactlist(mktmpfn("synclink", "action", tfn), al);
 	}
-	checksrcdirs(strlen(dstroot), md, srcroot);
-	// free the workfile data
-	free(srcdir);
-	free(dstdir);
-	free_mdata(md);
-	return 0;
-}//main()
+	if (planfn) {
+		writeplan(planfn, srcroot, dstroot, al);
+	} else {
+		applyactions(al);
+	}
+	free_actlist(al);
+	free_fslist(dst);
+} // syncdst()
 
-void dohelp(int forced)
-{
-  fputs(helpmsg, stderr);
-  exit(forced);
-}
+void fanout(fslist *src, rd_data *rd, char **dstdirs, int ndst)
+{	/* Sync every one of dstdirs to the source listing, each in a
+	 * process of its own and all at once. The children share src copy
+	 * on write; each opens its own destination and, as one can not be
+	 * shared, its own ring. Quits if any fails, once all are done.
+	*/
+	pid_t *pids = xmalloc(ndst * sizeof(pid_t));
+	int i, failed = 0;
+	fflush(NULL);	// or the children write out what is buffered too.
+	flush_evlog();
+	for (i = 0; i < ndst; i++) {
+		pids[i] = fork();
+		if (pids[i] == -1) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		if (pids[i]) continue;
+		setdst(dstdirs[i]);
+		if (ur) {
+			free_uring(ur);
+			ur = init_uring(256);	// NULL falls back to plain syscalls.
+		}
+		syncdst(src, rd, dstdirs[i], NULL);
+		writemetrics(i + 1);
+		exit(EXIT_SUCCESS);
+	}
+	for (i = 0; i < ndst; i++) {
+		int status;
+		if (waitpid(pids[i], &status, 0) == -1) {
+			perror("waitpid");
+			exit(EXIT_FAILURE);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "%s: sync failed\n", dstdirs[i]);
+			failed++;
+		}
+	}
+	free(pids);
+	if (failed) exit(EXIT_FAILURE);
+} // fanout()
 
-void checkdstdirs(size_t srclen, mdata *md, char *dsthead)
-{
-	// traverse md, creating dirs in dsthead as required.
-	if (verbose) fprintf(stderr, "Checking destination dirs.\n");
-	char *line = md->fro;
-	while (line < md->to) {
-		if (exists_dir(line)) {	// it's a dir
-			char buf[PATH_MAX] = {0};
-			sprintf(buf, "%s%s", dsthead, line + srclen);
-			if (verbose > 1)
-				fprintf (stderr, "Checking dir: %s\n", buf);
-			if (!exists_dir(buf)) {	// create the dir
-				if (verbose) fprintf(stderr, "Creating dir: %s\n", buf);
-				newdir(buf, 0);
-			}
+typedef struct bigbatch {	// the actions of syncbig() not yet done.
+	actlist *al;
+	arena *paths;
+	size_t limit;	// bytes they may take.
+} bigbatch;
+
+void syncbig(char *srcdir, char **dstdirs, int ndst, int useuring)
+{	/* syncdirs() for trees whose listings need not fit in memory. Each
+	 * tree is walked into sorted runs on disk, which with their buffer
+	 * and merge take half of maxmem. Each destination is then diffed with the source as
+	 * the runs of both are merged back, and the actions are done a batch
+	 * of at most a quarter of maxmem at a time as they are found. The
+	 * walks are one thread and the destinations are done in turn.
+	*/
+	rd_data *rd = init_recursedir((char **)NULL, 1024 * 1024,
+								DT_DIR, DT_REG, 0);
+	rd->uring = useuring;
+	rd->match = cmatch;
+	if (dirbuf) rd->dentbuf = dirbuf;
+	metrics_phase(MP_SRCWALK);
+	runset *src = init_runset(maxmem / 2);
+	streamtree(srcdir, rd, spillent, src);
+	metrics_phase(MP_SRCSORT);
+	runs_finish(src);
+	metrics_listmem(maxmem / 2);
+	evlog(EV_INFO, "runs", "Source: %zu entries in %zu runs.", src->total,
+			src->nruns);
+	bigbatch bb;
+	bb.al = init_actlist();
+	bb.al->rmdirsafter = 1;
+	bb.al->quiet = 1;
+	bb.paths = init_arena(1024 * 1024);
+	bb.limit = maxmem / 4;
+	int i;
+	for (i = 0; i < ndst; i++) {
+		if (i) setdst(dstdirs[i]);
+		metrics_phase(MP_DSTWALK);
+		runset *dst = init_runset(maxmem / 2);
+		streamtree(dstdirs[i], rd, spillent, dst);
+		metrics_phase(MP_DSTSORT);
+		runs_finish(dst);
+		evlog(EV_INFO, "runs", "Destination: %zu entries in %zu runs.",
+				dst->total, dst->nruns);
+		metrics_phase(MP_DIFF);
+		runmerge *sm = init_runmerge(src);
+		runmerge *dm = init_runmerge(dst);
+		diffruns(sm, dm, bigaction, &bb);
+		if (bb.al->count) applyactions(bb.al);
+		bb.al->count = 0;
+		clear_arena(bb.paths);
+		metrics_phase(-1);
+		free_runmerge(sm);
+		free_runmerge(dm);
+		free_runset(dst);
+	}
+	free_actlist(bb.al);
+	free_arena(bb.paths);
+	free_runset(src);
+	free_recursedir(rd, NULL);
+} // syncbig()
+
+void spillent(void *arg, const char *path, fsent *fe)
+{	/* streamtree() hands each entry here, to go into a run. */
+	runs_add((runset *)arg, path, fe);
+} // spillent()
+
+void bigaction(void *arg, unsigned char op, const char *path)
+{	/* diffruns() hands each action here. They are done a batch at a
+	 * time, once the batch has taken its share of memory.
+	*/
+	bigbatch *bb = arg;
+	addaction(bb->al, op, arenastr(bb->paths, path));
+	if (arenasize(bb->paths) + bb->al->limit * sizeof(action) < bb->limit)
+		return;
+	applyactions(bb->al);
+	bb->al->count = 0;
+	clear_arena(bb->paths);
+	metrics_phase(MP_DIFF);
+} // bigaction()
+
+void setdst(const char *dstdir)
+{	/* Make dstdir the destination that paths in it are relative to. */
+	free(dstroot);
+	dstroot = xstrdup((char *)dstdir);
+	free_dircache(dstdc);
+	dstdc = init_dircache(dstroot);
+} // setdst()
+
+typedef struct steplevel {	// what stepdir() holds at one depth.
+	fslist *src;
+	fslist *dst;
+	actlist *al;
+} steplevel;
+
+typedef struct stepper {
+	rd_data *rd;
+	steplevel *lv;
+	int nlevels;
+} stepper;
+
+static void stepdir(stepper *sp, DIR *sup, DIR *dup, const char *path,
+						int depth);
+
+void synclockstep(char **dstdirs, int ndst)
+{	/* syncdirs() without listing either tree whole: stepdir() makes each
+	 * dst dir match its src dir and only then goes into the subdirs of
+	 * both. So the dst is walked once, as it is made to match, and what
+	 * is held is a listing of one dir of each tree at each depth.
+	 * The destinations are done in turn.
+	*/
+	stepper sp;
+	memset(&sp, 0, sizeof(stepper));
+	sp.rd = init_recursedir((char **)NULL, 64 * 1024, DT_DIR, DT_REG, 0);
+	sp.rd->uring = (ur != NULL);
+	sp.rd->match = cmatch;
+	if (dirbuf) sp.rd->dentbuf = dirbuf;
+	int i;
+	for (i = 0; i < ndst; i++) {
+		if (i) setdst(dstdirs[i]);
+		stepdir(&sp, NULL, NULL, "", 0);
+	}
+	size_t mem = 0;
+	for (i = 0; i < sp.nlevels; i++) {
+		mem += fslistsize(sp.lv[i].src) + fslistsize(sp.lv[i].dst);
+		free_fslist(sp.lv[i].src);
+		free_fslist(sp.lv[i].dst);
+		free_actlist(sp.lv[i].al);
+	}
+	metrics_listmem(mem);
+	free(sp.lv);
+	free_recursedir(sp.rd, NULL);
+} // synclockstep()
+
+void stepdir(stepper *sp, DIR *sup, DIR *dup, const char *path, int depth)
+{	/* Make the dst dir path match the src dir path, then do the same
+	 * for every subdir of it. Sup and dup are the parents of the two,
+	 * both NULL for the roots; sup alone NULL means the dir is not in
+	 * the source and all that is in it goes. The listings are those of
+	 * this depth, reused by every dir at it.
+	*/
+	if (depth == sp->nlevels) {
+		sp->lv = realloc(sp->lv, (depth + 1) * sizeof(steplevel));
+		if (!sp->lv) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
 		}
-		line += strlen(line) + 1;
+		sp->lv[depth].src = init_fslist();
+		sp->lv[depth].dst = init_fslist();
+		// a dir of names, not a tree, so no need of huge chunks.
+		sp->lv[depth].src->ar->chunksize = 64 * 1024;
+		sp->lv[depth].dst->ar->chunksize = 64 * 1024;
+		sp->lv[depth].al = init_actlist();
+		sp->lv[depth].al->quiet = 1;
+		sp->nlevels++;
+	}
+	fslist *src = sp->lv[depth].src, *dst = sp->lv[depth].dst;
+	actlist *al = sp->lv[depth].al;
+	clear_fslist(src);
+	clear_fslist(dst);
+	al->count = 0;
+	const char *name = strrchr(path, '/');
+	name = (name) ? name + 1 : path;
+	DIR *sdp = NULL, *ddp;
+	metrics_phase(MP_SRCWALK);
+	if (!depth) sdp = listdirat(AT_FDCWD, srcroot, "", src, sp->rd, srcroot);
+	else if (sup) sdp = listdirat(dirfd(sup), name, path, src, sp->rd,
+									srcroot);
+	metrics_phase(MP_DSTWALK);
+	ddp = listdirat((depth) ? dirfd(dup) : AT_FDCWD, (depth) ? name
+					: dstroot, path, dst, sp->rd, dstroot);
+	if (!ddp) {	// gone since its parent was done.
+		if (sdp) doclosedir(sdp);
+		metrics_phase(-1);
+		return;
 	}
-} // checkdstdirs()
+	metrics_phase(MP_SRCSORT);
+	sortfslist(src, 0);
+	metrics_phase(MP_DSTSORT);
+	sortfslist(dst, 0);
+	metrics_phase(MP_DIFF);
+	difffslists(src, dst, al);
+	findmoves(src, dst, al);
+	metrics_phase(-1);
+	// What is in a dir that goes has to go first.
+	size_t i;
+	char sub[PATH_MAX];
+	for (i = 0; i < al->count; i++) {
+		if (al->acts[i].op != ACT_RMDIR) continue;
+		stepdir(sp, NULL, ddp, actpath(&al->acts[i], sub), depth + 1);
+	}
+	applyactions(al);
+	if (sdp) {
+		for (i = 0; i < src->count; i++) {
+			if (src->ents[i].type != DT_DIR) continue;
+			stepdir(sp, sdp, ddp, fspath(src, i, sub), depth + 1);
+		}
+		doclosedir(sdp);
+	}
+	doclosedir(ddp);
+} // stepdir()
 
-void checkdstfiles(size_t srclen, mdata *md, char *dsthead)
-{
-	// traverse the lists, checking files in dst.
-	char *srcline = md->fro;
-	if (verbose) fprintf(stderr, "Checking destination files.\n");
-	while (srcline < md->to) {
-		if (exists_file(srcline)) {	// it's a file
-			char buf[PATH_MAX] = {0};
-			sprintf(buf, "%s%s", dsthead, srcline + srclen);
-			if(verbose > 1) fprintf(stderr,
-					"Checking destination file: %s\n", buf);
-			if (exists_file(buf)) {
-				// the filename exists: copy or link?
-				if (getinode(srcline) != getinode(buf)) { // not a link
-					if (verbose) fprintf(stderr,
-					"Deleting copy and making link: %s\n", buf);
-					myunlink(buf);
-					makelink(srcline, buf);
-				}
-			} else { // the filename does not exist in dst.
-				if(verbose) fprintf(stderr,
-					"Linking new destination file: %s\n", buf);
-				makelink(srcline, buf);
-			}
+void watchdirs(char *srcdir, char *dstdir, int useuring)
+{	/* Sync once, then keep dst in step with src as inotify reports its
+	 * changes. Only the dirs changed are compared, one level deep. The
+	 * whole trees are synced again every reconcile seconds, and at
+	 * once if events have been lost. Failures, mostly races with
+	 * changes still being made, are reported but are not fatal; the
+	 * events that caused them bring the dir round again. Never returns.
+	*/
+	keepgoing = 1;
+	watcher *w = init_watcher(srcdir, cmatch);	// before the sync, miss nothing.
+	syncdirs(srcdir, &dstdir, 1, NULL, useuring);
+	writemetrics(0);	// as it never exits.
+	time_t next = time(NULL) + reconcile;
+	while (1) {
+		time_t now = time(NULL);
+		int n = watch_wait(w, (next > now) ? (next - now) * 1000 : 0, 200);
+		flush_dircache(srcdc);	// dirs may have been replaced since.
+		flush_dircache(dstdc);
+		if (n < 0 || time(NULL) >= next) {
+			evlog(EV_INFO, "reconcile", "Reconciling %s with %s%s",
+							dstdir, srcdir, (n < 0) ? ", events lost" : "");
+			if (n < 0) rewatch(w);
+			syncdirs(srcdir, &dstdir, 1, NULL, useuring);
+			writemetrics(0);
+			next = time(NULL) + reconcile;
+			continue;
+		}
+		int i;
+		for (i = 0; i < n; i++) {
+			evlog(EV_ACTION, "changed", "Changed: %s/%s",
+									srcroot, w->dirty[i]);
+			syncpath(w->dirty[i], 0, useuring);
 		}
-		srcline += strlen(srcline) + 1;
 	}
-} // checkdstfiles()
+} // watchdirs()
 
-void checksrcfiles(size_t dstlen, mdata *md, char *srchead)
-{	/* if there are any files found in dst that don't exist in src,
-	 * delete them.
+void syncpath(const char *rel, int deep, int useuring)
+{	/* Make the entries of rel, relative to both roots, in dst match
+	 * those in src; if deep all that is below rel too. A dir to be made
+	 * or removed, or one that is replaced by a file or the reverse, is
+	 * then synced deep.
 	*/
-	char *dstline = md->fro;
-	if (verbose) fprintf(stderr, "Checking source files.\n");
-
-	while (dstline < md->to) {
-		if (exists_file(dstline)) {	// It's a file.
-			char buf[PATH_MAX];
-			sprintf(buf, "%s%s", srchead, dstline + dstlen);
-			// Does it exist in src?
-			if (!exists_file(buf)) { // No such file in src.
-				// So remove it from dst.
-				myunlink(dstline);
+	fslist *src = init_fslist();
+	fslist *dst = init_fslist();
+	rd_data *rd = init_recursedir((char **)NULL, 64 * 1024,
+								DT_DIR, DT_REG, 0);
+	rd->uring = useuring;
+	rd->match = cmatch;
+	if (dirbuf) rd->dentbuf = dirbuf;
+	rd->shallow = !deep;
+	walkpath(srcdc, rel, src, rd);
+	walkpath(dstdc, rel, dst, rd);
+	actlist *al = init_actlist();
+	difffslists(src, dst, al);
+	actlist *todo = al;
+	actlist *deeper = init_actlist();
+	if (!deep) {	// put aside the dirs and anything in the same place.
+		todo = init_actlist();
+		size_t i;
+		char path[PATH_MAX], other[PATH_MAX];
+		for (i = 0; i < al->count; i++) {
+			action *act = &al->acts[i];
+			if (act->op == ACT_MKDIR || act->op == ACT_RMDIR) {
+				copyaction(deeper, act);
+				continue;
 			}
+			// a replaced dir has both its actions next to each other.
+			actpath(act, path);
+			if ((i > 0 &&
+				strcmp(actpath(&al->acts[i - 1], other), path) == 0) ||
+				(i + 1 < al->count &&
+				strcmp(actpath(&al->acts[i + 1], other), path) == 0))
+				continue;
+			copyaction(todo, act);
 		}
-		dstline += strlen(dstline) + 1;
 	}
-} // checksrcfiles()
+	char path[PATH_MAX], prev[PATH_MAX] = {0};
+	if (deeper->count && strcmp(actpath(deeper->acts, path), rel) == 0) {
+		syncpath(rel, 1, useuring);	// rel itself, do it all deep.
+	} else {
+		applyactions(todo);
+		size_t i;
+		for (i = 0; i < deeper->count; i++) {
+			actpath(&deeper->acts[i], path);
+			if (i && strcmp(prev, path) == 0) continue;
+			flush_dircache(srcdc);
+			flush_dircache(dstdc);
+			syncpath(path, 1, useuring);
+			strcpy(prev, path);
+		}
+	}
+	if (todo != al) free_actlist(todo);
+	free_actlist(al);
+	free_actlist(deeper);
+	free_fslist(src);
+	free_fslist(dst);
+	free_recursedir(rd, NULL);
+} // syncpath()
 
-void checksrcdirs(size_t dstlen, mdata *md, char *srchead)
-{	/* if there are any dirs found in dst that don't exist in src,
-	 * delete them. NB checksrcfiles() must be run first so that these
-	 * dirs are empty.
+void walkpath(dircache *dc, const char *rel, fslist *fl, rd_data *rd)
+{	/* List rel, relative to the root of dc, and what is in it, into fl
+	 * sorted. Rel itself is listed unless it is the root. Nothing is
+	 * listed if rel does not exist or is neither a file nor a dir.
 	*/
-	char *dstline = md->fro;
-	if (verbose) fprintf(stderr, "Checking source dirs.\n");
-	while (dstline < md->to) {
-		if (exists_dir(dstline)) {	// It's a dir.
-			char buf[PATH_MAX];
-			sprintf(buf, "%s%s", srchead, dstline + dstlen);
-			// Does it exist in src?
-			if (!exists_dir(buf)) {	// No such dir in src.
-				// So remove it from dst.
-				dormdir(dstline);
-			}
+	int rootfd = dc->fds[0];
+	size_t self = NOPARENT;
+	if (*rel) {
+		struct stat sb;
+		if (fstatat(rootfd, rel, &sb, AT_SYMLINK_NOFOLLOW) == -1) return;
+		fsent fe;
+		memset(&fe, 0, sizeof(fsent));
+		fe.ino = sb.st_ino;
+		fe.dev = sb.st_dev;
+		fe.nlink = sb.st_nlink;
+		if (S_ISREG(sb.st_mode)) fe.type = DT_REG;
+		else if (S_ISDIR(sb.st_mode)) fe.type = DT_DIR;
+		else return;
+		if (rd->match && match_path(rd->match, rel, fe.type == DT_DIR))
+			return;
+		fe.parent = NOPARENT;
+		self = fl->count;
+		addfslist(fl, rel, &fe);	// named by its whole path.
+		if (fe.type != DT_DIR) return;
+	}
+	int fd = openat(rootfd, (*rel) ? rel : ".",
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) return;	// gone since.
+	DIR *dp = fdopendir(fd);
+	if (!dp) {
+		perror("fdopendir");
+		exit(EXIT_FAILURE);
+	}
+	char path[PATH_MAX];
+	strcpy(path, dc->root);
+	if (*rel) strjoin(path, '/', (char *)rel, PATH_MAX);
+	size_t i = fl->count;
+	rd->matchrel = rel;
+	recursedirp(dp, path, fl, rd);
+	rd->matchrel = NULL;
+	for (; i < fl->count; i++)	// what is at the top of rel is in rel.
+		if (fl->ents[i].parent == NOPARENT) fl->ents[i].parent = self;
+	sortfslist(fl, 0);
+} // walkpath()
+
+void walktree(char *dirname, fslist *fl, rd_data *rd)
+{	/* Make the dir list for dirname, in parallel if so requested. */
+	if (nthreads > 1) {
+		precursedir(dirname, fl, rd, nthreads);
+	} else {
+		recursedir(dirname, fl, rd);
+	}
+} // walktree()
+
+void poolfiles(fslist *src)
+{	/* Put every file listed in src into the pool, or find the one of
+	 * the same content already there, and list the pool inode in its
+	 * place so that difffslists() has dst linked to that. A file that
+	 * can not be pooled is left to be linked as it is.
+	*/
+	size_t i;
+	char path[PATH_MAX];
+	poolsrc = src;
+	poolrefs = xmalloc(src->count * sizeof(struct poolref));
+	for (i = 0; i < src->count; i++) {
+		fsent *fe = &src->ents[i];
+		poolrefs[i].size = NOPOOL;
+		mt_done(1);
+		if (fe->type != DT_REG) continue;
+		fspath(src, i, path);
+		const char *name;
+		struct stat sb;
+		int fd = dircache_at(srcdc, path, &name);
+		if (fd == -1 || fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			pathfail(srcroot, path);
+			continue;
+		}
+		if (!S_ISREG(sb.st_mode)) continue;	// replaced since.
+		uint64_t hash;
+		if (pool_add(cpool, fd, name, &sb, &hash) == -1) {
+			fprintf(stderr, "%s/%s: not pooled, %s\n", srcroot, path,
+					strerror(errno));
+			continue;
 		}
-		dstline += strlen(dstline) + 1;
+		fe->ino = sb.st_ino;
+		fe->dev = sb.st_dev;
+		poolrefs[i].hash = hash;
+		poolrefs[i].size = sb.st_size;
 	}
-} // checksrcdirs()
+} // poolfiles()
 
-void myunlink(const char *path)
-{	/* just unlink() with error handling */
-	if (verbose) fprintf(stderr, "Unlinking: %s\n", path);
-	if (unlink(path) == -1) {
-		perror(path);
+const char *poolfrom(action *act, const char *path, char *pname)
+{	/* The pool entry to link act from into pname, or NULL to link from
+	 * src. Unless src is the pool entry its content is compared first:
+	 * a file changed since it was pooled, or a hash collision, is not
+	 * worth the risk.
+	*/
+	if (!poolrefs || act->fl != poolsrc ||
+			poolrefs[act->ent].size == NOPOOL) return NULL;
+	pool_name(poolrefs[act->ent].hash, poolrefs[act->ent].size, pname);
+	const char *name;
+	int fd = dircache_at(srcdc, path, &name);
+	if (fd == -1) return NULL;	// makelink() will report it.
+	int same = pool_same(cpool, fd, name, pname);
+	if (same == 1) return pname;
+	if (same == 0) fprintf(stderr, "%s/%s: differs from %s/%s, linked"
+					" as it is.\n", srcroot, path, cpool->root, pname);
+	else fprintf(stderr, "%s/%s: %s\n", cpool->root, pname,
+					strerror(errno));
+	return NULL;
+} // poolfrom()
+
+void checkpool(const char *pooldir, char *srcdir, char **dstdirs,
+				int ndst)
+{	/* The pool must be on the file system of the trees, for links,
+	 * and not inside any of them, or it would be synced itself.
+	*/
+	struct stat psb, sb;
+	int i;
+	if (stat(pooldir, &psb) == -1) {
+		perror(pooldir);
 		exit(EXIT_FAILURE);
 	}
+	for (i = -1; i < ndst; i++) {
+		const char *root = (i < 0) ? srcdir : dstdirs[i];
+		size_t len = strlen(root);
+		if (stat(root, &sb) == -1) {
+			perror(root);
+			exit(EXIT_FAILURE);
+		}
+		if (sb.st_dev != psb.st_dev) {
+			fprintf(stderr, "%s: not on the file system of %s\n",
+					pooldir, root);
+			exit(EXIT_FAILURE);
+		}
+		if (strncmp(pooldir, root, len) == 0 &&
+				(pooldir[len] == '/' || pooldir[len] == 0)) {
+			fprintf(stderr, "%s: inside %s\n", pooldir, root);
+			exit(EXIT_FAILURE);
+		}
+	}
+} // checkpool()
+
+void findmoves(fslist *src, fslist *dst, actlist *al)
+{	/* Rename in dst what al would remove only to link or make again
+	 * elsewhere, as found by findrenames(), and replace al with what is
+	 * still to be done after. A dir moved in src so costs one rename,
+	 * not an unlink and a link for every file in it.
+	*/
+	renames *rn = findrenames(src, dst, al);
+	if (!rn->count) {
+		free_renames(rn);
+		return;
+	}
+	char path[PATH_MAX], to[PATH_MAX];
+	size_t k, done = 0;
+	metrics_phase(MP_RENAME);
+	if (!al->quiet) evlog(EV_INFO, "phase", "Renaming moved entries.");
+	for (k = 0; k < rn->nmkdirs; k++) {
+		fspath(src, rn->mkdirs[k], path);
+		evlog(EV_ACTION, "mkdir", "Creating dir: %s/%s", dstroot, path);
+		makedir(path);
+		flushops();	// each may be in the one before.
+	}
+	for (k = 0; k < rn->count; k++) {
+		if (renamedst(fspath(dst, rn->from[k], path),
+						fspath(src, rn->to[k], to)) == -1) continue;
+		rn->from[done] = rn->from[k];	// those not done get diffed.
+		rn->to[done++] = rn->to[k];
+	}
+	rn->count = done;
+	flush_dircache(dstdc);	// it may have the old names.
+	metrics_phase(MP_DIFF);
+	renamefslist(src, dst, rn);
+	al->count = 0;
+	difffslists(src, dst, al);
+	free_renames(rn);
+} // findmoves()
+
+void applyactions(actlist *al)
+{	/* Do what difffslists() found to be needed. Removals go first so
+	 * that a dir replaced by a file, or the reverse, is out of the way
+	 * before its replacement is made. With io_uring every phase is
+	 * submitted as a batch; mkdirs and rmdirs are batched one depth at
+	 * a time so that no dir is made before its parent or removed
+	 * before its children. With a journal what is to be done is written
+	 * to it first, and how far it has got as it goes, see reached().
+	*/
+	size_t i, n;
+	int d, maxdepth = 0;
+	unsigned short *depth = NULL;
+	action *act;
+	char path[PATH_MAX];
+	if (!al->count) return;
+	unsigned char *skip = xmalloc(al->count);	// relinks not to do.
+	memset(skip, 0, al->count);
+	if (!jnl || !jnl->resumed) {	// resumed, the journal has the result.
+		metrics_phase(MP_VERIFY);
+		keepcopies(al, skip);
+		if (verify) verifyrelinks(al, skip);
+	}
+	if (jnl && !jnl->fp) {	// the journal has only what is to be done.
+		for (i = n = 0; i < al->count; i++)
+			if (!skip[i]) al->acts[n++] = al->acts[i];
+		al->count = n;
+		memset(skip, 0, n);
+		journal_plan(jnl, srcroot, dstroot, al);
+	}
+	if (ur) {	// depth of each dir to make or remove.
+		depth = xmalloc((al->count + 1) * sizeof(unsigned short));
+		for (i = 0; i < al->count; i++) {
+			act = &al->acts[i];
+			depth[i] = 0;
+			if (act->op != ACT_MKDIR && act->op != ACT_RMDIR) continue;
+			char *cp;
+			for (cp = actpath(act, path); *cp; cp++)
+				if (*cp == '/') depth[i]++;
+			if (depth[i] > maxdepth) maxdepth = depth[i];
+		}
+	}
+	metrics_phase(MP_UNLINK);
+	// 1. Delete files in destination that don't exist in source, and
+	// copies that are to be replaced by links.
+	if (!al->quiet) evlog(EV_INFO, "phase", "Removing destination files.");
+	for (i = 0; i < al->count; i++) {
+		act = &al->acts[i];
+		if (act->op != ACT_RELINK && act->op != ACT_UNLINK) continue;
+		if (skip[i] || reached(JP_UNLINK, 0, i)) continue;
+		actpath(act, path);
+		if (act->op == ACT_RELINK) evlog(EV_ACTION, "relink",
+				"Deleting copy and making link: %s/%s", dstroot, path);
+		myunlink(path);
+	}
+	flushops();
+	// 2. Delete dirs in destination that don't exist in source.
+	// Reverse order so that each dir is empty by the time it is reached.
+	metrics_phase(MP_RMDIR);
+	if (!al->quiet) evlog(EV_INFO, "phase", "Removing destination dirs.");
+	for (d = maxdepth; d >= 0; d--) {
+		for (n = 0; n < al->count; n++) {
+			i = (al->rmdirsafter) ? n : al->count - 1 - n;
+			act = &al->acts[i];
+			if (act->op != ACT_RMDIR) continue;
+			if (ur && depth[i] != d) continue;
+			if (reached(JP_RMDIR, maxdepth - d, n)) continue;
+			dormdir(actpath(act, path));
+		}
+		flushops();
+		if (!ur) break;
+	}
+	// 3. Create destination dirs as needed.
+	metrics_phase(MP_MKDIR);
+	if (!al->quiet) evlog(EV_INFO, "phase", "Creating destination dirs.");
+	for (d = 0; d <= maxdepth; d++) {
+		for (i = 0; i < al->count; i++) {
+			act = &al->acts[i];
+			if (act->op != ACT_MKDIR) continue;
+			if (ur && depth[i] != d) continue;
+			if (reached(JP_MKDIR, d, i)) continue;
+			actpath(act, path);
+			evlog(EV_ACTION, "mkdir", "Creating dir: %s/%s", dstroot, path);
+			makedir(path);
+		}
+		flushops();
+	}
+	// 4. Link new files and the copies removed above.
+	metrics_phase(MP_LINK);
+	if (!al->quiet) evlog(EV_INFO, "phase", "Linking destination files.");
+	for (i = 0; i < al->count; i++) {
+		act = &al->acts[i];
+		if (act->op != ACT_LINK && act->op != ACT_RELINK) continue;
+		if (skip[i] || reached(JP_LINK, 0, i)) continue;
+		actpath(act, path);
+		if (act->op == ACT_LINK) evlog(EV_ACTION, "new",
+				"Linking new destination file: %s/%s", dstroot, path);
+		char pname[POOLNAME_MAX];
+		makelink(path, poolfrom(act, path, pname));
+	}
+	flushops();
+	if (jnl) journal_at(jnl, JP_LINK, 0, al->count);
+	metrics_phase(-1);
+	free(depth);
+	free(skip);
+} // applyactions()
+
+int reached(int phase, int pass, size_t next)
+{	/* For the journal, if any: whether action next of the pass was done
+	 * before the run was resumed, else note that all before it is done.
+	 * What io_uring has queued is not done till flushed, so then that is
+	 * done first, only when a checkpoint is due. Stops the run at the
+	 * deadline, resumable.
+	*/
+	if (!jnl) return 0;
+	if (journal_done(jnl, phase, pass, next)) return 1;
+	if (ur) {
+		if (!journal_due(jnl)) return 0;
+		flushops();
+	}
+	if (!journal_at(jnl, phase, pass, next)) return 0;
+	journal_sync(jnl);
+	stop_progress(0);
+	writemetrics(0);
+	flush_evlog();
+	fprintf(stderr, "Deadline reached, resume with: synclink %s--resume %s\n",
+			(jnl->uring) ? "-u " : "", jnl->fn);
+	exit(EXIT_DEADLINE);
+} // reached()
+
+int redone(const char *path, int err, int already)
+{	/* An action that failed with err, already being the errno of one
+	 * that was done before, is not a failure if it is being done again
+	 * by a resumed run, as all since the last checkpoint is.
+	*/
+	if (!jnl || !jnl->resumed || err != already) return 0;
+	evlog(EV_DEBUG, "redone", "Already done: %s/%s", dstroot, path);
+	return 1;
+} // redone()
+
+void keepcopies(actlist *al, unsigned char *skip)
+{	/* A dst file can never be a link to its src file, only a copy, if
+	 * it is on another file system or the src file has all the links
+	 * its file system allows. Flag those in skip that have the size and
+	 * mtime of src, as a copy made by copylink() has, or they are copied
+	 * again on every run.
+	*/
+	struct stat rsb, ssb, dsb;
+	char path[PATH_MAX];
+	size_t i;
+	if (fstat(dstdc->fds[0], &rsb) == -1) return;
+	long linkmax = fpathconf(srcdc->fds[0], _PC_LINK_MAX);
+	if (linkmax <= 0) linkmax = LONG_MAX;	// no limit.
+	for (i = 0; i < al->count; i++) {
+		action *act = &al->acts[i];
+		if (act->op != ACT_RELINK) continue;
+		if (act->fl && act->fl->ents[act->ent].dev == rsb.st_dev &&
+				act->fl->ents[act->ent].nlink < linkmax) continue;
+		actpath(act, path);
+		if (fstatat(srcdc->fds[0], path, &ssb, AT_SYMLINK_NOFOLLOW) == -1 ||
+			fstatat(dstdc->fds[0], path, &dsb, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		if ((ssb.st_dev != dsb.st_dev || (long)ssb.st_nlink >= linkmax) &&
+				ssb.st_size == dsb.st_size &&
+				ssb.st_mtim.tv_sec == dsb.st_mtim.tv_sec &&
+				ssb.st_mtim.tv_nsec == dsb.st_mtim.tv_nsec)
+			skip[i] = 1;
+	}
+} // keepcopies()
+
+void verifyrelinks(actlist *al, unsigned char *skip)
+{	/* Check each dst file that is to be replaced by a link against its
+	 * src file: first the sizes, then the hashes of the contents, all
+	 * hashed at once on as many threads as there are cpus, or -j if
+	 * more than one. Those that differ are reported and flagged in
+	 * skip, so that they are left alone.
+	*/
+	size_t i, n, nrel = 0, bad = 0;
+	char path[PATH_MAX];
+	for (i = 0; i < al->count; i++)
+		if (al->acts[i].op == ACT_RELINK && !skip[i]) nrel++;
+	if (!nrel) return;
+	hashjob *jobs = xmalloc(2 * nrel * sizeof(hashjob));
+	size_t *which = xmalloc(nrel * sizeof(size_t));
+	arena *paths = init_arena(1024 * 1024);
+	for (i = 0, n = 0; i < al->count; i++) {
+		if (al->acts[i].op != ACT_RELINK || skip[i]) continue;
+		actpath(&al->acts[i], path);
+		struct stat ssb, dsb;
+		if (fstatat(srcdc->fds[0], path, &ssb, AT_SYMLINK_NOFOLLOW) == -1 ||
+			fstatat(dstdc->fds[0], path, &dsb, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;	// the relink will report it.
+		if (ssb.st_size != dsb.st_size) {
+			fprintf(stderr, "%s/%s: size differs from %s/%s, not"
+					" replaced\n", dstroot, path, srcroot, path);
+			skip[i] = 1;
+			bad++;
+			continue;
+		}
+		char *cp = arenastr(paths, path);
+		jobs[2 * n].dirfd = srcdc->fds[0];
+		jobs[2 * n].path = cp;
+		jobs[2 * n + 1].dirfd = dstdc->fds[0];
+		jobs[2 * n + 1].path = cp;
+		which[n++] = i;
+	}
+	int threads = nthreads;
+	if (threads < 2) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	hashfiles(jobs, 2 * n, threads);
+	mt_done(nrel);
+	for (i = 0; i < n; i++) {
+		hashjob *sj = &jobs[2 * i], *dj = &jobs[2 * i + 1];
+		if (sj->err || dj->err) {
+			fprintf(stderr, "%s/%s: %s, not replaced\n",
+					(sj->err) ? srcroot : dstroot, sj->path,
+					strerror((sj->err) ? sj->err : dj->err));
+		} else if (sj->hash != dj->hash) {
+			fprintf(stderr, "%s/%s: content differs from %s/%s, not"
+					" replaced\n", dstroot, sj->path, srcroot, sj->path);
+		} else {
+			continue;
+		}
+		skip[which[i]] = 1;
+		bad++;
+	}
+	evlog(EV_INFO, "verify", "Verified %zu copies, %zu differ.", nrel, bad);
+	free_arena(paths);
+	free(which);
+	free(jobs);
+} // verifyrelinks()
+
+int copylink(int sfd, const char *sname, int dfd, const char *dname)
+{	/* Copy sname in sfd to dname in dfd where a link can not be made:
+	 * dst is on another file system, or src has all the links it can.
+	 * The way to copy is worked out once for each pair of file systems.
+	 * Returns 0, or -1 with errno set.
+	*/
+	struct stat ssb, dsb;
+	if (fstatat(sfd, sname, &ssb, AT_SYMLINK_NOFOLLOW) == -1 ||
+			fstat(dfd, &dsb) == -1) return -1;
+	size_t i;
+	for (i = 0; i < ndevpairs; i++)
+		if (devpairs[i].sdev == ssb.st_dev && devpairs[i].ddev == dsb.st_dev)
+			break;
+	if (i == ndevpairs) {
+		devpairs = realloc(devpairs, (i + 1) * sizeof(struct devpair));
+		if (!devpairs) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		devpairs[i].sdev = ssb.st_dev;
+		devpairs[i].ddev = dsb.st_dev;
+		devpairs[i].method = 0;
+		ndevpairs++;
+	}
+	int was = devpairs[i].method;
+	uint64_t t = mt_start();
+	int res = copyat(sfd, sname, dfd, dname, &devpairs[i].method);
+	mt_end(MC_COPY, t, res == -1);
+	if (res == -1) return -1;
+	if (devpairs[i].method != was) {
+		static const char *how[] = {"", "reflink", "copy_file_range",
+									"sendfile"};
+		evlog(EV_INFO, "copymethod", "Copying from device %lx to %lx by %s.",
+				(unsigned long)ssb.st_dev, (unsigned long)dsb.st_dev,
+				how[devpairs[i].method]);
+	}
+	return 0;
+} // copylink()
+
+void myunlink(const char *path)
+{	/* just unlink() with error handling, path is in dst */
+	mt_done(1);
+	evlog(EV_ACTION, "unlink", "Unlinking: %s/%s", dstroot, path);
+	if (ur) {
+		queueop(URING_UNLINKAT, path, 0);
+		return;
+	}
+	const char *name;
+	int fd = dircache_at(dstdc, path, &name);
+	if (fd == -1) {
+		pathfail(dstroot, path);
+		return;
+	}
+	uint64_t t = mt_start();
+	int res = unlinkat(fd, name, 0);
+	mt_end(MC_UNLINK, t, res == -1);
+	if (res == -1 && !redone(path, errno, ENOENT)) pathfail(dstroot, path);
 } // myunlink()
 
-void makelink(const char *src, const char *dst)
-{	/* link() with error handling */
-	if (verbose) fprintf(stderr, "Linking:\n\t%s =>\n\t%s\n", src, dst);
-	if (link(src, dst) == -1) {
-		perror(src);
-		exit(EXIT_FAILURE);
+void makelink(const char *path, const char *from)
+{	/* link() with error handling, from path in src, or if from is not
+	 * NULL from that pool entry, to path in dst.
+	*/
+	mt_done(1);
+	evlog(EV_ACTION, "link", "Linking:\n\t%s/%s =>\n\t%s/%s",
+							(from) ? cpool->root : srcroot,
+							(from) ? from : path, dstroot, path);
+	if (ur) {
+		queueop(URING_LINKAT, path, 0);
+		if (from) {
+			ops[nops - 1].dirfd = cpool->fd;
+			ops[nops - 1].path = arenastr(opspaths, from);
+		}
+		return;
+	}
+	const char *sname, *dname;
+	int sfd;
+	if (from) {
+		sfd = cpool->fd;
+		sname = from;
+	} else {
+		sfd = dircache_at(srcdc, path, &sname);
+	}
+	if (sfd == -1) {
+		pathfail(srcroot, path);
+		return;
+	}
+	int dfd = dircache_at(dstdc, path, &dname);
+	if (dfd == -1) {
+		pathfail(dstroot, path);
+		return;
+	}
+	uint64_t t = mt_start();
+	int res = linkat(sfd, sname, dfd, dname, 0);
+	mt_end(MC_LINK, t, res == -1);
+	if (res == -1 && ((errno != EXDEV && errno != EMLINK) ||
+		copylink(sfd, sname, dfd, dname) == -1) &&
+		!redone(path, errno, EEXIST)) {
+		if (from) pathfail(cpool->root, from);
+		else pathfail(srcroot, path);
 	}
 } // makelink()
 
 void dormdir(const char *path)
-{	/* rmdir() with error handling */
-	if (verbose) fprintf(stderr, "Removing dir: %s\n", path);
-	if (rmdir(path) == -1) {
-		perror(path);
-		exit(EXIT_FAILURE);
+{	/* rmdir() with error handling, path is in dst */
+	mt_done(1);
+	evlog(EV_ACTION, "rmdir", "Removing dir: %s/%s", dstroot, path);
+	if (ur) {
+		queueop(URING_UNLINKAT, path, AT_REMOVEDIR);
+		return;
+	}
+	const char *name;
+	int fd = dircache_at(dstdc, path, &name);
+	if (fd == -1) {
+		pathfail(dstroot, path);
+		return;
 	}
+	uint64_t t = mt_start();
+	int res = unlinkat(fd, name, AT_REMOVEDIR);
+	mt_end(MC_RMDIR, t, res == -1);
+	if (res == -1 && !keptdir(path, errno) && !redone(path, errno, ENOENT))
+		pathfail(dstroot, path);
 } // dormdir()
 
+int keptdir(const char *path, int err)
+{	/* An rmdir() that failed with err because path holds entries that
+	 * are excluded, and so were never removed, is not a failure.
+	*/
+	if (!cmatch || err != ENOTEMPTY) return 0;
+	evlog(EV_INFO, "kept", "Kept dir, it holds excluded entries: %s/%s",
+			dstroot, path);
+	return 1;
+} // keptdir()
+
+int renamedst(const char *path, const char *to)
+{	/* renameat() with error handling, both paths are in dst. Never
+	 * replaces what is at to, as that was made after the walk. Returns
+	 * 0, or -1 if path was not renamed and so is to be unlinked and to
+	 * linked as though it had not moved.
+	*/
+	mt_done(1);
+	evlog(EV_ACTION, "rename", "Renaming: %s/%s =>\n\t%s/%s", dstroot,
+			path, dstroot, to);
+	uint64_t t = mt_start();
+	int res = renameat2(dstdc->fds[0], path, dstdc->fds[0], to,
+						RENAME_NOREPLACE);
+	mt_end(MC_RENAME, t, res == -1);
+	if (res == 0) return 0;
+	if (errno == EEXIST || errno == EINVAL)	// or no RENAME_NOREPLACE.
+		evlog(EV_INFO, "rename", "Not renamed, %s: %s/%s", strerror(errno),
+				dstroot, to);
+	else
+		pathfail(dstroot, path);
+	return -1;
+} // renamedst()
+
+void makedir(const char *path)
+{	/* mkdir() with error handling, path is in dst */
+	const int crmode = 0775;	// as newdir().
+	mt_done(1);
+	if (ur) {
+		queueop(URING_MKDIRAT, path, 0);
+		ops[nops - 1].mode = crmode;
+		return;
+	}
+	const char *name;
+	int fd = dircache_at(dstdc, path, &name);
+	if (fd == -1) {
+		pathfail(dstroot, path);
+		return;
+	}
+	uint64_t t = mt_start();
+	int res = mkdirat(fd, name, crmode);
+	mt_end(MC_MKDIR, t, res == -1);
+	if (res == -1 && !redone(path, errno, EEXIST)) pathfail(dstroot, path);
+} // makedir()
+
+void queueop(unsigned char op, const char *path, int flags)
+{	/* Add an operation on path to the io_uring batch. The ring works
+	 * on whole relative paths from the root fds: the dircache fds can
+	 * not be used as they may be closed while the op is in flight.
+	*/
+	if (nops == opslimit) {
+		opslimit = (opslimit) ? opslimit * 2 : 4096;
+		ops = realloc(ops, opslimit * sizeof(uring_op));
+		if (!ops) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	uring_op *uo = &ops[nops++];
+	memset(uo, 0, sizeof(uring_op));
+	uo->op = op;
+	uo->flags = flags;
+	if (!opspaths) opspaths = init_arena(1024 * 1024);
+	path = arenastr(opspaths, path);	// in flight after path is reused.
+	if (op == URING_LINKAT) {
+		uo->dirfd = srcdc->fds[0];
+		uo->path = path;
+		uo->dirfd2 = dstdc->fds[0];
+		uo->path2 = path;
+	} else {
+		uo->dirfd = dstdc->fds[0];
+		uo->path = path;
+	}
+} // queueop()
+
+void flushops(void)
+{	/* Run the io_uring batch and report every failure by path. As with
+	 * the blocking syscalls any failure is fatal, but only once the
+	 * whole batch has been reported.
+	*/
+	if (!nops) return;
+	uint64_t t = mt_start();
+	size_t failed = uring_run(ur, ops, nops);
+	mt_end(MC_URING, t, 0);
+	size_t i;
+	if (mtr.on) {	// the ops of the batch by kind.
+		for (i = 0; i < nops; i++) {
+			int call = MC_MKDIR;
+			if (ops[i].op == URING_LINKAT) call = MC_LINK;
+			else if (ops[i].op == URING_UNLINKAT)
+				call = (ops[i].flags & AT_REMOVEDIR) ? MC_RMDIR : MC_UNLINK;
+			mt_count(call, 1, ops[i].res < 0);
+		}
+	}
+	if (failed) flush_evlog();
+	for (i = 0; failed && i < nops; i++) {
+		if (ops[i].res >= 0) continue;
+		if (ops[i].op == URING_LINKAT &&
+			(ops[i].res == -EXDEV || ops[i].res == -EMLINK)) {
+			if (copylink(ops[i].dirfd, ops[i].path, ops[i].dirfd2,
+						ops[i].path2) == 0) {
+				failed--;
+				continue;
+			}
+			ops[i].res = -errno;
+		}
+		if (ops[i].op == URING_UNLINKAT && (ops[i].flags & AT_REMOVEDIR) &&
+			keptdir(ops[i].path, -ops[i].res)) {
+			failed--;
+			continue;
+		}
+		if (redone(ops[i].path, -ops[i].res,
+				(ops[i].op == URING_UNLINKAT) ? ENOENT : EEXIST)) {
+			failed--;
+			continue;
+		}
+		const char *root = dstroot;
+		if (ops[i].op == URING_LINKAT)
+			root = (cpool && ops[i].dirfd == cpool->fd) ?
+					cpool->root : srcroot;
+		fprintf(stderr, "%s/%s: %s\n", root, ops[i].path,
+				strerror(-ops[i].res));
+	}
+	nops = 0;
+	clear_arena(opspaths);
+	if (failed && !keepgoing) exit(EXIT_FAILURE);
+} // flushops()
+
+void writemetrics(int child)
+{	/* Write the metrics if asked for. A child syncing one of several
+	 * destinations writes its own, to the file name with -child put in
+	 * before any extension.
+	*/
+	if (!metricsfn) return;
+	if (!child || strcmp(metricsfn, "-") == 0) {
+		metrics_write(metricsfn);
+		return;
+	}
+	char fn[PATH_MAX];
+	const char *dot = strrchr(metricsfn, '.');
+	const char *slash = strrchr(metricsfn, '/');
+	if (!dot || (slash && dot < slash) || dot == metricsfn) {
+		snprintf(fn, PATH_MAX, "%s-%d", metricsfn, child);
+	} else {
+		snprintf(fn, PATH_MAX, "%.*s-%d%s", (int)(dot - metricsfn),
+					metricsfn, child, dot);
+	}
+	metrics_write(fn);
+} // writemetrics()
+
+void pathfail(const char *root, const char *path)
+{	/* perror() for a path held as root and relative path, then quit
+	 * unless keepgoing.
+	*/
+	int err = errno;
+	flush_evlog();	// so that it follows what was logged before.
+	fprintf(stderr, "%s/%s: %s\n", root, path, strerror(err));
+	if (!keepgoing) exit(EXIT_FAILURE);
+} // pathfail()
+
 void checkarg(char *in, const char *fail)
 {/* in must exist and then test for type */
 	if (!in) {
@@ -0,0 +1,200 @@
+/*    tindex.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of tindex.[h|c] is to keep an on disk index of a walked
+ * tree: every dir with its mtime and ctime and the entries it held.
+ * The next walk maps the index and need not read any dir whose times
+ * have not changed since.
+ * */
+
+#include "dirs.h"
+#include "tindex.h"
+
+static const char timagic[8] = "SLINDEX1";
+
+static int
+tindexsane(tihead *hd, size_t size)
+{ /* Whether the index of size bytes headed by hd is whole and every
+   * offset and count in it lies within it, so that nothing read
+   * through it can stray outside the map. The last string byte being
+   * NUL, each string offset below strsize is a terminated string.
+  */
+	size_t left = size - sizeof(tihead);
+	if (memcmp(hd->magic, timagic, sizeof(timagic)) != 0 ||
+			hd->ndirs > left / sizeof(tidir)) return 0;
+	left -= hd->ndirs * sizeof(tidir);
+	if (hd->nents > left / sizeof(tient)) return 0;
+	left -= hd->nents * sizeof(tient);
+	if (hd->strsize != left || hd->strsize == 0) return 0;
+	tidir *dirs = (tidir *)(hd + 1);
+	tient *ents = (tient *)(dirs + hd->ndirs);
+	char *strs = (char *)(ents + hd->nents);
+	if (strs[hd->strsize - 1] != 0 || hd->root >= hd->strsize) return 0;
+	size_t i;
+	for (i = 0; i < hd->ndirs; i++) {
+		if (dirs[i].path >= hd->strsize || dirs[i].first > hd->nents ||
+				dirs[i].count > hd->nents - dirs[i].first) return 0;
+	}
+	for (i = 0; i < hd->nents; i++)
+		if (ents[i].name >= hd->strsize) return 0;
+	return 1;
+} // tindexsane()
+
+tindex
+*open_tindex(const char *fn, const char *root, uint64_t sig)
+{ /* Map the index in fn. Returns NULL if there is none, or it is not
+   * an index of root made with the same walk filters. Not fatal, the
+   * walk just reads every dir and a new index gets written.
+  */
+	int fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return NULL;
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(tihead)) {
+		close(fd);
+		return NULL;
+	}
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+	tindex *ti = xmalloc(sizeof(tindex));
+	ti->map = map;
+	ti->size = sb.st_size;
+	ti->hd = map;
+	if (!tindexsane(ti->hd, ti->size) || ti->hd->sig != sig) {
+		close_tindex(ti);
+		return NULL;
+	}
+	ti->dirs = (tidir *)(ti->hd + 1);
+	ti->ents = (tient *)(ti->dirs + ti->hd->ndirs);
+	ti->strs = (char *)(ti->ents + ti->hd->nents);
+	if (strcmp(tistr(ti, ti->hd->root), root) != 0) {
+		close_tindex(ti);
+		return NULL;
+	}
+	return ti;
+} // open_tindex()
+
+void
+close_tindex(tindex *ti)
+{
+	munmap(ti->map, ti->size);
+	free(ti);
+} // close_tindex()
+
+char
+*tistr(tindex *ti, uint64_t off)
+{ /* The string at offset off. */
+	return ti->strs + off;
+} // tistr()
+
+tidir
+*tindex_finddir(tindex *ti, const char *path)
+{ /* Binary search for the dir path, relative to the root. Returns NULL
+   * if the index does not have it.
+  */
+	size_t lo = 0, hi = ti->hd->ndirs;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int res = strcmp(tistr(ti, ti->dirs[mid].path), path);
+		if (res == 0) return &ti->dirs[mid];
+		if (res < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return NULL;
+} // tindex_finddir()
+
+static int
+cmpfsdirp(const void *p1, const void *p2)
+{ /* For qsort() on an array of fsdir pointers, by path. */
+	return strcmp((* (fsdir * const *) p1)->path,
+					(* (fsdir * const *) p2)->path);
+} // cmpfsdirp()
+
+static uint64_t
+addstr(mdata *strs, const char *s)
+{ /* Put s in strs, returning its offset. */
+	uint64_t off = strs->to - strs->fro;
+	meminsert(s, strs, 1024 * 1024);
+	return off;
+} // addstr()
+
+void
+writetindex(const char *fn, const char *root, uint64_t sig,
+				struct fslist *fl)
+{ /* Write an index of fl, which must be as recursedir() left it, not
+   * sorted. Dirs changed so recently that a further change would not
+   * alter their times are marked untrusted. The new index replaces
+   * the old one atomically.
+  */
+	size_t i, j;
+	fsdir **dirs = xmalloc((fl->ndirs + 1) * sizeof(fsdir *));
+	for (i = 0; i < fl->ndirs; i++) dirs[i] = &fl->dirs[i];
+	qsort(dirs, fl->ndirs, sizeof(fsdir *), cmpfsdirp);
+	mdata *strs = init_mdata();
+	tihead hd;
+	memset(&hd, 0, sizeof(tihead));
+	memcpy(hd.magic, timagic, sizeof(timagic));
+	hd.sig = sig;
+	hd.root = addstr(strs, root);
+	hd.ndirs = fl->ndirs;
+	tidir *td = xmalloc((fl->ndirs + 1) * sizeof(tidir));
+	tient *te = xmalloc((fl->count + 1) * sizeof(tient));
+	time_t recent = time(NULL) - 2;
+	for (i = 0; i < fl->ndirs; i++) {
+		fsdir *fd = dirs[i];
+		td[i].path = addstr(strs, fd->path);
+		td[i].mtime = fd->mtime.tv_sec;
+		td[i].mtimens = fd->mtime.tv_nsec;
+		td[i].ctime = fd->ctime.tv_sec;
+		td[i].ctimens = fd->ctime.tv_nsec;
+		if (fd->mtime.tv_sec >= recent || fd->ctime.tv_sec >= recent)
+			td[i].mtime = -1;
+		td[i].first = hd.nents;
+		td[i].count = fd->count;
+		for (j = fd->first; j < fd->first + fd->count; j++) {
+			fsent *fe = &fl->ents[j];
+			tient *t = &te[hd.nents++];
+			memset(t, 0, sizeof(tient));
+			t->name = addstr(strs, fe->name);
+			t->ino = fe->ino;
+			t->dev = fe->dev;
+			t->nlink = fe->nlink;
+			t->type = fe->type;
+		}
+	}
+	hd.strsize = strs->to - strs->fro;
+	char tmpfn[PATH_MAX];
+	sprintf(tmpfn, "%s.%d", fn, getpid());
+	FILE *fpo = dofopen(tmpfn, "w");
+	if (fwrite(&hd, sizeof(tihead), 1, fpo) != 1 ||
+		fwrite(td, sizeof(tidir), hd.ndirs, fpo) != hd.ndirs ||
+		fwrite(te, sizeof(tient), hd.nents, fpo) != hd.nents ||
+		fwrite(strs->fro, 1, hd.strsize, fpo) != hd.strsize) {
+		perror(tmpfn);
+		exit(EXIT_FAILURE);
+	}
+	dofclose(fpo);
+	if (rename(tmpfn, fn) == -1) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+	free_mdata(strs);
+	vfree(dirs, td, te, NULL);
+} // writetindex()
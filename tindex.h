@@ -0,0 +1,95 @@
+/*    tindex.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of tindex.[h|c] is to keep an on disk index of a walked
+ * tree: every dir with its mtime and ctime and the entries it held.
+ * The next walk maps the index and need not read any dir whose times
+ * have not changed since.
+ * */
+#ifndef _TINDEX_H
+#define _TINDEX_H
+#define _GNU_SOURCE 1
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include "str.h"
+#include "files.h"
+
+/* On disk layout: a tihead, the tidirs sorted by path, the tients of
+ * each dir together in the order of the dirs, then the strings. All
+ * string fields are offsets into the strings.
+ * */
+
+typedef struct tihead {
+	char magic[8];		// "SLINDEX1"
+	uint64_t sig;		// of the walk filters the index was made with.
+	uint64_t root;		// the walked dir.
+	uint64_t ndirs;
+	uint64_t nents;
+	uint64_t strsize;
+} tihead;
+
+typedef struct tidir {
+	uint64_t path;		// relative to root, "" for root itself.
+	int64_t mtime;		// -1 if not to be trusted.
+	int64_t mtimens;
+	int64_t ctime;
+	int64_t ctimens;
+	uint64_t first;		// index of its first tient.
+	uint64_t count;
+} tidir;
+
+typedef struct tient {
+	uint64_t ino;
+	uint64_t dev;
+	uint64_t name;
+	uint32_t nlink;
+	uint8_t type;
+	uint8_t pad[3];
+} tient;
+
+typedef struct tindex {
+	void *map;
+	size_t size;
+	tihead *hd;
+	tidir *dirs;
+	tient *ents;
+	char *strs;
+} tindex;
+
+struct fslist;
+
+tindex
+*open_tindex(const char *fn, const char *root, uint64_t sig);
+
+void
+close_tindex(tindex *ti);
+
+tidir
+*tindex_finddir(tindex *ti, const char *path);
+
+char
+*tistr(tindex *ti, uint64_t off);
+
+void
+writetindex(const char *fn, const char *root, uint64_t sig,
+				struct fslist *fl);
+
+#endif
@@ -0,0 +1,227 @@
+/*    uring.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of uring.[h|c] is to run batches of file system metadata
+ * operations through io_uring, many in flight at once, instead of one
+ * blocking syscall after another. Talks to the kernel directly so there
+ * is no dependency on liburing.
+ * */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static int
+uring_probe(int fd)
+{ /* Return 1 if the kernel can do every op this module submits. */
+	const unsigned char need[] = { IORING_OP_LINKAT, IORING_OP_UNLINKAT,
+									IORING_OP_MKDIRAT, IORING_OP_STATX };
+	const unsigned nops = 256;
+	size_t len = sizeof(struct io_uring_probe) +
+					nops * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = xmalloc(len);
+	memset(probe, 0, len);
+	int ok = (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+						probe, nops) == 0);
+	size_t i;
+	for (i = 0; ok && i < sizeof(need); i++) {
+		if (need[i] > probe->last_op ||
+			!(probe->ops[need[i]].flags & IO_URING_OP_SUPPORTED)) ok = 0;
+	}
+	free(probe);
+	return ok;
+} // uring_probe()
+
+uring
+*init_uring(unsigned entries)
+{ /* Set up a ring with room for entries submissions. Returns NULL, with
+   * errno set, if io_uring is not available or is too old; the caller
+   * should then do its operations one at a time.
+  */
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd == -1) return NULL;
+	if (!uring_probe(fd)) {
+		close(fd);
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	uring *ur = xmalloc(sizeof(uring));
+	memset(ur, 0, sizeof(uring));
+	ur->fd = fd;
+	ur->sqentries = p.sq_entries;
+	ur->cqentries = p.cq_entries;
+	ur->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cqsize = p.cq_off.cqes +
+					p.cq_entries * sizeof(struct io_uring_cqe);
+	ur->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cqsize > ur->sqsize) ur->sqsize = ur->cqsize;
+		ur->cqsize = 0;	// shares the sq mapping.
+	}
+	ur->sqring = mmap(NULL, ur->sqsize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ur->cqring = (ur->cqsize == 0) ? ur->sqring :
+					mmap(NULL, ur->cqsize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ur->sqes = mmap(NULL, ur->sqesize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ur->sqring == MAP_FAILED || ur->cqring == MAP_FAILED ||
+			ur->sqes == MAP_FAILED) {
+		perror("io_uring mmap");
+		exit(EXIT_FAILURE);
+	}
+	char *sq = ur->sqring;
+	char *cq = ur->cqring;
+	ur->sqhead = (unsigned *)(sq + p.sq_off.head);
+	ur->sqtail = (unsigned *)(sq + p.sq_off.tail);
+	ur->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ur->sqarray = (unsigned *)(sq + p.sq_off.array);
+	ur->cqhead = (unsigned *)(cq + p.cq_off.head);
+	ur->cqtail = (unsigned *)(cq + p.cq_off.tail);
+	ur->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ur->cqes = cq + p.cq_off.cqes;
+	return ur;
+} // init_uring()
+
+void
+free_uring(uring *ur)
+{ /* Tear down what init_uring() set up. */
+	munmap(ur->sqes, ur->sqesize);
+	if (ur->cqsize) munmap(ur->cqring, ur->cqsize);
+	munmap(ur->sqring, ur->sqsize);
+	close(ur->fd);
+	free(ur);
+} // free_uring()
+
+static void
+prepsqe(struct io_uring_sqe *sqe, uring_op *op, size_t i)
+{ /* Fill in a submission queue entry for op, which is ops[i]. */
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->fd = op->dirfd;
+	sqe->addr = (unsigned long)op->path;
+	sqe->user_data = i;
+	switch(op->op) {
+	case URING_LINKAT:
+		sqe->opcode = IORING_OP_LINKAT;
+		sqe->len = op->dirfd2;
+		sqe->addr2 = (unsigned long)op->path2;
+		sqe->hardlink_flags = op->flags;
+		break;
+	case URING_UNLINKAT:
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->unlink_flags = op->flags;
+		break;
+	case URING_MKDIRAT:
+		sqe->opcode = IORING_OP_MKDIRAT;
+		sqe->len = op->mode;
+		break;
+	case URING_STATX:
+		sqe->opcode = IORING_OP_STATX;
+		sqe->len = op->mode;
+		sqe->off = (unsigned long)op->stx;
+		sqe->statx_flags = op->flags;
+		break;
+	}
+} // prepsqe()
+
+size_t
+uring_run(uring *ur, uring_op *ops, size_t n)
+{ /* Submit all n ops, keeping as many in flight as the ring allows,
+   * and wait for them all to complete. Each op's res is set to what
+   * the syscall would have returned, or -errno. The ops may complete
+   * in any order so they must not depend on each other.
+   * Returns the count of ops that failed.
+  */
+	size_t next = 0, done = 0, failed = 0;
+	unsigned inflight = 0, unsubmitted = 0;
+	struct io_uring_sqe *sqes = ur->sqes;
+	struct io_uring_cqe *cqes = ur->cqes;
+	while (done < n) {
+		unsigned tail = *ur->sqtail;
+		unsigned head = __atomic_load_n(ur->sqhead, __ATOMIC_ACQUIRE);
+		while (next < n && inflight < ur->cqentries &&
+				tail - head < ur->sqentries) {
+			unsigned idx = tail & *ur->sqmask;
+			prepsqe(&sqes[idx], &ops[next], next);
+			ur->sqarray[idx] = idx;
+			tail++;
+			next++;
+			inflight++;
+			unsubmitted++;
+		}
+		__atomic_store_n(ur->sqtail, tail, __ATOMIC_RELEASE);
+		int ret = syscall(__NR_io_uring_enter, ur->fd, unsubmitted, 1,
+							IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret == -1) {
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				perror("io_uring_enter");
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			unsubmitted -= ret;
+		}
+		unsigned chead = *ur->cqhead;
+		unsigned ctail = __atomic_load_n(ur->cqtail, __ATOMIC_ACQUIRE);
+		while (chead != ctail) {
+			struct io_uring_cqe *cqe = &cqes[chead & *ur->cqmask];
+			ops[cqe->user_data].res = cqe->res;
+			if (cqe->res < 0) failed++;
+			chead++;
+			inflight--;
+			done++;
+		}
+		__atomic_store_n(ur->cqhead, chead, __ATOMIC_RELEASE);
+	}
+	return failed;
+} // uring_run()
+
+#else	// no io_uring headers at build time.
+
+uring
+*init_uring(unsigned entries)
+{ /* Always unavailable. */
+	(void)entries;
+	errno = ENOSYS;
+	return NULL;
+} // init_uring()
+
+void
+free_uring(uring *ur)
+{
+	free(ur);
+} // free_uring()
+
+size_t
+uring_run(uring *ur, uring_op *ops, size_t n)
+{ /* Never reached, init_uring() never succeeds. */
+	(void)ur;
+	(void)ops;
+	return n;
+} // uring_run()
+
+#endif
@@ -0,0 +1,80 @@
+/*    uring.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of uring.[h|c] is to run batches of file system metadata
+ * operations through io_uring, many in flight at once, instead of one
+ * blocking syscall after another. Talks to the kernel directly so there
+ * is no dependency on liburing.
+ * */
+#ifndef _URING_H
+#define _URING_H
+#define _GNU_SOURCE 1
+
+#include "str.h"
+
+enum {	// uring_op op codes.
+	URING_LINKAT = 1,
+	URING_UNLINKAT,
+	URING_MKDIRAT,
+	URING_STATX
+};
+
+typedef struct uring_op {
+	const char *path;	// the old path for linkat.
+	const char *path2;	// the new path for linkat.
+	int dirfd;
+	int dirfd2;			// for path2.
+	int flags;			// the *at() flags.
+	unsigned mode;		// mkdirat() mode or statx() mask.
+	struct statx *stx;	// statx() result.
+	int res;			// syscall result, or -errno.
+	unsigned char op;
+} uring_op;
+
+typedef struct uring {
+	int fd;
+	unsigned sqentries;
+	unsigned cqentries;
+	unsigned *sqhead;
+	unsigned *sqtail;
+	unsigned *sqmask;
+	unsigned *sqarray;
+	unsigned *cqhead;
+	unsigned *cqtail;
+	unsigned *cqmask;
+	void *sqes;
+	void *cqes;
+	void *sqring;
+	void *cqring;
+	size_t sqsize;
+	size_t cqsize;
+	size_t sqesize;
+} uring;
+
+uring
+*init_uring(unsigned entries);
+
+void
+free_uring(uring *ur);
+
+size_t
+uring_run(uring *ur, uring_op *ops, size_t n);
+
+#endif
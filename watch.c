@@ -0,0 +1,247 @@
+/*    watch.c
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of watch.[h|c] is to follow the changes made to a tree
+ * through inotify, reporting which of its dirs have had entries made,
+ * removed or renamed since the last look.
+ * Every dir has its own watch, added as the dir is found. Changes to
+ * the contents of files are not watched; a hard link shares them.
+ * */
+
+#include "watch.h"
+
+static const uint32_t wmask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+				IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+static void
+setpath(watcher *w, int wd, const char *path)
+{ /* Record that wd watches path. A dir renamed within the tree keeps
+   * its wd, so it may already be known under its old name.
+  */
+	if (wd >= w->limit) {
+		int old = w->limit;
+		while (wd >= w->limit) w->limit = (w->limit) ? w->limit * 2 : 1024;
+		w->paths = realloc(w->paths, w->limit * sizeof(char *));
+		if (!w->paths) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		memset(w->paths + old, 0, (w->limit - old) * sizeof(char *));
+	}
+	free(w->paths[wd]);
+	w->paths[wd] = xstrdup((char *)path);
+} // setpath()
+
+static void
+watchtree(watcher *w, char *path)
+{ /* Watch the dir path, relative to the root, and every dir below it.
+   * Path is a PATH_MAX buffer. Dirs gone before they are reached are
+   * skipped, the events for their removal are on the way.
+  */
+	if (w->match && *path && match_path(w->match, path, 1)) return;
+	char full[PATH_MAX];
+	strcpy(full, w->root);
+	if (*path) strjoin(full, '/', path, PATH_MAX);
+	int wd = inotify_add_watch(w->fd, full, wmask);
+	if (wd == -1) {
+		if (errno == ENOENT || errno == ENOTDIR) return;
+		if (errno == ENOSPC) {
+			fprintf(stderr, "%s: out of inotify watches, raise "
+					"fs.inotify.max_user_watches\n", full);
+		} else {
+			perror(full);
+		}
+		exit(EXIT_FAILURE);
+	}
+	setpath(w, wd, path);
+	DIR *dp = opendir(full);
+	if (!dp) return;
+	size_t plen = strlen(path);
+	struct dirent *dent;
+	while ((dent = readdir(dp))) {
+		if (dent->d_type == DT_UNKNOWN) {	// no d_type on this fs.
+			struct stat sb;
+			if (fstatat(dirfd(dp), dent->d_name, &sb,
+						AT_SYMLINK_NOFOLLOW) == -1 ||
+				!S_ISDIR(sb.st_mode)) continue;
+		} else if (dent->d_type != DT_DIR) {
+			continue;
+		}
+		if (strcmp(dent->d_name, ".") == 0) continue;
+		if (strcmp(dent->d_name, "..") == 0) continue;
+		strjoin(path, (plen) ? '/' : 0, dent->d_name, PATH_MAX);
+		watchtree(w, path);
+		path[plen] = 0;
+	}
+	closedir(dp);
+} // watchtree()
+
+watcher
+*init_watcher(const char *root, matcher *match)
+{ /* Watch every dir in the tree at root that match does not exclude,
+   * match may be NULL.
+  */
+	watcher *w = xmalloc(sizeof(watcher));
+	memset(w, 0, sizeof(watcher));
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd == -1) {
+		perror("inotify_init1");
+		exit(EXIT_FAILURE);
+	}
+	w->root = xstrdup((char *)root);
+	w->match = match;
+	rewatch(w);
+	return w;
+} // init_watcher()
+
+void
+free_watcher(watcher *w)
+{
+	int i;
+	for (i = 0; i < w->limit; i++) free(w->paths[i]);
+	size_t j;
+	for (j = 0; j < w->ndirty; j++) free(w->dirty[j]);
+	close(w->fd);
+	free(w->paths);
+	free(w->dirty);
+	free(w->root);
+	free(w);
+} // free_watcher()
+
+void
+rewatch(watcher *w)
+{ /* Watch the whole tree again, after an overflow when dirs may have
+   * been made that no event was had for. Dirs already watched keep
+   * their wd.
+  */
+	char path[PATH_MAX] = {0};
+	watchtree(w, path);
+} // rewatch()
+
+static void
+adddirty(watcher *w, const char *path)
+{ /* Note that the entries of path have changed. */
+	if (w->ndirty && strcmp(w->dirty[w->ndirty - 1], path) == 0) return;
+	if (w->ndirty == w->dlimit) {
+		w->dlimit = (w->dlimit) ? w->dlimit * 2 : 256;
+		w->dirty = realloc(w->dirty, w->dlimit * sizeof(char *));
+		if (!w->dirty) {
+			fputs("Out of memory.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	w->dirty[w->ndirty++] = xstrdup((char *)path);
+} // adddirty()
+
+static void
+readevents(watcher *w)
+{ /* Take every event queued and note the dirs they are in. */
+	char buf[65536]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1) {
+		ssize_t len = read(w->fd, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EINTR) return;
+			perror("inotify read");
+			exit(EXIT_FAILURE);
+		}
+		char *cp;
+		struct inotify_event *ev;
+		for (cp = buf; cp < buf + len; cp += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)cp;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				w->overflow = 1;
+				continue;
+			}
+			if (ev->wd < 0 || ev->wd >= w->limit || !w->paths[ev->wd])
+				continue;
+			if (ev->mask & IN_IGNORED) {	// the dir has gone.
+				free(w->paths[ev->wd]);
+				w->paths[ev->wd] = NULL;
+				continue;
+			}
+			char *dir = w->paths[ev->wd];
+			if ((ev->mask & IN_ISDIR) &&
+				(ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+				char path[PATH_MAX];
+				strcpy(path, dir);
+				strjoin(path, (*dir) ? '/' : 0, ev->name, PATH_MAX);
+				watchtree(w, path);
+				dir = w->paths[ev->wd];	// setpath() may move paths.
+			}
+			adddirty(w, dir);
+		}
+	}
+} // readevents()
+
+static long
+elapsed(struct timespec *since)
+{ /* Milliseconds since since. */
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 +
+			(now.tv_nsec - since->tv_nsec) / 1000000;
+} // elapsed()
+
+static int
+cmpstrp(const void *p1, const void *p2)
+{
+	return strcmp(* (char * const *) p1, * (char * const *) p2);
+} // cmpstrp()
+
+int
+watch_wait(watcher *w, int timeout, int settle)
+{ /* Wait up to timeout ms, -1 for ever, for the tree to change. Then
+   * go on collecting changes until there have been none for settle ms,
+   * or for at most ten times that on a tree that never settles, so
+   * that a burst of changes to a dir is synced once.
+   * Returns the count of dirs in w->dirty, 0 if nothing changed or -1
+   * if events were lost and the whole tree must be synced.
+  */
+	size_t i;
+	for (i = 0; i < w->ndirty; i++) free(w->dirty[i]);
+	w->ndirty = 0;
+	w->overflow = 0;
+	struct pollfd pf = { .fd = w->fd, .events = POLLIN };
+	int res = poll(&pf, 1, timeout);
+	if (res == -1 && errno != EINTR) {
+		perror("poll");
+		exit(EXIT_FAILURE);
+	}
+	if (res <= 0) return 0;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		readevents(w);
+		if (elapsed(&start) >= 10L * settle) break;
+	} while (poll(&pf, 1, settle) > 0);
+	if (w->overflow) return -1;
+	qsort(w->dirty, w->ndirty, sizeof(char *), cmpstrp);
+	size_t j = 0;
+	for (i = 0; i < w->ndirty; i++) {
+		if (j && strcmp(w->dirty[j - 1], w->dirty[i]) == 0) {
+			free(w->dirty[i]);
+			continue;
+		}
+		w->dirty[j++] = w->dirty[i];
+	}
+	w->ndirty = j;
+	return (int)w->ndirty;
+} // watch_wait()
@@ -0,0 +1,59 @@
+/*    watch.h
+ *
+ * Copyright 2017 Robert L (Bob) Parker rlp1938@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The purpose of watch.[h|c] is to follow the changes made to a tree
+ * through inotify, reporting which of its dirs have had entries made,
+ * removed or renamed since the last look.
+ * */
+#ifndef _WATCH_H
+#define _WATCH_H
+#define _GNU_SOURCE 1
+
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include "str.h"
+#include "dirs.h"
+
+typedef struct watcher {
+	int fd;			// the inotify instance.
+	char *root;
+	matcher *match;	// dirs it excludes are not watched, NULL for none.
+	char **paths;	// paths[wd] is the dir watched by wd, rel to root.
+	int limit;		// size of paths.
+	char **dirty;	// dirs changed, sorted, no duplicates.
+	size_t ndirty;
+	size_t dlimit;
+	int overflow;	// events were lost, the whole tree may differ.
+} watcher;
+
+watcher
+*init_watcher(const char *root, matcher *match);
+
+void
+free_watcher(watcher *w);
+
+void
+rewatch(watcher *w);
+
+int
+watch_wait(watcher *w, int timeout, int settle);
+
+#endif